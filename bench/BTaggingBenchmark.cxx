@@ -0,0 +1,288 @@
+//
+// BTaggingBenchmark
+//
+// Microbenchmarks of BTagCalibration, BTagCalibrationReader and BTaggingScaleTool with the
+// csv and efficiency files of this package and a reproducible synthetic jet sample.
+//
+// usage: BTaggingBenchmark [nJets] [seed]
+//
+// Prints one JSON object per line and benchmark, e.g.
+//   {"benchmark":"reader_eval","file":"CSVv2_Moriond17_B_H.csv","ns_per_jet":21.3,"jets_per_s":4.7e+07}
+// and, at the end, the peak resident set size of the process. Startup benchmarks report
+// "ms" instead of "ns_per_jet".
+//
+
+// STL include(s):
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// System include(s):
+#include <sys/resource.h>
+
+// ROOT include(s):
+#include <TList.h>
+
+// SFrame include(s):
+#include "core/include/SCycleBase.h"
+#include "core/include/SInputData.h"
+
+#include "include/BTagCalibrationStandalone.h"
+#include "include/BTaggingLogger.h"
+#include "include/BTaggingScaleTool.h"
+#include "test/BTaggingTestUZHJets.h"
+
+namespace {
+
+  typedef std::chrono::steady_clock Clock;
+
+  double elapsedNs( const Clock::time_point& start ) {
+    return std::chrono::duration<double, std::nano>( Clock::now() - start ).count();
+  }
+
+  using BTaggingTest::JetSample;
+  using BTaggingTest::makeJets;
+
+  void report( const std::string& benchmark, const std::string& file, double nsPerJet ) {
+    std::printf( "{\"benchmark\":\"%s\",\"file\":\"%s\",\"ns_per_jet\":%.2f,\"jets_per_s\":%.4g}\n",
+                 benchmark.c_str(), file.c_str(), nsPerJet, 1e9 / nsPerJet );
+  }
+
+  void reportStartup( const std::string& benchmark, const std::string& file, double ms ) {
+    std::printf( "{\"benchmark\":\"%s\",\"file\":\"%s\",\"ms\":%.3f}\n", benchmark.c_str(), file.c_str(), ms );
+  }
+
+  /// keeps the results alive, so that the compiler cannot drop the loops
+  double g_sink = 0.;
+
+  /// cycle without event loop, owning the histograms booked by the tool
+  class BenchmarkCycle : public SCycleBase {
+  public:
+    BenchmarkCycle() { SetHistOutput( &m_output ); }
+    virtual void BeginCycle() throw( SError ) {}
+    virtual void EndCycle() throw( SError ) {}
+    virtual void BeginInputData( const SInputData& ) throw( SError ) {}
+    virtual void EndInputData( const SInputData& ) throw( SError ) {}
+    virtual void BeginMasterInputData( const SInputData& ) throw( SError ) {}
+    virtual void EndMasterInputData( const SInputData& ) throw( SError ) {}
+    virtual void BeginInputFile( const SInputData& ) throw( SError ) {}
+    virtual void ExecuteEvent( const SInputData&, Double_t ) throw( SError ) {}
+  private:
+    TList m_output;
+  };
+
+  /// cheap per-jet function (a scale factor lookup) with 0, 1 or 12 DEBUG statements: with
+  /// DEBUG output off, the cost should not depend on their number. 0 statements is what every
+  /// variant becomes with -DBTAGGING_MIN_LOG_LEVEL=3.
+  class LoggingProbe {
+  public:
+    LoggingProbe( const BTaggingScaleFactors& sf, bool debugOutput ):
+      m_logger( "LoggingProbe" ), m_debugOutput( debugOutput ), m_sf( sf ) {}
+
+    __attribute__(( noinline )) double weight0( const double& pt, const double& eta, const int& flavour, bool isTagged ) {
+      return m_sf.reader().eval( BTaggingScaleFactors::jetFlavor( flavour ), eta, pt ) * (isTagged ? 1. : 0.5);
+    }
+
+    __attribute__(( noinline )) double weight1( const double& pt, const double& eta, const int& flavour, bool isTagged ) {
+      BTAG_DEBUG_SCOPE;
+      const double jetweight = m_sf.reader().eval( BTaggingScaleFactors::jetFlavor( flavour ), eta, pt ) * (isTagged ? 1. : 0.5);
+      BTAG_REPORT_DEBUG( "flavor " << flavour << ", pt " << pt << ", eta " << eta << ", tagged " << isTagged << ", jetweight " << jetweight );
+      return jetweight;
+    }
+
+    __attribute__(( noinline )) double weight12( const double& pt, const double& eta, const int& flavour, bool isTagged ) {
+      BTAG_DEBUG_SCOPE;
+      BTAG_REPORT_DEBUG( "LoggingProbe::weight12" );
+      BTAG_REPORT_DEBUG( "pt " << pt );
+      BTAG_REPORT_DEBUG( "eta " << eta );
+      BTAG_REPORT_DEBUG( "flavour " << flavour );
+      BTAG_REPORT_DEBUG( "tagged " << isTagged );
+      BTAG_REPORT_DEBUG( "cut " << m_sf.workingPointCut() );
+      const double jetweight = m_sf.reader().eval( BTaggingScaleFactors::jetFlavor( flavour ), eta, pt ) * (isTagged ? 1. : 0.5);
+      BTAG_REPORT_DEBUG( "jetweight " << jetweight );
+      BTAG_REPORT_DEBUG( "flavor " << flavour << ", pt " << pt << ", eta " << eta << ", tagged " << isTagged << ", jetweight " << jetweight );
+      BTAG_REPORT_DEBUG( "in tracker " << (std::fabs( eta ) <= 2.4) );
+      BTAG_REPORT_DEBUG( "efficiency flavour " << BTaggingScaleFactors::effFlavour( flavour ) );
+      BTAG_REPORT_DEBUG( "scale factor flavour " << BTaggingScaleFactors::jetFlavor( flavour ) );
+      BTAG_REPORT_DEBUG( "LoggingProbe::weight12 done" );
+      return jetweight;
+    }
+
+  private:
+    SLogger m_logger;
+    bool m_debugOutput;
+    const BTaggingScaleFactors& m_sf;
+  };
+
+  /// csv file with the measurement types used for it
+  struct CalibrationFile {
+    const char* name;
+    const char* measurementType_bc;
+    const char* measurementType_udsg;
+  };
+
+} // namespace
+
+
+int main( int argc, char** argv ) {
+
+  const size_t nJets = argc > 1 ? std::strtoul( argv[1], 0, 10 ) : 1000000;
+  const unsigned seed = argc > 2 ? std::strtoul( argv[2], 0, 10 ) : 12345;
+  const char* sframe_dir = std::getenv( "SFRAME_DIR" );
+  if (!sframe_dir) {
+    std::fprintf( stderr, "SFRAME_DIR is not set\n" );
+    return 1;
+  }
+  const std::string csvDir = std::string( sframe_dir ) + "/../BTaggingTools/csv/";
+  const JetSample jets = makeJets( nJets, seed );
+
+  const CalibrationFile files[] = {
+    { "subjet_CSVv2_Moriond17_B_H.csv", "lt", "incl" },
+    { "CSVv2_Moriond17_B_H.csv", "mujets", "incl" },
+  };
+  const BTagEntry::JetFlavor flavors[] = { BTagEntry::FLAV_B, BTagEntry::FLAV_C, BTagEntry::FLAV_UDSG };
+
+  for (size_t f = 0; f < sizeof( files ) / sizeof( files[0] ); ++f) {
+    const std::string path = csvDir + files[f].name;
+
+    Clock::time_point start = Clock::now();
+    BTagCalibration calib( "CSVv2", path );
+    reportStartup( "calibration_construct", files[f].name, elapsedNs( start ) * 1e-6 );
+
+    start = Clock::now();
+    BTagCalibration calibOnDemand( "CSVv2", path, BTagCalibration::LOAD_ON_DEMAND );
+    reportStartup( "calibration_construct_on_demand", files[f].name, elapsedNs( start ) * 1e-6 );
+
+    start = Clock::now();
+    BTagCalibrationReader reader( BTagEntry::OP_LOOSE, "central", {"up", "down"} );
+    for (int i = 0; i < 3; ++i) {
+      reader.load( calib, flavors[i], flavors[i] == BTagEntry::FLAV_UDSG ? files[f].measurementType_udsg : files[f].measurementType_bc );
+    }
+    reportStartup( "reader_load", files[f].name, elapsedNs( start ) * 1e-6 );
+
+    start = Clock::now();
+    for (size_t i = 0; i < nJets; ++i) {
+      g_sink += reader.eval( jets.flavor[i], jets.eta[i], jets.pt[i] );
+    }
+    report( "reader_eval", files[f].name, elapsedNs( start ) / nJets );
+
+    double sf[3];
+    start = Clock::now();
+    for (size_t i = 0; i < nJets; ++i) {
+      reader.eval_all( jets.flavor[i], jets.eta[i], jets.pt[i], 0., sf );
+      g_sink += sf[0] + sf[1] + sf[2];
+    }
+    report( "reader_eval_all", files[f].name, elapsedNs( start ) / nJets );
+
+    std::vector<double> out( nJets );
+    start = Clock::now();
+    reader.eval_batch( nJets, &jets.flavor[0], &jets.eta[0], &jets.pt[0], 0, &out[0] );
+    report( "reader_eval_batch", files[f].name, elapsedNs( start ) / nJets );
+    g_sink += out[nJets / 2];
+
+    start = Clock::now();
+    for (size_t i = 0; i < nJets; ++i) {
+      const std::pair<float, float> bounds = reader.min_max_pt( jets.flavor[i], std::fabs( jets.eta[i] ) );
+      g_sink += bounds.first + bounds.second;
+    }
+    report( "reader_min_max_pt", files[f].name, elapsedNs( start ) / nJets );
+  }
+
+  // scale factor tool with its default configuration (csv and efficiency files of this package)
+  BenchmarkCycle cycle;
+  BTaggingScaleTool tool( &cycle );
+  SInputData id( "Benchmark" );
+
+  Clock::time_point start = Clock::now();
+  tool.BeginInputData( id );
+  reportStartup( "tool_begin_input_data", "", elapsedNs( start ) * 1e-6 );
+
+  start = Clock::now();
+  for (size_t i = 0; i < nJets; ++i) {
+    g_sink += tool.getScaleFactor( jets.pt[i], jets.eta[i], jets.hadronFlavour[i], tool.isTagged( jets.csv[i] ) );
+  }
+  report( "tool_get_scale_factor", "", elapsedNs( start ) / nJets );
+
+  // jets with two softdrop subjets each, made of the synthetic jets: per jet, and for events of two
+  // jets, whose subjets are looked up together as structure of arrays; ns per subjet
+  const size_t nFatJets = nJets / 3;
+  const BTaggingTest::UZHJetSample fatJets( jets, nFatJets, 2 );
+  const std::vector<UZH::JetVec> events = fatJets.events( 2 );
+  const double nSubjets = 2. * nFatJets;
+  const double nEventSubjets = 4. * events.size();
+
+  start = Clock::now();
+  for (size_t i = 0; i < nFatJets; ++i) {
+    g_sink += tool.getSoftdropSubjetScaleFactor( fatJets.jets()[i] );
+  }
+  report( "tool_get_softdrop_subjet_scale_factor", "", elapsedNs( start ) / nSubjets );
+
+  start = Clock::now();
+  for (size_t i = 0; i < events.size(); ++i) {
+    g_sink += tool.getSoftdropSubjetScaleFactor( events[i] );
+  }
+  report( "tool_get_softdrop_subjet_scale_factor_event", "", elapsedNs( start ) / nEventSubjets );
+
+  start = Clock::now();
+  for (size_t i = 0; i < events.size(); ++i) {
+    g_sink += tool.getSoftdropSubjetScaleFactor( events[i], 1., 0. );
+  }
+  report( "tool_get_softdrop_subjet_scale_factor_event_bc_up", "", elapsedNs( start ) / nEventSubjets );
+
+  start = Clock::now();
+  for (size_t i = 0; i < events.size(); ++i) {
+    const BTaggingScaleTool::ScaleFactorWeights weights = tool.getSoftdropSubjetScaleFactors( events[i] );
+    g_sink += weights.nominal + weights.bc_up + weights.udsg_down;
+  }
+  report( "tool_get_softdrop_subjet_scale_factors_event", "", elapsedNs( start ) / nEventSubjets );
+
+  start = Clock::now();
+  for (size_t i = 0; i < nJets; ++i) {
+    g_sink += tool.getScaleFactor( jets.pt[i], jets.eta[i], jets.hadronFlavour[i], tool.isTagged( jets.csv[i] ), 1., 0. )
+            + tool.getScaleFactor( jets.pt[i], jets.eta[i], jets.hadronFlavour[i], tool.isTagged( jets.csv[i] ), -1., 0. );
+  }
+  report( "tool_get_scale_factor_bc_up_down", "", elapsedNs( start ) / nJets );
+
+  // cost of DEBUG statements with DEBUG output off (never set, but unknown to the compiler)
+  BTaggingScaleFactors probeScaleFactors;
+  probeScaleFactors.setReader( BTagCalibrationRegistry::reader( "CSVv2", csvDir + "CSVv2_Moriond17_B_H.csv", BTagEntry::OP_MEDIUM,
+                                                                "mujets", "incl", "central", {"up", "down"} ), 0.8484 );
+  LoggingProbe probe( probeScaleFactors, std::getenv( "BTAGGING_BENCHMARK_DEBUG" ) != 0 );
+  start = Clock::now();
+  for (size_t i = 0; i < nJets; ++i) {
+    g_sink += probe.weight0( jets.pt[i], jets.eta[i], jets.hadronFlavour[i], jets.csv[i] > 0.8484 );
+  }
+  report( "debug_statements_0", "", elapsedNs( start ) / nJets );
+  start = Clock::now();
+  for (size_t i = 0; i < nJets; ++i) {
+    g_sink += probe.weight1( jets.pt[i], jets.eta[i], jets.hadronFlavour[i], jets.csv[i] > 0.8484 );
+  }
+  report( "debug_statements_1", "", elapsedNs( start ) / nJets );
+  start = Clock::now();
+  for (size_t i = 0; i < nJets; ++i) {
+    g_sink += probe.weight12( jets.pt[i], jets.eta[i], jets.hadronFlavour[i], jets.csv[i] > 0.8484 );
+  }
+  report( "debug_statements_12", "", elapsedNs( start ) / nJets );
+
+  tool.bookHistograms();
+  start = Clock::now();
+  for (size_t i = 0; i < nJets; ++i) {
+    tool.fillEfficiency( jets.pt[i], jets.eta[i], jets.hadronFlavour[i], tool.isTagged( jets.csv[i] ) );
+  }
+  report( "tool_fill_efficiency", "", elapsedNs( start ) / nJets );
+
+  start = Clock::now();
+  tool.EndInputData( id );
+  reportStartup( "tool_end_input_data", "", elapsedNs( start ) * 1e-6 );
+
+  struct rusage usage;
+  getrusage( RUSAGE_SELF, &usage );
+  std::printf( "{\"benchmark\":\"peak_rss\",\"jets\":%lu,\"seed\":%u,\"kb\":%ld,\"checksum\":%.6g}\n",
+               (unsigned long) nJets, seed, usage.ru_maxrss, g_sink );
+
+  return 0;
+
+}
@@ -1,3 +1,82 @@
+#ifndef BTagFormula_H
+#define BTagFormula_H
+
+/**
+ * BTagFormula
+ *
+ * Compiles the formula string of a BTagEntry into a small bytecode that is
+ * evaluated without ROOT. Understood are numbers, x, + - * /, comparisons,
+ * && || !, the ternary step functions made from histograms and the usual
+ * math functions (log, exp, sqrt, pow, ...). compile() returns false for
+ * anything else (e.g. '^'); the caller should fall back to TF1 then.
+ *
+ ************************************************************/
+
+#include <memory>
+#include <string>
+#include <vector>
+
+
+class BTagFormula
+{
+public:
+  enum OpCode {
+    PUSH_CONST=0, PUSH_X,
+    ADD, SUB, MUL, DIV,
+    ADD_CONST, MUL_CONST, SUB_CONST, RSUB_CONST, DIV_CONST, RDIV_CONST,
+    NEG, NOT, LT, LE, GT, GE, EQ, NE, AND, OR,
+    LOG, LOG10, EXP, SQRT, ABS, POW, MIN, MAX,
+    JUMP_IF_FALSE, JUMP,
+  };
+  struct Instruction {
+    int op;
+    int arg;                                     // jump target
+    double value;                                // constant operand
+  };
+
+  BTagFormula(): mapped_(0), mappedSize_(0), stackSize_(0), hasJumps_(false) {}
+
+  bool compile(const std::string &formula);
+  double eval(double x) const;
+
+  // takes over bytecode made by compile() before (e.g. from a cache file);
+  // returns false, and stays empty, if the code is not consistent
+  bool assign(const Instruction *code, int size);
+
+  // as assign(), but without copying: the code stays where it is (e.g. in a
+  // mapped cache file) and owner keeps it alive as long as this formula
+  bool reference(const Instruction *code, int size,
+                 const std::shared_ptr<const void> &owner);
+
+  // evaluates n values at once; branch free formulas run the bytecode on
+  // blocks of kBatchSize values, in loops the compiler can vectorize
+  void eval_batch(const double *x, double *out, int n) const;
+
+  bool empty() const {return codeSize() == 0;}
+  bool hasJumps() const {return hasJumps_;}
+  const Instruction* codeData() const {
+    return owner_ ? mapped_ : (code_.empty() ? 0 : &code_[0]);
+  }
+  int codeSize() const {return owner_ ? mappedSize_ : int(code_.size());}
+
+  static const int kMaxStackSize = 32;
+  static const int kBatchSize = 64;
+
+protected:
+  bool check(const Instruction *code, int size);
+
+  std::vector<Instruction> code_;
+  const Instruction *mapped_;                    // code of reference()
+  int mappedSize_;
+  std::shared_ptr<const void> owner_;
+  int stackSize_;
+  bool hasJumps_;
+
+};
+
+#endif  // BTagFormula_H
+
+
 #ifndef BTagEntry_H
 #define BTagEntry_H
 
@@ -62,25 +141,31 @@ public:
 
   };
 
-  BTagEntry() {}
+  BTagEntry(): csvLine(0) {}
   BTagEntry(const std::string &csvLine);
   BTagEntry(const std::string &func, Parameters p);
   BTagEntry(const TF1* func, Parameters p);
   BTagEntry(const TH1* histo, Parameters p);
-  ~BTagEntry() {}
   static std::string makeCSVHeader();
   std::string makeCSVLine() const;
   static std::string trimStr(std::string str);
 
+  // parses the csv line [begin, end) in place; used by BTagCalibration to
+  // skip the formula check, which the reader does when it loads the entry
+  void parseCSVLine(const char *begin, const char *end, bool checkFormula);
+
   // public, no getters needed
   std::string formula;
   Parameters params;
+  BTagFormula compiled;                          // empty if not compiled yet
+  unsigned csvLine;                              // line in the csv, 0 if none
 
 };
 
 #endif  // BTagEntry_H
 
 
+
 #ifndef BTagCalibration_H
 #define BTagCalibration_H
 
@@ -96,6 +181,27 @@ public:
  *           - by eta bin
  *             - as 1D-function dependent of pt or discriminant
  *
+ * Parsing a csv file (and compiling its formulas) can be skipped with a
+ * binary cache file: it holds the parsed entries together with their
+ * compiled formulas and the checksum of the csv it was made from. It is
+ * only used if the checksum still matches; otherwise the csv is parsed and
+ * the cache is written anew. A cache file stays mapped as long as the
+ * calibration: readers take the records and their bytecode from the mapping
+ * (getEntryRefs()), only getEntries() turns them into BTagEntry objects.
+ *
+ * With LOAD_ON_DEMAND only the first three columns of the csv are read at
+ * first, to find the lines of each (OperatingPoint, measurementType,
+ * sysType). These lines are parsed when getEntries() asks for them, so
+ * errors in lines that are never asked for go unnoticed. The const methods
+ * parse under a mutex of the calibration, so it can still be shared by
+ * several threads (e.g. through BTagCalibrationRegistry).
+ *
+ * getEntries() returns references into the calibration, so once it has
+ * been called the calibration is considered shared: addEntry(), readCSV(),
+ * readCache() and operator= throw from then on instead of moving the
+ * entries under a reader in another thread. Fill a calibration completely
+ * before handing it to readers.
+ *
  ************************************************************/
 
 #include <map>
@@ -103,14 +209,30 @@ public:
 #include <string>
 #include <istream>
 #include <ostream>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
 
 
 class BTagCalibration
 {
 public:
-  BTagCalibration() {}
+  enum LoadMode {
+    LOAD_ALL=0,
+    LOAD_ON_DEMAND=1,
+  };
+
+  BTagCalibration(): shared_(false) {}
   BTagCalibration(const std::string &tagger);
   BTagCalibration(const std::string &tagger, const std::string &filename);
+  BTagCalibration(const std::string &tagger,
+                  const std::string &filename,
+                  LoadMode mode);
+  BTagCalibration(const std::string &tagger,
+                  const std::string &filename,
+                  const std::string &cacheFile);
+  BTagCalibration(const BTagCalibration &other);
+  BTagCalibration& operator=(const BTagCalibration &other);
   ~BTagCalibration() {}
 
   std::string tagger() const {return tagger_;}
@@ -118,16 +240,71 @@ public:
   void addEntry(const BTagEntry &entry);
   const std::vector<BTagEntry>& getEntries(const BTagEntry::Parameters &par) const;
 
+  // what a reader needs of an entry, without copying its strings: formula
+  // and bytecode point into the mapped cache file or into the BTagEntry
+  struct EntryRef {
+    BTagEntry::JetFlavor jetFlavor;
+    float etaMin;
+    float etaMax;
+    float ptMin;
+    float ptMax;
+    float discrMin;
+    float discrMax;
+    const char *formula;
+    size_t formulaSize;
+    BTagFormula compiled;                        // empty if not compiled yet
+    unsigned csvLine;
+    const BTagEntry *entry;                      // 0 for cache records
+  };
+  // same entries as getEntries(), and also marks the calibration shared
+  std::vector<EntryRef> getEntryRefs(const BTagEntry::Parameters &par) const;
+
   void readCSV(std::istream &s);
   void readCSV(const std::string &s);
+  void readCSV(const char *data, size_t size);
   void makeCSV(std::ostream &s) const;
   std::string makeCSV() const;
 
+  // binary cache, see above; readCache() returns false (and leaves this
+  // object untouched) if the file is missing, damaged, of another version
+  // or made from another csv
+  bool readCache(const std::string &cacheFile, uint64_t csvChecksum);
+  bool writeCache(const std::string &cacheFile, uint64_t csvChecksum) const;
+  static uint64_t checksum(const std::string &csvContent);
+  static uint64_t checksum(const char *data, size_t size);
+
+  static const uint32_t kCacheVersion = 2;
+
 protected:
   static std::string token(const BTagEntry::Parameters &par);
+  void readCSV(const char *data, size_t size, bool onDemand);
+  void addCSVLine(const char *begin, const char *end, unsigned lineNumber);
+  void indexCSVLine(const char *begin, const char *end, unsigned lineNumber);
+  void parseOnDemand(const std::string &tok) const;
+  void parseAll() const;
+  void checkNotShared(const char *method) const;  // call with parseMutex_
+  BTagEntry cachedEntry(uint32_t record) const;
+  EntryRef cachedEntryRef(uint32_t record) const;
 
   std::string tagger_;
-  std::map<std::string, std::vector<BTagEntry> > data_;
+  mutable std::map<std::string, std::vector<BTagEntry> > data_;
+
+  // LOAD_ON_DEMAND: lines in csvData_ not parsed yet, by token
+  struct UnparsedLine {
+    size_t offset;
+    size_t size;
+    unsigned number;                             // line number in the csv
+  };
+  mutable std::map<std::string, std::vector<UnparsedLine> > unparsed_;
+  mutable std::shared_ptr<const char> csvData_;
+
+  // cache file: records not turned into BTagEntry objects yet, by token
+  mutable std::map<std::string, std::vector<uint32_t> > cached_;
+
+  mutable bool shared_;                          // getEntries() was called
+  mutable std::mutex parseMutex_;                // guards the five above
+
+  std::shared_ptr<const char> cacheData_;        // whole mapped cache file
 
 };
 
@@ -141,12 +318,26 @@ protected:
  * BTagCalibrationReader
  *
  * Helper class to pull out a specific set of BTagEntry's out of a
- * BTagCalibration. TF1 functions are set up at initialization time.
+ * BTagCalibration. Formulas are compiled at initialization time (with
+ * BTagFormula, or as TF1 if BTagFormula does not understand them).
+ *
+ * Any number of sysTypes can be loaded into one reader. They share the bin
+ * lookup, so eval_all() returns all variations for the cost of one search.
+ *
+ * Thread safety: once loaded, a reader is not changed by any of its const
+ * methods, and they keep their scratch space on the stack. They can be
+ * called concurrently from any number of threads without locking. The only
+ * exception are formulas that BTagFormula does not understand: their TF1
+ * changes state in Eval(), so it is guarded by a mutex. lockFree() tells
+ * whether such formulas were loaded (never the case for the csv files in
+ * this package). load() and setTabulation() must not run concurrently with
+ * anything else.
  *
  ************************************************************/
 
 #include <memory>
 #include <string>
+#include <vector>
 
 
 
@@ -155,21 +346,91 @@ class BTagCalibrationReader
 public:
   BTagCalibrationReader() {}
   BTagCalibrationReader(BTagEntry::OperatingPoint op,
-                        std::string sysType="central");
+                        const std::string & sysType="central",
+                        const std::vector<std::string> & otherSysTypes=std::vector<std::string>());
+
+  // Optional, call before load(): samples every formula on a grid that is
+  // refined until linear (or cubic) interpolation is guaranteed to deviate
+  // less than maxAbsError from the formula anywhere in its range. The bound
+  // uses interval enclosures of the second (cubic: up to the fourth)
+  // derivative per grid interval and includes the rounding of the stored
+  // doubles. Entries that cannot be bounded (steps, kinks, TF1 formulas) or
+  // do not converge within 4096 grid intervals keep the formula.
+  void setTabulation(double maxAbsError, bool cubic=false);
 
   void load(const BTagCalibration & c,
             BTagEntry::JetFlavor jf,
             std::string measurementType="comb");
 
+  // max. error bound of the tables of this flavor (see setTabulation), 0 if
+  // nothing is tabulated
+  double tabulationError(BTagEntry::JetFlavor jf) const;
+
+  // evaluates the first sysType
   double eval(BTagEntry::JetFlavor jf,
               float eta,
               float pt,
               float discr=0.) const;
 
+  // evaluates all sysTypes with a single bin lookup; out must hold
+  // sysTypes().size() values, in the order of sysTypes()
+  void eval_all(BTagEntry::JetFlavor jf,
+                float eta,
+                float pt,
+                float discr,
+                double *out) const;
+
+  // evaluates the sysTypes with the indices sys[0..n) with a single bin
+  // lookup; out[i] belongs to sys[i]
+  void eval_some(BTagEntry::JetFlavor jf,
+                 float eta,
+                 float pt,
+                 float discr,
+                 const int *sys,
+                 int n,
+                 double *out) const;
+
+  // evaluates the first sysType for n jets given as structure of arrays;
+  // discr may be 0 if the operating point is not OP_RESHAPING
+  void eval_batch(size_t n,
+                  const BTagEntry::JetFlavor *jf,
+                  const float *eta,
+                  const float *pt,
+                  const float *discr,
+                  double *out) const;
+
   std::pair<float, float> min_max_pt(BTagEntry::JetFlavor jf, 
                                      float eta, 
                                      float discr=0.) const;
 
+  // eval_all() and eval_some() at pt clamped into the range of min_max_pt():
+  // to ptMin + 1e-5 below it, to ptMax - 0.1 at or above it. Eta is folded
+  // once for both lookups. Returns true if pt was out of range (e.g. to
+  // double the uncertainty).
+  bool eval_all_clamped(BTagEntry::JetFlavor jf,
+                        float eta,
+                        double pt,
+                        float discr,
+                        double *out) const;
+  bool eval_some_clamped(BTagEntry::JetFlavor jf,
+                         float eta,
+                         double pt,
+                         float discr,
+                         const int *sys,
+                         int n,
+                         double *out) const;
+
+  const std::vector<std::string>& sysTypes() const;
+  int sysIndex(const std::string & sysType) const;  // -1 if not loaded
+
+  // indices of the sysTypes that have entries for jf, in increasing order;
+  // the others do not apply to this flavor (e.g. cferr* to b jets in
+  // iterativefit) and always evaluate to 0
+  const std::vector<int>& sysIndices(BTagEntry::JetFlavor jf) const;
+
+  // false if any formula is evaluated by a (mutex guarded) TF1
+  bool lockFree() const;
+
 protected:
   class BTagCalibrationReaderImpl;
   std::auto_ptr<BTagCalibrationReaderImpl> pimpl;
@@ -179,3 +440,53 @@ protected:
 #endif  // BTagCalibrationReader_H
 
 
+#ifndef BTagCalibrationRegistry_H
+#define BTagCalibrationRegistry_H
+
+/**
+ * BTagCalibrationRegistry
+ *
+ * Process-wide store of calibrations and readers, so that several tools (or
+ * input data blocks) asking for the same configuration share one copy.
+ * Calibrations are kept by (file path, tagger, content checksum) and read
+ * on demand; readers are kept by the calibration plus operating point,
+ * measurement types, sysTypes and tabulation settings. Both are handed out
+ * read-only and are deleted when nobody uses them anymore. A reader copies
+ * its entries, so it keeps its calibration alive only while it is built.
+ *
+ * A file that changed on disk has another checksum, and is read again.
+ *
+ ************************************************************/
+
+#include <memory>
+#include <string>
+#include <vector>
+
+
+class BTagCalibrationRegistry
+{
+public:
+  static std::shared_ptr<const BTagCalibration> calibration(
+    const std::string &tagger,
+    const std::string &filename,
+    BTagCalibration::LoadMode mode=BTagCalibration::LOAD_ON_DEMAND,
+    const std::string &cacheFile="");
+
+  // reader for all three flavors, measurementType_bc for b and c jets
+  static std::shared_ptr<const BTagCalibrationReader> reader(
+    const std::string &tagger,
+    const std::string &filename,
+    BTagEntry::OperatingPoint op,
+    const std::string &measurementType_bc,
+    const std::string &measurementType_udsg,
+    const std::string &sysType="central",
+    const std::vector<std::string> &otherSysTypes=std::vector<std::string>(),
+    double tabulationTolerance=0.,
+    BTagCalibration::LoadMode mode=BTagCalibration::LOAD_ON_DEMAND,
+    const std::string &cacheFile="",
+    bool tabulationCubic=false);
+};
+
+#endif  // BTagCalibrationRegistry_H
+
+
@@ -0,0 +1,103 @@
+#ifndef __BTAGGINGEVENTWEIGHT_H__
+#define __BTAGGINGEVENTWEIGHT_H__
+
+#include <memory>
+#include <stdexcept>
+
+#include <ROOT/RVec.hxx>
+
+#include "BTaggingScaleFactors.h"
+
+//
+// Fixed-cut b-tagging event weights as callables for ROOT::RDataFrame::Define, from the
+// per-event jet columns pt, eta, discriminator (RVec<float>) and hadron flavour (RVec<int>):
+//
+//   auto sf = std::make_shared<BTaggingScaleFactors>();
+//   sf->setReader(BTagCalibrationRegistry::reader(...), workingPointCut);
+//   sf->setEfficiency(0, BTaggingScaleFactors::EFF_B, *hPass_b, *hAll_b);
+//   ...
+//   df.Define("weightBtag", BTaggingEventWeight(sf), {"jet_pt", "jet_eta", "jet_csv", "jet_hadronFlavour"})
+//     .Define("weightsBtag", BTaggingEventWeights(sf), {"jet_pt", "jet_eta", "jet_csv", "jet_hadronFlavour"})
+//     .Define("weightBtag_bc_up", [](const BTaggingScaleFactors::Weights& w){ return w.bc_up; }, {"weightsBtag"});
+//
+// BTaggingScaleFactors::Weights has no dictionary, so its members are read with compiled
+// callables as above; a jitted string expression like "weightsBtag.bc_up" does not compile.
+//
+// The callables share the (read-only) scale factors and can be called from all threads of
+// implicit multithreading at once; per event nothing is allocated and no lock is taken. The
+// scale factors must therefore not be changed any more, and the reader must be lockFree().
+//
+// Header only, so that the SFrame library does not depend on ROOT::VecOps.
+//
+
+/// nominal event weight
+class BTaggingEventWeight {
+
+ public:
+  typedef ROOT::VecOps::RVec<float> Floats;
+  typedef ROOT::VecOps::RVec<int> Ints;
+
+  /// category: index of the efficiency maps given to scaleFactors->setEfficiency
+  explicit BTaggingEventWeight( const std::shared_ptr<const BTaggingScaleFactors>& scaleFactors, const int& category = 0 ):
+    m_scaleFactors( scaleFactors ), m_category( category ) {
+    if (!m_scaleFactors->reader().lockFree()) {
+      throw std::runtime_error( "BTaggingEventWeight needs a reader without TF1 formulas" );
+    }
+  }
+
+  double operator()( const Floats& pt, const Floats& eta, const Floats& discr, const Ints& hadronFlavour ) const {
+    const size_t nJets = pt.size();
+    if (eta.size() != nJets || discr.size() != nJets || hadronFlavour.size() != nJets) {
+      throw std::runtime_error( "BTaggingEventWeight: jet columns of different size" );
+    }
+    const BTaggingScaleFactors& sf = *m_scaleFactors;
+    double weight = 1.;
+    for (size_t i = 0; i < nJets; ++i) {
+      weight *= sf.getJetWeight(pt[i], eta[i], hadronFlavour[i], sf.isTagged(discr[i]), 0., 0., m_category);
+    }
+    return weight;
+  }
+
+ private:
+  std::shared_ptr<const BTaggingScaleFactors> m_scaleFactors;
+  int m_category;
+
+};
+
+
+/// nominal event weight and its b/c and udsg variations, in one pass over the jets
+class BTaggingEventWeights {
+
+ public:
+  typedef ROOT::VecOps::RVec<float> Floats;
+  typedef ROOT::VecOps::RVec<int> Ints;
+
+  /// category: index of the efficiency maps given to scaleFactors->setEfficiency
+  explicit BTaggingEventWeights( const std::shared_ptr<const BTaggingScaleFactors>& scaleFactors, const int& category = 0 ):
+    m_scaleFactors( scaleFactors ), m_category( category ) {
+    if (!m_scaleFactors->reader().lockFree()) {
+      throw std::runtime_error( "BTaggingEventWeights needs a reader without TF1 formulas" );
+    }
+  }
+
+  BTaggingScaleFactors::Weights operator()( const Floats& pt, const Floats& eta, const Floats& discr, const Ints& hadronFlavour ) const {
+    const size_t nJets = pt.size();
+    if (eta.size() != nJets || discr.size() != nJets || hadronFlavour.size() != nJets) {
+      throw std::runtime_error( "BTaggingEventWeights: jet columns of different size" );
+    }
+    const BTaggingScaleFactors& sf = *m_scaleFactors;
+    BTaggingScaleFactors::Weights weights = {1., 1., 1., 1., 1.};
+    for (size_t i = 0; i < nJets; ++i) {
+      sf.multiplyJetWeights(weights, pt[i], eta[i], hadronFlavour[i], sf.isTagged(discr[i]), m_category);
+    }
+    return weights;
+  }
+
+ private:
+  std::shared_ptr<const BTaggingScaleFactors> m_scaleFactors;
+  int m_category;
+
+};
+
+
+#endif //  __BTAGGINGEVENTWEIGHT_H__
@@ -0,0 +1,44 @@
+#ifndef __BTAGGINGLOGGER_H__
+#define __BTAGGINGLOGGER_H__
+
+// SFrame include(s):
+#include "core/include/SLogger.h"
+
+//
+// Logging macros for the per-jet functions of this package.
+//
+// BTAGGING_MIN_LOG_LEVEL is the lowest SMsgType compiled in (default: DEBUG). Building
+// with -DBTAGGING_MIN_LOG_LEVEL=3 (INFO) removes the DEBUG statements completely.
+// Otherwise they are only formatted if the tool's m_debugOutput flag is set. The flag is
+// read once per function by BTAG_DEBUG_SCOPE, which has to come before the first
+// BTAG_REPORT_DEBUG: the compiler can then keep it in a register and move the message
+// code out of the way, so that the cost of a function with DEBUG output off does not grow
+// with the number of its statements (see debug_statements_* in bench/BTaggingBenchmark.cxx).
+//
+// Meant to be used inside member functions of a class with m_logger and m_debugOutput,
+// like BTaggingScaleTool:
+//
+//   double BTaggingScaleTool::getScaleFactor( ... ) {
+//     BTAG_DEBUG_SCOPE;
+//     ...
+//     BTAG_REPORT_DEBUG( "flavor " << flavour << ", jetweight " << jetweight );
+//
+
+#ifndef BTAGGING_MIN_LOG_LEVEL
+#   define BTAGGING_MIN_LOG_LEVEL 2    // DEBUG
+#endif
+
+#if BTAGGING_MIN_LOG_LEVEL <= 2
+#   define BTAG_DEBUG_SCOPE const bool btagDebugOutput = m_debugOutput
+#   define BTAG_REPORT_DEBUG( MESSAGE )                                \
+   do {                                                                \
+      if( __builtin_expect( btagDebugOutput, false ) ) {               \
+         m_logger << DEBUG << MESSAGE << SLogger::endmsg;              \
+      }                                                                \
+   } while( false )
+#else
+#   define BTAG_DEBUG_SCOPE do {} while( false )
+#   define BTAG_REPORT_DEBUG( MESSAGE ) do {} while( false )
+#endif
+
+#endif // __BTAGGINGLOGGER_H__
@@ -0,0 +1,225 @@
+#ifndef __BTAGGINGSCALEFACTORS_H__
+#define __BTAGGINGSCALEFACTORS_H__
+
+#include <memory>
+#include <vector>
+
+#include <TH2.h>
+
+#include "BTagCalibrationStandalone.h"
+
+//
+// Scale factor logic of BTaggingScaleTool without SFrame, for any event loop. Jets are
+// given as plain numbers: pt, eta, hadron flavour and discriminator (or tagging decision).
+// BTaggingScaleTool is the SFrame adapter of these classes.
+//
+// The const methods keep no state, so they can be called from several threads at once.
+// Errors are thrown as std::runtime_error.
+//
+
+/// fixed-cut event weights of one working point: scale factors and MC efficiencies
+class BTaggingScaleFactors {
+
+ public:
+  /// sysTypes of the reader
+  enum SysIndex { SYS_CENTRAL=0, SYS_UP=1, SYS_DOWN=2, N_SYS=3 };
+  /// flavours of the efficiency maps
+  enum EffFlavour { EFF_B=0, EFF_C=1, EFF_UDSG=2, N_EFF_FLAVOURS=3 };
+
+  /// event weights with the nominal scale factors, and with those of b and c or of udsg jets varied by one sigma
+  struct Weights {
+    double nominal;
+    double bc_up;
+    double bc_down;
+    double udsg_up;
+    double udsg_down;
+  };
+
+  /// jet quantities that do not depend on the working point, to be computed once per jet
+  /// if it is passed to several BTaggingScaleFactors
+  struct Jet {
+    Jet( const double& pt, const double& eta, const int& hadronFlavour );
+    double pt;
+    double eta;
+    int hadronFlavour;
+    BTagEntry::JetFlavor flavor;      ///< as jetFlavor( hadronFlavour )
+    EffFlavour effFlavour;            ///< as effFlavour( hadronFlavour )
+    bool bc;                          ///< varied with the b and c uncertainties (signed flavour 5 or 4)
+    bool inTracker;                   ///< |eta| <= 2.4, else the jet weight is 1
+  };
+
+  BTaggingScaleFactors();
+
+  /// reader with the sysTypes "central", "up" and "down"; jets with a discriminator above
+  /// workingPointCut are tagged. A null reader sets the cut only.
+  void setReader( const std::shared_ptr<const BTagCalibrationReader>& reader, const double& workingPointCut );
+  const BTagCalibrationReader& reader() const { return *m_reader; }
+  const double& workingPointCut() const { return m_workingPointCut; }
+  bool isTagged( const double& discr ) const { return discr > m_workingPointCut; }
+
+  /// efficiency map hPass / hAll of a jet category (any number >= 0) and flavour
+  void setEfficiency( const int& category, EffFlavour flavour, const TH2& hPass, const TH2& hAll );
+
+  /// MC efficiency; 0 if there is no map for the category
+  double getEfficiency( const int& category, const double& pt, const double& eta, const int& hadronFlavour ) const;
+  /// getEfficiency for a flavour of the efficiency maps
+  double efficiency( const int& category, EffFlavour flavour, const double& pt, const double& eta ) const;
+
+  /// weight of one jet, sigma_bc and sigma_udsg shift the scale factors of b and c or of udsg jets;
+  /// the uncertainty is doubled for jets outside the pt range of the scale factors
+  double getJetWeight( const double& pt, const double& eta, const int& hadronFlavour, bool isTagged,
+                       const double& sigma_bc, const double& sigma_udsg, const int& category ) const;
+
+  /// multiplies weights by the jet weights of all variations, with one lookup for all of them
+  void multiplyJetWeights( Weights& weights, const double& pt, const double& eta, const int& hadronFlavour, bool isTagged,
+                           const int& category ) const;
+  void multiplyJetWeights( Weights& weights, const Jet& jet, bool isTagged, const int& category ) const;
+
+  /// multiplyJetWeights for n jets given as structure of arrays, tagged by their discriminator:
+  /// the scale factors and efficiencies of a block of jets are looked up before their weights
+  /// are computed, without allocating
+  void multiplyJetWeights( Weights& weights, const size_t& n, const float* pt, const float* eta, const int* hadronFlavour,
+                           const float* discr, const int& category ) const;
+
+  /// nominal weight of n jets given as structure of arrays, as multiplyJetWeights; only the
+  /// central scale factors are looked up, so only they have to be different from 0
+  double nominalWeight( const size_t& n, const float* pt, const float* eta, const int* hadronFlavour,
+                        const float* discr, const int& category ) const;
+
+  /// product of getJetWeight over n jets given as structure of arrays, tagged by their
+  /// discriminator; all variations are looked up, as in multiplyJetWeights, so all of them have
+  /// to be different from 0
+  double variationWeight( const size_t& n, const float* pt, const float* eta, const int* hadronFlavour,
+                          const float* discr, const double& sigma_bc, const double& sigma_udsg,
+                          const int& category ) const;
+
+  /// scale factors of a jet in the tracker range: sf[SYS_CENTRAL], sf[SYS_UP] and sf[SYS_DOWN], with
+  /// the uncertainty doubled outside the pt range of the scale factors; throws if any of them is 0
+  void getScaleFactors( const Jet& jet, double* sf ) const;
+
+  /// getEfficiency for a jet
+  double getEfficiency( const int& category, const Jet& jet ) const;
+
+  /// efficiency maps filled by fillEfficiency: hPass and hAll directly, or with deferred fills
+  /// through flat tables that are only added to them by flushEfficiencies. hAll may be 0 if the
+  /// jets are counted in the denominator elsewhere, e.g. by the object of another working point
+  void bookEfficiency( const int& category, EffFlavour flavour, TH2F* hPass, TH2F* hAll );
+  void fillEfficiency( const int& category, const int& hadronFlavour, bool isTagged, const double& pt, const double& eta );
+  void flushEfficiencies();
+  void setDeferredEfficiencyFills( bool deferred ) { m_deferredFills = deferred; }
+  /// number of deferred fills not flushed yet
+  double pendingEfficiencyFills() const;
+
+  /// flavour of the efficiency maps: 5 is b, 4 is c, everything else udsg
+  static EffFlavour effFlavour( const int& hadronFlavour ) {
+    return (hadronFlavour == 5) ? EFF_B : ((hadronFlavour == 4) ? EFF_C : EFF_UDSG);
+  }
+  /// flavour of the scale factors: |5| is b, |4| and |15| are c, everything else udsg
+  static BTagEntry::JetFlavor jetFlavor( const int& hadronFlavour );
+
+ private:
+  /// axis of an efficiency map, finds bins like TAxis::FindFixBin
+  struct EffAxis {
+    int nBins;
+    double min;
+    double max;
+    std::vector<double> edges;        ///< empty for equidistant bins
+    int findBin( const double& x ) const;
+  };
+  /// efficiency map of one jet category and flavour
+  struct EffTable {
+    EffAxis ptAxis;
+    EffAxis etaAxis;
+    std::vector<float> eff;           ///< bins as in TH2, including under- and overflow
+  };
+  /// booked efficiency histogram, filled through flat counters
+  struct EffCounter {
+    EffCounter(): hist( 0 ), entries( 0. ) {}
+    TH2F* hist;
+    EffAxis ptAxis;
+    EffAxis etaAxis;
+    std::vector<double> counts;       ///< bins as in TH2, including under- and overflow
+    double entries;
+    double stats[7];                  ///< as TH1::GetStats, for weight 1
+  };
+
+  /// fills table from the efficiency histogram
+  static void fillEffTable( EffTable& table, const TH2& hEff );
+
+  /// number of jets per block of the structure of arrays methods
+  enum { BLOCK_SIZE=64 };
+  /// jet weights of the first nSys sysTypes for the jets of a block (n <= BLOCK_SIZE) within the
+  /// tracker range, which are counted in the return value; bc tells which variations they enter.
+  /// The up and down scale factors are shifted by |sigma_bc| or |sigma_udsg| (times 2 out of range).
+  size_t blockJetWeights( const size_t& n, const float* pt, const float* eta, const int* hadronFlavour, const float* discr,
+                          const int& category, const int& nSys, const double& sigma_bc, const double& sigma_udsg,
+                          double (*jetweight)[N_SYS], bool* bc ) const;
+
+  std::shared_ptr<const BTagCalibrationReader> m_reader;
+  double m_workingPointCut;
+  std::vector< EffTable > m_effTables;      ///< [category * N_EFF_FLAVOURS + flavour]
+  std::vector< EffCounter > m_effCounters;  ///< [(category * N_EFF_FLAVOURS + flavour) * 2 + tagged]
+  bool m_statOverflows;                     ///< TH1::StatOverflows() when booking
+  bool m_deferredFills;                     ///< false: fillEfficiency fills the histograms
+
+};
+
+
+/// fixed-cut event weights with several working points at once (e.g. Loose, Medium and Tight): the
+/// weight of a jet between two working points uses the scale factors and efficiencies of both
+class BTaggingMultiWPScaleFactors {
+
+ public:
+  typedef BTaggingScaleFactors::Weights Weights;
+  enum { N_SYS=BTaggingScaleFactors::N_SYS };
+
+  /// n working points, to be set up through workingPoint( i ) in the order of increasing cuts
+  void setNWorkingPoints( const size_t& n );
+  size_t nWorkingPoints() const { return m_workingPoints.size(); }
+  BTaggingScaleFactors& workingPoint( const size_t& i ) { return m_workingPoints.at(i); }
+  const BTaggingScaleFactors& workingPoint( const size_t& i ) const { return m_workingPoints.at(i); }
+
+  /// number of working points passed: 0 if the loosest is failed, nWorkingPoints() if the tightest is passed
+  int tagLevel( const double& discr ) const;
+
+  /// multiplies weights by the jet weights of all variations; the b/c (udsg) variations move the
+  /// scale factors of all working points together
+  void multiplyJetWeights( Weights& weights, const BTaggingScaleFactors::Jet& jet, const double& discr,
+                           const int& category ) const;
+
+ private:
+  std::vector< BTaggingScaleFactors > m_workingPoints;
+
+};
+
+
+/// discriminator reshaping (iterativefit) event weights for central and any number of systematics
+class BTaggingReshapingWeights {
+
+ public:
+  /// reader with "central" first, then the systematics; a systematic without entries for a
+  /// flavour (e.g. cferr for b and udsg jets) is not evaluated for it and takes the central value
+  void setReader( const std::shared_ptr<const BTagCalibrationReader>& reader );
+  const BTagCalibrationReader& reader() const { return *m_reader; }
+
+  /// central and systematics, in the order of the reader's sysTypes
+  size_t nWeights() const { return m_reader ? m_reader->sysTypes().size() : 0; }
+
+  /// number of systematics evaluated for a flavour, central included
+  size_t nEvaluated( BTagEntry::JetFlavor flavour ) const { return m_sys[flavour].size(); }
+
+  /// multiplies weights[0, nWeights()) by the scale factors of one jet; sf is scratch space
+  /// for nWeights() values. Jets beyond |eta| 2.4 or without central scale factor are skipped;
+  /// a zero scale factor of a systematic that applies to the jet's flavour throws.
+  void multiplyJetWeights( double* weights, double* sf, const double& pt, const double& eta, const int& hadronFlavour,
+                           const double& discr ) const;
+
+ private:
+  std::shared_ptr<const BTagCalibrationReader> m_reader;
+  std::vector<int> m_sys[3];          ///< per flavour: reader sysTypes with entries
+  std::vector<int> m_slot[3];         ///< per flavour and weight: position of its value in m_sys, 0 if central
+
+};
+
+
+#endif //  __BTAGGINGSCALEFACTORS_H__
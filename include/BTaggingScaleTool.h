@@ -7,15 +7,20 @@
 
 #include <TH2.h>
 
+class TFile;
+
 #include "../NtupleVariables/include/Jet.h"
 
 #include "../include/BTagCalibrationStandalone.h"
+#include "../include/BTaggingScaleFactors.h"
 
 class BTaggingScaleTool : public SToolBase {
   
   //
   // Follow examples in https://twiki.cern.ch/twiki/bin/viewauth/CMS/BTagCalibration
   // 
+  // The scale factor logic is in BTaggingScaleFactors, this class configures it from
+  // properties and passes the jets of the cycle to it.
   //
   
  public:
@@ -27,46 +32,129 @@ class BTaggingScaleTool : public SToolBase {
 
   /// function booking histograms
   void BeginInputData( const SInputData& id ) throw( SError );
+
+  /// function writing the deferred efficiency fills (_DeferEfficiencyFills) into the booked histograms,
+  /// to be called from the EndInputData of the cycle
+  void EndInputData( const SInputData& id ) throw( SError );
+
+  /// jet category of the efficiency maps, to be resolved once by jetCategory( name ): the
+  /// overloads taking it do no string work per jet
+  class JetCategory {
+   public:
+    JetCategory(): m_index( -1 ) {}
+    int index() const { return m_index; }
+   private:
+    friend class BTaggingScaleTool;
+    explicit JetCategory( const int& index ): m_index( index ) {}
+    int m_index;
+  };
+
+  /// handle of "jet", "subjet_softdrop" or "jet_ak4" (the veto); other categories have no efficiency maps
+  JetCategory jetCategory( const TString& name ) const { return JetCategory( effCategory( name ) ); }
+
+  /// flavours of the efficiency maps (b, c and udsg)
+  typedef BTaggingScaleFactors::EffFlavour EffFlavour;
   
   double getScaleFactor( const double& pt, const double& eta, const int& flavour, bool isTagged, const double& sigma_bc = 0., const double& sigma_udsg = 0., const TString& jetCategory = "jet" );
+  double getScaleFactor( const double& pt, const double& eta, const int& flavour, bool isTagged, const double& sigma_bc, const double& sigma_udsg, const JetCategory& jetCategory );
 
   double getScaleFactor( const UZH::Jet& jet, const double& sigma_bc = 0., const double& sigma_udsg = 0., const TString& jetCategory = "jet");
+  double getScaleFactor( const UZH::Jet& jet, const double& sigma_bc, const double& sigma_udsg, const JetCategory& jetCategory );
   
   double getSoftdropSubjetScaleFactor( const UZH::Jet& jet, const double& sigma_bc = 0., const double& sigma_udsg = 0., const TString& jetCategory = "subjet_softdrop" );
+  double getSoftdropSubjetScaleFactor( const UZH::Jet& jet, const double& sigma_bc, const double& sigma_udsg, const JetCategory& jetCategory );
 
   double getScaleFactor( const UZH::JetVec& vJets, const double& sigma_bc = 0., const double& sigma_udsg = 0., const TString& jetCategory = "jet" );
+  double getScaleFactor( const UZH::JetVec& vJets, const double& sigma_bc, const double& sigma_udsg, const JetCategory& jetCategory );
   
   double getSoftdropSubjetScaleFactor( const UZH::JetVec& vJets, const double& sigma_bc = 0., const double& sigma_udsg = 0., const TString& jetCategory = "subjet_softdrop" );
+  double getSoftdropSubjetScaleFactor( const UZH::JetVec& vJets, const double& sigma_bc, const double& sigma_udsg, const JetCategory& jetCategory );
  
-  /// function for veto
+  /// functions for veto: the same as above with the veto configuration
   double getScaleFactor_veto( const double& pt, const double& eta, const int& flavour, bool isTagged, const double& sigma_bc = 0., const double& sigma_udsg = 0., const TString& jetCategory_veto = "jet_ak4" );
 
   double getScaleFactor_veto( const UZH::Jet& jet, const double& sigma_bc = 0., const double& sigma_udsg = 0., const TString& jetCategory_veto = "jet_ak4");
 
   double getScaleFactor_veto( const UZH::JetVec& vJets, const double& sigma_bc = 0., const double& sigma_udsg = 0., const TString& jetCategory_veto = "jet_ak4" );
   
+  /// event weights with the nominal scale factors, and with those of b and c or of udsg jets varied by one sigma
+  typedef BTaggingScaleFactors::Weights ScaleFactorWeights;
+
+  /// all weights of getScaleFactor( vJets, sigma_bc, sigma_udsg ) with sigma 0 and +-1, in one pass over the jets
+  ScaleFactorWeights getScaleFactors( const UZH::JetVec& vJets, const TString& jetCategory = "jet" );
+  ScaleFactorWeights getScaleFactors( const UZH::JetVec& vJets, const JetCategory& jetCategory );
+
+  /// all weights of getScaleFactor_veto( vJets, sigma_bc, sigma_udsg ) with sigma 0 and +-1
+  ScaleFactorWeights getScaleFactors_veto( const UZH::JetVec& vJets );
+
+  /// all weights of getSoftdropSubjetScaleFactor( vJets, sigma_bc, sigma_udsg ) with sigma 0 and +-1
+  ScaleFactorWeights getSoftdropSubjetScaleFactors( const UZH::JetVec& vJets, const TString& jetCategory = "subjet_softdrop" );
+  ScaleFactorWeights getSoftdropSubjetScaleFactors( const UZH::JetVec& vJets, const JetCategory& jetCategory );
+
+  /// discriminator reshaping event weights (WorkingPoint "Reshaping"), one pass over the jets:
+  /// weights[0] is central, weights[i] belongs to getReshapingSysTypes()[i-1]. The fixed-cut
+  /// scale factors of a configuration with WorkingPoint "Reshaping" throw an SError.
+  void getReshapingWeights( const UZH::JetVec& vJets, std::vector<double>& weights );
+  /// getReshapingWeights of the veto configuration (WorkingPoint_veto "Reshaping")
+  void getReshapingWeights_veto( const UZH::JetVec& vJets, std::vector<double>& weights );
+
+  /// systematics of the reshaping weights, in the order of getReshapingWeights
+  const std::vector<std::string>& getReshapingSysTypes() const { return m_reshapingSysTypes; }
+
+  /// event weights of all channels configured by the _Channel* properties, one pass over the jets:
+  /// weights[i] belongs to getChannelNames()[i], with the jets tagged at its working point
+  void getChannelScaleFactors( const UZH::JetVec& vJets, std::vector<ScaleFactorWeights>& weights );
+
+  /// names of the channels, in the order of getChannelScaleFactors
+  const std::vector<std::string>& getChannelNames() const { return m_channelNames; }
+
+  /// helper function to check if jet is b-tagged at the working point of a channel
+  bool isTaggedChannel( const double& csv, const size_t& channel ) const;
+
+  /// event weights using all working points of the _MultiWorkingPoints property together, one pass
+  /// over the jets: each jet is weighted for falling between the working points it passes and fails.
+  /// The categories of the main configuration need their efficiency maps in _EffFile, the other
+  /// categories (e.g. jet_ak4 in _EffFile_veto) can be used if their file has them.
+  ScaleFactorWeights getMultiWPScaleFactors( const UZH::JetVec& vJets, const TString& jetCategory = "jet" );
+  ScaleFactorWeights getMultiWPScaleFactors( const UZH::JetVec& vJets, const JetCategory& jetCategory );
+
+  /// getMultiWPScaleFactors for the softdrop subjets
+  ScaleFactorWeights getSoftdropSubjetMultiWPScaleFactors( const UZH::JetVec& vJets, const TString& jetCategory = "subjet_softdrop" );
+  ScaleFactorWeights getSoftdropSubjetMultiWPScaleFactors( const UZH::JetVec& vJets, const JetCategory& jetCategory );
+
+  /// number of _MultiWorkingPoints passed: 0 fails the loosest, 1 passes only the loosest etc.
+  int getTagLevel( const double& csv ) const { return m_multiWP.tagLevel(csv); }
+
 
 
   /// function to book histograms for efficiencies
   void bookHistograms();
   
-  /// function to fill jet b-tagging efficiencies
+  /// function to fill jet b-tagging efficiencies; the fill functions fill the histograms of all
+  /// channels booked in the jet category, each jet being tagged at the working point of the channel
   void fillEfficiencies( const UZH::JetVec& vJets );
  
-  /// function to fill jet b-tagging efficiencies for veto
+  /// function to fill jet b-tagging efficiencies for veto ("jet_ak4")
   void fillEfficiencies_veto( const UZH::JetVec& vJets );
   
   /// function to fill subjet b-tagging efficiencies
   void fillSoftdropSubjetEfficiencies( const UZH::JetVec& vJets );
+
+  /// function to fill b-tagging efficiencies for an individual jet ("jet_ak4" for the veto); only
+  /// for jet categories booked by a single channel, as the tagging decision is given
+  void fillEfficiency( const double& pt, const double& eta, const int& flavour, bool isTagged, const TString& jetCategory = "jet" );
+  void fillEfficiency( const double& pt, const double& eta, const int& flavour, bool isTagged, const JetCategory& jetCategory );
   
   /// function to read in b-tagging efficiencies
   void readEfficiencies();
   
   /// function to return b-tagging efficiency for individual jet
   double getEfficiency( const double& pt, const double& eta, const int& flavour, const TString& jetCategory = "jet" );
+  double getEfficiency( const double& pt, const double& eta, const int& flavour, const JetCategory& jetCategory );
+  double getEfficiency( const double& pt, const double& eta, EffFlavour flavour, const JetCategory& jetCategory );
   
-  /// function to convert flavor integer to TString
-  TString flavourToString( const int& flavour );
+  /// function to convert flavor integer to TString, without copying it
+  const TString& flavourToString( const int& flavour );
   
   /// helper function to check if jet is b-tagged
   bool isTagged( const UZH::Jet& jet );
@@ -90,33 +178,138 @@ class BTaggingScaleTool : public SToolBase {
   std::string m_workingPoint_veto;
   std::string m_csvFile;
   std::string m_csvFile_veto;
+  std::string m_cacheFile;            ///< binary cache of m_csvFile, empty: none
+  std::string m_cacheFile_veto;
+  bool m_loadOnDemand;                ///< parse only the csv lines that are used
   std::string m_measurementType_udsg;
   std::string m_measurementType_bc;
   std::string Clemens;
   std::string m_measurementType_veto_udsg;
   std::string m_measurementType_veto_bc;
+  double m_tabulationTolerance;       ///< max. deviation of tabulated SFs, 0: off
+  bool m_tabulationCubic;             ///< cubic interpolation of the tabulated SFs
   std::string m_effHistDirectory;
   std::string m_effFile;
   std::string m_effFile_veto;
-  std::vector<TString> m_jetCategories;
-  std::vector<TString> m_jetCategories_veto;
+  bool m_deferEfficiencyFills;        ///< fill the efficiency histograms only in EndInputData
+  std::vector<TString> m_jetCategories;  ///< names of the efficiency categories, see effCategory
   std::vector<TString> m_flavours;
   
   std::map<std::string, double> wpCuts; // could have a function to set these
 
-  double currentWorkingPointCut;
-  double currentWorkingPointCut_veto;
+  /// index of the efficiency maps in m_jetCategories: "jet", "subjet_softdrop", "jet_ak4"; -1 if unknown
+  int effCategory( const TString& jetCategory ) const;
+
+  // categories of the functions without jetCategory argument
+  JetCategory m_category_jet;
+  JetCategory m_category_subjet;
+  JetCategory m_category_veto;
+
+  /// working point configuration with its own reader and efficiency maps: m_channels holds the
+  /// main one, the veto and then those of the _Channels property
+  struct Channel {
+    std::string name;
+    std::string tagger;
+    std::string workingPoint;
+    std::string csvFile;
+    std::string cacheFile;            ///< binary cache of csvFile, empty: none
+    std::string measurementType_bc;
+    std::string measurementType_udsg;
+    std::string effFile;
+    std::vector<int> categories;      ///< efficiency maps <category>_<flavour>_<workingPoint> booked and read
+    BTagEntry::OperatingPoint operatingPoint;
+    BTaggingScaleFactors scaleFactors;          ///< fixed-cut weights, efficiency maps in the categories of effCategory
+    BTaggingReshapingWeights reshapingWeights;  ///< WorkingPoint "Reshaping"
+  };
+  enum { CHANNEL_MAIN=0, CHANNEL_VETO=1, N_FIXED_CHANNELS=2 };
+  std::vector<Channel> m_channels;
+
+  /// scale factor lookup of the per-jet functions with the working point of a channel
+  double getChannelScaleFactor( const Channel& channel, const double& pt, const double& eta, const int& flavour, bool isTagged,
+                                const double& sigma_bc, const double& sigma_udsg, const int& category );
+  /// getChannelScaleFactor for all jets, each tagged at the working point of the channel
+  double getChannelScaleFactor( const Channel& channel, const UZH::JetVec& vJets, const double& sigma_bc, const double& sigma_udsg,
+                                const int& category );
+  /// all weights of getChannelScaleFactor( channel, vJets, sigma_bc, sigma_udsg, category ) with sigma 0 and +-1
+  ScaleFactorWeights getChannelScaleFactors( const Channel& channel, const UZH::JetVec& vJets, const int& category );
+  /// scale factors of a channel with a fixed cut, SError for WorkingPoint "Reshaping"
+  const BTaggingScaleFactors& fixedCutScaleFactors( const Channel& channel ) const;
+  /// reshaping weights of a channel, see getReshapingWeights
+  void getChannelReshapingWeights( const Channel& channel, const UZH::JetVec& vJets, std::vector<double>& weights );
+
+  /// numerator booked in a jet category: the scale factors whose working point tags the jets
+  struct EffNumerator {
+    BTaggingScaleFactors* scaleFactors;
+    std::string workingPoint;
+  };
+  /// per jet category, the numerators booked in it; the first one also counts all jets in <category>_<flavour>_all
+  std::vector< std::vector<EffNumerator> > m_effNumerators;
+
+  /// books <category>_<flavour>_<workingPoint> for scaleFactors, unless booked for another channel
+  void bookEfficiencies( BTaggingScaleFactors& scaleFactors, const int& category, const std::string& workingPoint,
+                         const int& nPtBins, const float* ptBins, const int& nEtaBins, const float* etaBins );
+
+  /// counts a jet in the efficiency histograms of category and flavour, with the tagging decision of its only numerator
+  void fillEffCounter( const int& category, const int& flavour, bool isTagged, const double& pt, const double& eta );
+  /// counts a jet in all efficiency histograms of category and flavour, tagged at the working point of each numerator
+  void fillEffCounters( const int& category, const int& flavour, const double& discr, const double& pt, const double& eta );
+  /// fillEffCounters for all jets
+  void fillEfficiencies( const UZH::JetVec& vJets, const JetCategory& jetCategory );
+
+  /// deferred efficiency fills of all channels not written into the histograms yet
+  double pendingEfficiencyFills() const;
+  /// writes the deferred efficiency fills of all channels into their histograms
+  void flushEfficiencyFills();
+  /// flushEfficiencyFills with a WARNING, for fills the cycle did not write with EndInputData
+  void flushLateEfficiencyFills();
+
+  /// copies the softdrop subjets of all jets into the m_subjet* arrays; returns their number
+  size_t gatherSoftdropSubjets( const UZH::Jet* jets, const size_t& nJets );
+  /// weight of the softdrop subjets of all jets with the variations sigma_bc and sigma_udsg, in one
+  /// batch; only the central scale factors are looked up for the nominal weight
+  double getSoftdropSubjetWeight( const UZH::Jet* jets, const size_t& nJets, const double& sigma_bc, const double& sigma_udsg,
+                                  const JetCategory& jetCategory );
+
+  // softdrop subjets of an event as structure of arrays, reused from event to event
+  std::vector<float> m_subjetPt;
+  std::vector<float> m_subjetEta;
+  std::vector<float> m_subjetCsv;
+  std::vector<int> m_subjetFlavour;
+
+  /// sets up m_channels from the properties
+  void setupChannels( BTagCalibration::LoadMode loadMode );
+  /// reader(s) of a channel
+  void setupChannel( Channel& channel, BTagCalibration::LoadMode loadMode );
+
+  /// value of a _Channel* property for a channel; a single value applies to all of them
+  const std::string& channelSetting( const std::vector<std::string>& values, const size_t& channel, const std::string& property ) const;
+
+  /// denominator of the efficiency of a working point: <name>_<wp>_all as written by mergeEfficiencies, else <name>_all
+  TH2F* getEfficiencyDenominator( TFile* file, const TString& name, const TString& workingPoint ) const;
+  /// efficiency maps of all _MultiWorkingPoints in a category; false (and nothing set) if one is missing
+  bool readMultiWPEfficiencies( TFile* file, const int& category );
+
+  std::vector<std::string> m_channelNames;
+  std::vector<std::string> m_channelTaggers;
+  std::vector<std::string> m_channelWorkingPoints;
+  std::vector<std::string> m_channelCsvFiles;
+  std::vector<std::string> m_channelCacheFiles;
+  std::vector<std::string> m_channelMeasurementTypes_bc;
+  std::vector<std::string> m_channelMeasurementTypes_udsg;
+  std::vector<std::string> m_channelEffFiles;
+  std::vector<std::string> m_channelJetCategories;
 
-  std::map< std::string, TH2F > m_effMaps;
-  std::map< std::string, TH2F > m_effMaps_veto;
+  /// working points evaluated together, in the order of increasing cuts; empty: off
+  std::vector<std::string> m_multiWorkingPoints;
+  BTaggingMultiWPScaleFactors m_multiWP;  ///< efficiency maps in the categories of effCategory
+  std::vector<bool> m_multiWPCategories;  ///< categories with the efficiency maps of all _MultiWorkingPoints
 
-  std::unique_ptr<BTagCalibrationReader> m_reader;
-  std::unique_ptr<BTagCalibrationReader> m_reader_up;
-  std::unique_ptr<BTagCalibrationReader> m_reader_down;
+  // iterativefit reshaping: "central", then m_reshapingSysTypes
+  std::string m_measurementType_reshaping;
+  std::vector<std::string> m_reshapingSysTypes;
+  std::vector<double> m_reshapingScratch; ///< per-jet scale factors in getReshapingWeights, sized in BeginInputData
 
-  std::unique_ptr<BTagCalibrationReader> m_reader_veto;
-  std::unique_ptr<BTagCalibrationReader> m_reader_veto_up;
-  std::unique_ptr<BTagCalibrationReader> m_reader_veto_down;
+  bool m_debugOutput;                 ///< DEBUG messages from the per-jet functions, see BTaggingLogger.h
 
 };
 
@@ -0,0 +1,227 @@
+//
+// mergeEfficiencies
+//
+// Compiled replacement of extractEfficiencies.py: adds up the efficiency histograms booked by
+// BTaggingScaleTool::bookHistograms in any number of output files, for all jet categories
+// (prefixes), flavours and working points in one pass, with the files read in parallel.
+//
+// usage: mergeEfficiencies [options] inputFiles
+//   -o output      output ROOT file [default: bTagEffs.root]
+//   -d directory   directory of the histograms in input and output [default: bTagEff]
+//   -p prefixes    comma separated histogram prefixes [default: jet_,jet_ak4_,subjet_softdrop_]
+//   -w wps         comma separated working points [default: Loose,Medium,Tight]
+//   -x pattern     skip input files with pattern in their name
+//   -j threads     number of files read at the same time [default: number of cores]
+//   -r             recreate the output file instead of updating it
+//
+// For every prefix and flavour found, the output directory holds <prefix><flavour>_all and,
+// for every working point found, <prefix><flavour>_<wp>, <prefix><flavour>_<wp>_all and
+// <prefix><flavour>_<wp>_eff: the layout BTaggingScaleTool::readEfficiencies expects.
+// Histograms that are already in the output file are replaced.
+//
+// The working points booked can differ from file to file. The denominator of a working point,
+// <wp>_all, is the sum of _all over the files that have that working point, and <wp>_eff is
+// divided by it; _all is the sum over all files.
+//
+
+// STL include(s):
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// System include(s):
+#include <unistd.h>
+
+// ROOT include(s):
+#include <TDirectory.h>
+#include <TFile.h>
+#include <TH2.h>
+#include <TROOT.h>
+
+namespace {
+
+  std::vector<std::string> split( const std::string& list ) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= list.size()) {
+      const size_t end = std::min( list.find( ',', start ), list.size() );
+      if (end > start) items.push_back( list.substr( start, end - start ) );
+      start = end + 1;
+    }
+    return items;
+  }
+
+  /// this is hardcoded in BTaggingScaleTool as well
+  const char* const flavourNames[] = { "b", "c", "udsg" };
+  const size_t nFlavours = sizeof( flavourNames ) / sizeof( flavourNames[0] );
+
+  /// sums of one thread (or of all): [(prefix * nFlavours + flavour) * (1 + nWPs) + hist],
+  /// hist 0 is "_all", hist 1 + i the working point i
+  typedef std::vector< std::unique_ptr<TH2> > HistSums;
+
+  void add( std::unique_ptr<TH2>& sum, TH2* hist ) {
+    if (!sum) {
+      sum.reset( hist );
+      return;
+    }
+    sum->Add( hist );
+    delete hist;
+  }
+
+  /// adds the histograms of files[next++] to sums until no file is left; the _all of a file is
+  /// also added to the denominators of the working points found in it (same indices as sums)
+  void mergeFiles( const std::vector<std::string>& files, std::atomic<size_t>& next, HistSums& sums, HistSums& denominators,
+                   const std::vector<std::string>& names, size_t nHists, const std::string& directory,
+                   std::atomic<bool>& failed ) {
+    for (size_t i = next++; i < files.size(); i = next++) {
+      std::unique_ptr<TFile> file( TFile::Open( files[i].c_str() ) );
+      if (!file || file->IsZombie()) {
+        std::fprintf( stderr, "ERROR: cannot open %s\n", files[i].c_str() );
+        failed = true;
+        return;
+      }
+      TDirectory* dir = file->GetDirectory( directory.c_str() );
+      if (!dir) {
+        std::fprintf( stderr, "WARNING: no directory %s in %s\n", directory.c_str(), files[i].c_str() );
+        continue;
+      }
+      for (size_t base = 0; base < names.size(); base += nHists) {
+        TH2* all = dynamic_cast<TH2*>( dir->Get( names[base].c_str() ) );
+        for (size_t w = 1; w < nHists; ++w) {
+          // only the working points of the tool configuration are booked
+          TH2* hist = dynamic_cast<TH2*>( dir->Get( names[base + w].c_str() ) );
+          if (!hist) continue;
+          if (!all) {
+            std::fprintf( stderr, "WARNING: %s without %s in %s, skipped\n", names[base + w].c_str(), names[base].c_str(),
+                          files[i].c_str() );
+            delete hist;
+            continue;
+          }
+          add( sums[base + w], hist );
+          add( denominators[base + w], (TH2*) all->Clone() );
+        }
+        if (all) add( sums[base], all );
+      }
+    }
+  }
+
+} // namespace
+
+
+int main( int argc, char** argv ) {
+
+  std::string outputFile = "bTagEffs.root";
+  std::string directory = "bTagEff";
+  std::vector<std::string> prefixes = split( "jet_,jet_ak4_,subjet_softdrop_" );
+  std::vector<std::string> workingPoints = split( "Loose,Medium,Tight" );
+  std::string exclude;
+  unsigned nThreads = std::max( 1u, std::thread::hardware_concurrency() );
+  bool replace = false;
+
+  int opt;
+  while ((opt = getopt( argc, argv, "o:d:p:w:x:j:r" )) != -1) {
+    switch (opt) {
+    case 'o': outputFile = optarg; break;
+    case 'd': directory = optarg; break;
+    case 'p': prefixes = split( optarg ); break;
+    case 'w': workingPoints = split( optarg ); break;
+    case 'x': exclude = optarg; break;
+    case 'j': nThreads = std::max( 1, std::atoi( optarg ) ); break;
+    case 'r': replace = true; break;
+    default:
+      std::fprintf( stderr, "usage: %s [-o output] [-d directory] [-p prefixes] [-w wps] [-x pattern] [-j threads] [-r] inputFiles\n", argv[0] );
+      return 1;
+    }
+  }
+  std::vector<std::string> files;
+  for (int i = optind; i < argc; ++i) {
+    if (!exclude.empty() && std::string( argv[i] ).find( exclude ) != std::string::npos) continue;
+    files.push_back( argv[i] );
+  }
+  if (files.empty()) {
+    std::fprintf( stderr, "Please provide at least one ROOT file name\n" );
+    return 1;
+  }
+  nThreads = std::min<size_t>( nThreads, files.size() );
+
+  const size_t nHists = 1 + workingPoints.size();
+  std::vector<std::string> names;
+  for (size_t p = 0; p < prefixes.size(); ++p) {
+    for (size_t f = 0; f < nFlavours; ++f) {
+      const std::string base = prefixes[p] + flavourNames[f];
+      names.push_back( base + "_all" );
+      for (size_t w = 0; w < workingPoints.size(); ++w) {
+        names.push_back( base + "_" + workingPoints[w] );
+      }
+    }
+  }
+
+  std::printf( "Merging %lu files with %u threads into %s\n", (unsigned long) files.size(), nThreads, outputFile.c_str() );
+
+  // histograms read are owned here, not by the files
+  ROOT::EnableThreadSafety();
+  TH1::AddDirectory( kFALSE );
+
+  std::vector<HistSums> threadSums( nThreads );
+  std::vector<HistSums> threadDenominators( nThreads );
+  std::atomic<size_t> next( 0 );
+  std::atomic<bool> failed( false );
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < nThreads; ++t) {
+    threadSums[t].resize( names.size() );
+    threadDenominators[t].resize( names.size() );
+    threads.push_back( std::thread( mergeFiles, std::cref( files ), std::ref( next ), std::ref( threadSums[t] ),
+                                    std::ref( threadDenominators[t] ), std::cref( names ), nHists, std::cref( directory ),
+                                    std::ref( failed ) ) );
+  }
+  for (size_t t = 0; t < threads.size(); ++t) {
+    threads[t].join();
+  }
+  if (failed) {
+    return 1;
+  }
+
+  HistSums sums( names.size() );
+  HistSums denominators( names.size() );
+  for (size_t t = 0; t < threadSums.size(); ++t) {
+    for (size_t h = 0; h < names.size(); ++h) {
+      if (threadSums[t][h]) add( sums[h], threadSums[t][h].release() );
+      if (threadDenominators[t][h]) add( denominators[h], threadDenominators[t][h].release() );
+    }
+  }
+
+  std::unique_ptr<TFile> outFile( TFile::Open( outputFile.c_str(), replace ? "RECREATE" : "UPDATE" ) );
+  if (!outFile || outFile->IsZombie()) {
+    std::fprintf( stderr, "ERROR: cannot open %s\n", outputFile.c_str() );
+    return 1;
+  }
+  TDirectory* outDir = outFile->GetDirectory( directory.c_str() );
+  if (!outDir) outDir = outFile->mkdir( directory.c_str() );
+
+  for (size_t base = 0; base < names.size(); base += nHists) {
+    TH2* all = sums[base].get();
+    if (!all) continue;
+    outDir->WriteTObject( all, names[base].c_str(), "Overwrite" );
+    for (size_t w = 1; w < nHists; ++w) {
+      TH2* pass = sums[base + w].get();
+      TH2* denominator = denominators[base + w].get();
+      if (!pass) continue;
+      std::unique_ptr<TH2> eff( (TH2*) pass->Clone( (names[base + w] + "_eff").c_str() ) );
+      eff->Divide( denominator );
+      outDir->WriteTObject( pass, names[base + w].c_str(), "Overwrite" );
+      outDir->WriteTObject( denominator, (names[base + w] + "_all").c_str(), "Overwrite" );
+      outDir->WriteTObject( eff.get(), eff->GetName(), "Overwrite" );
+      std::printf( "%s/%s: %.0f of %.0f jets\n", directory.c_str(), names[base + w].c_str(), pass->GetEntries(),
+                   denominator->GetEntries() );
+    }
+  }
+  outFile->Close();
+
+  return 0;
+
+}
@@ -34,76 +34,166 @@ BTagEntry::Parameters::Parameters(
                  sysType.begin(), ::tolower);
 }
 
-BTagEntry::BTagEntry(const std::string &csvLine)
-{
-  // make tokens
-  std::stringstream buff(csvLine);
-  std::vector<std::string> vec;
-  std::string token;
-  while (std::getline(buff, token, ","[0])) {
-    token = BTagEntry::trimStr(token);
-    if (token.empty()) {
-      continue;
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace {
+
+inline bool isBlank(char c)
+{
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// like trimStr(), on [begin, end)
+inline void trimRange(const char *&begin, const char *&end)
+{
+  while (begin < end && isBlank(*begin)) ++begin;
+  while (begin < end && isBlank(end[-1])) --end;
+}
+
+// copies [begin, end), dropping the characters that are not part of string
+// values (blanks and quotes)
+inline void assignCleaned(std::string &out, const char *begin, const char *end)
+{
+  out.clear();
+  out.reserve(end - begin);
+  for (const char *p = begin; p < end; ++p) {
+    if (*p != ' ' && *p != '"' && *p != '\n') {
+      out.push_back(*p);
+    }
+  }
+}
+
+// std::stoi and std::stof on [begin, end), without making a std::string
+int parseInt(const char *begin, const char *end)
+{
+  char buff[64];
+  if (end - begin >= int(sizeof(buff))) {
+    return std::stoi(std::string(begin, end));
+  }
+  std::copy(begin, end, buff);
+  buff[end - begin] = '\0';
+  char *pos;
+  errno = 0;
+  long val = strtol(buff, &pos, 10);
+  if (pos == buff) {
+    throw std::invalid_argument("stoi");
+  }
+  if (errno == ERANGE || val < INT_MIN || val > INT_MAX) {
+    throw std::out_of_range("stoi");
+  }
+  return int(val);
+}
+
+float parseFloat(const char *begin, const char *end)
+{
+  char buff[64];
+  if (end - begin >= int(sizeof(buff))) {
+    return std::stof(std::string(begin, end));
+  }
+  std::copy(begin, end, buff);
+  buff[end - begin] = '\0';
+  char *pos;
+  errno = 0;
+  float val = strtof(buff, &pos);
+  if (pos == buff) {
+    throw std::invalid_argument("stof");
+  }
+  if (errno == ERANGE) {
+    throw std::out_of_range("stof");
+  }
+  return val;
+}
+
+}  // namespace
+
+BTagEntry::BTagEntry(const std::string &csvLine):
+  csvLine(0)
+{
+  parseCSVLine(csvLine.data(), csvLine.data() + csvLine.size(), true);
+}
+
+void BTagEntry::parseCSVLine(const char *begin,
+                             const char *end,
+                             bool checkFormula)
+{
+  // make tokens, pointing into the line
+  const char *tokBegin[11];
+  const char *tokEnd[11];
+  unsigned nTokens = 0;
+  for (const char *pos = begin; ; ++pos) {
+    const char *b = pos;
+    pos = std::find(pos, end, ',');
+    const char *e = pos;
+    trimRange(b, e);
+    if (b != e) {
+      if (nTokens < 11) {
+        tokBegin[nTokens] = b;
+        tokEnd[nTokens] = e;
+      }
+      ++nTokens;
+    }
+    if (pos == end) {
+      break;
     }
-    vec.push_back(token);
   }
-  if (vec.size() != 11) {
+  if (nTokens != 11) {
 std::cerr << "ERROR in BTagCalibration: "
           << "Invalid csv line; num tokens != 11: "
-          << csvLine;
+          << std::string(begin, end);
 throw std::exception();
   }
 
-  // clean string values
-  char chars[] = " \"\n";
-  for (unsigned int i = 0; i < strlen(chars); ++i) {
-    vec[1].erase(remove(vec[1].begin(),vec[1].end(),chars[i]),vec[1].end());
-    vec[2].erase(remove(vec[2].begin(),vec[2].end(),chars[i]),vec[2].end());
-    vec[10].erase(remove(vec[10].begin(),vec[10].end(),chars[i]),vec[10].end());
-  }
-
   // make formula
-  formula = vec[10];
-  TF1 f1("", formula.c_str());  // compile formula to check validity
-  if (f1.IsZombie()) {
+  assignCleaned(formula, tokBegin[10], tokEnd[10]);
+  if (checkFormula) {
+    TF1 f1("", formula.c_str());  // compile formula to check validity
+    if (f1.IsZombie()) {
 std::cerr << "ERROR in BTagCalibration: "
           << "Invalid csv line; formula does not compile: "
-          << csvLine;
+          << std::string(begin, end);
 throw std::exception();
+    }
   }
 
   // make parameters
-  unsigned op = stoi(vec[0]);
+  unsigned op = parseInt(tokBegin[0], tokEnd[0]);
   if (op > 3) {
 std::cerr << "ERROR in BTagCalibration: "
           << "Invalid csv line; OperatingPoint > 3: "
-          << csvLine;
+          << std::string(begin, end);
 throw std::exception();
   }
-  unsigned jf = stoi(vec[3]);
+  unsigned jf = parseInt(tokBegin[3], tokEnd[3]);
   if (jf > 2) {
 std::cerr << "ERROR in BTagCalibration: "
           << "Invalid csv line; JetFlavor > 2: "
-          << csvLine;
+          << std::string(begin, end);
 throw std::exception();
   }
+  std::string measurementType, sysType;
+  assignCleaned(measurementType, tokBegin[1], tokEnd[1]);
+  assignCleaned(sysType, tokBegin[2], tokEnd[2]);
   params = BTagEntry::Parameters(
     BTagEntry::OperatingPoint(op),
-    vec[1],
-    vec[2],
+    measurementType,
+    sysType,
     BTagEntry::JetFlavor(jf),
-    stof(vec[4]),
-    stof(vec[5]),
-    stof(vec[6]),
-    stof(vec[7]),
-    stof(vec[8]),
-    stof(vec[9])
+    parseFloat(tokBegin[4], tokEnd[4]),
+    parseFloat(tokBegin[5], tokEnd[5]),
+    parseFloat(tokBegin[6], tokEnd[6]),
+    parseFloat(tokBegin[7], tokEnd[7]),
+    parseFloat(tokBegin[8], tokEnd[8]),
+    parseFloat(tokBegin[9], tokEnd[9])
   );
 }
 
 BTagEntry::BTagEntry(const std::string &func, BTagEntry::Parameters p):
   formula(func),
-  params(p)
+  params(p),
+  csvLine(0)
 {
   TF1 f1("", formula.c_str());  // compile formula to check validity
   if (f1.IsZombie()) {
@@ -116,7 +206,8 @@ throw std::exception();
 
 BTagEntry::BTagEntry(const TF1* func, BTagEntry::Parameters p):
   formula(std::string(func->GetExpFormula("p").Data())),
-  params(p)
+  params(p),
+  csvLine(0)
 {
   if (func->IsZombie()) {
 std::cerr << "ERROR in BTagCalibration: "
@@ -191,7 +282,8 @@ std::string th1ToFormulaBinTree(const TH1* hist, int start=0, int end=-1) {
 }
 
 BTagEntry::BTagEntry(const TH1* hist, BTagEntry::Parameters p):
-  params(p)
+  params(p),
+  csvLine(0)
 {
   int nbins = hist->GetNbinsX();
   TAxis const* axis = hist->GetXaxis();
@@ -267,235 +359,2644 @@ std::string BTagEntry::trimStr(std::string str) {
 }
 
 
-#include <fstream>
-#include <sstream>
+#include <cmath>
+#include <cstdlib>
 
+namespace {
 
+// node of the syntax tree that is compiled into BTagFormula bytecode
+struct FormulaNode {
+  int op;                                        // BTagFormula::OpCode or -1
+  double value;
+  bool isConst;
+  bool isInt;                                    // C++ int typed expression
+  int child[3];
+};
 
-BTagCalibration::BTagCalibration(const std::string &taggr):
-  tagger_(taggr)
-{}
+const int kTernary = -1;
 
-BTagCalibration::BTagCalibration(const std::string &taggr,
-                                 const std::string &filename):
-  tagger_(taggr)
+double applyUnary(int op, double a)
 {
-  std::ifstream ifs(filename);
-  readCSV(ifs);
-  ifs.close();
+  switch (op) {
+    case BTagFormula::NEG:   return -a;
+    case BTagFormula::NOT:   return !a;
+    case BTagFormula::LOG:   return std::log(a);
+    case BTagFormula::LOG10: return std::log10(a);
+    case BTagFormula::EXP:   return std::exp(a);
+    case BTagFormula::SQRT:  return std::sqrt(a);
+    case BTagFormula::ABS:   return std::fabs(a);
+  }
+  return 0.;
 }
 
-void BTagCalibration::addEntry(const BTagEntry &entry)
+double applyBinary(int op, double a, double b)
 {
-  data_[token(entry.params)].push_back(entry);
+  switch (op) {
+    case BTagFormula::ADD: return a + b;
+    case BTagFormula::SUB: return a - b;
+    case BTagFormula::MUL: return a * b;
+    case BTagFormula::DIV: return a / b;
+    case BTagFormula::LT:  return a < b;
+    case BTagFormula::LE:  return a <= b;
+    case BTagFormula::GT:  return a > b;
+    case BTagFormula::GE:  return a >= b;
+    case BTagFormula::EQ:  return a == b;
+    case BTagFormula::NE:  return a != b;
+    case BTagFormula::AND: return a && b;
+    case BTagFormula::OR:  return a || b;
+    case BTagFormula::POW: return std::pow(a, b);
+    case BTagFormula::MIN: return a < b ? a : b;
+    case BTagFormula::MAX: return a > b ? a : b;
+  }
+  return 0.;
 }
 
-const std::vector<BTagEntry>& BTagCalibration::getEntries(
-  const BTagEntry::Parameters &par) const
+// Recursive descent parser with C++ operator precedence. Constant
+// sub-expressions are folded while the tree is built.
+class FormulaParser
 {
-  std::string tok = token(par);
-  if (!data_.count(tok)) {
-std::cerr << "ERROR in BTagCalibration: "
-          << "(OperatingPoint, measurementType, sysType) not available: "
-          << tok;
-throw std::exception();
+public:
+  FormulaParser(const std::string &s): s_(s), pos_(0), ok_(true) {}
+
+  int parse()
+  {
+    int n = ternary();
+    skipSpace();
+    if (pos_ != s_.size()) {
+      ok_ = false;
+    }
+    return n;
   }
-  return data_.at(tok);
-}
 
-void BTagCalibration::readCSV(const std::string &s)
-{
-  std::stringstream buff(s);
-  readCSV(buff);
-}
+  bool ok() const {return ok_;}
+  const FormulaNode & node(int i) const {return nodes_[i];}
 
-void BTagCalibration::readCSV(std::istream &s)
-{
-  std::string line;
+private:
+  int add(int op, double value, bool isConst, bool isInt,
+          int a=-1, int b=-1, int c=-1)
+  {
+    FormulaNode n;
+    n.op = op;
+    n.value = value;
+    n.isConst = isConst;
+    n.isInt = isInt;
+    n.child[0] = a;
+    n.child[1] = b;
+    n.child[2] = c;
+    nodes_.push_back(n);
+    return int(nodes_.size()) - 1;
+  }
 
-  // firstline might be the header
-  getline(s,line);
-  if (line.find("OperatingPoint") == std::string::npos) {
-    addEntry(BTagEntry(line));
+  int unary(int op, int a, bool isInt)
+  {
+    if (a < 0) {
+      return -1;
+    }
+    if (nodes_[a].isConst) {
+      return add(BTagFormula::PUSH_CONST, applyUnary(op, nodes_[a].value),
+                 true, isInt);
+    }
+    return add(op, 0., false, isInt, a);
   }
 
-  while (getline(s,line)) {
-    line = BTagEntry::trimStr(line);
-    if (line.empty()) {  // skip empty lines
-      continue;
+  int binary(int op, int a, int b)
+  {
+    if (a < 0 || b < 0) {
+      return -1;
     }
-    addEntry(BTagEntry(line));
+    bool bothInt = nodes_[a].isInt && nodes_[b].isInt;
+    bool isInt = bothInt;
+    switch (op) {
+      case BTagFormula::DIV:
+        if (bothInt) {                           // integer division: use TF1
+          ok_ = false;
+          return -1;
+        }
+        break;
+      case BTagFormula::LT: case BTagFormula::LE:
+      case BTagFormula::GT: case BTagFormula::GE:
+      case BTagFormula::EQ: case BTagFormula::NE:
+      case BTagFormula::AND: case BTagFormula::OR:
+        isInt = true;
+        break;
+      case BTagFormula::POW:
+        isInt = false;
+        break;
+    }
+    if (nodes_[a].isConst && nodes_[b].isConst) {
+      return add(BTagFormula::PUSH_CONST,
+                 applyBinary(op, nodes_[a].value, nodes_[b].value),
+                 true, isInt);
+    }
+    return add(op, 0., false, isInt, a, b);
   }
-}
 
-void BTagCalibration::makeCSV(std::ostream &s) const
-{ 
-  s << tagger_ << ";" << BTagEntry::makeCSVHeader();
-  for (std::map<std::string, std::vector<BTagEntry> >::const_iterator i 
-           = data_.cbegin(); i != data_.cend(); ++i) {
-    const std::vector<BTagEntry> &vec = i->second;
-    for (std::vector<BTagEntry>::const_iterator j 
-             = vec.cbegin(); j != vec.cend(); ++j) {
-      s << j->makeCSVLine();
+  void skipSpace()
+  {
+    while (pos_ < s_.size() && isspace(s_[pos_])) {
+      ++pos_;
     }
   }
-}
 
-std::string BTagCalibration::makeCSV() const
-{
-  std::stringstream buff;
-  makeCSV(buff);
-  return buff.str();
-}
+  bool accept(const char *tok)
+  {
+    skipSpace();
+    size_t len = strlen(tok);
+    if (s_.compare(pos_, len, tok) != 0) {
+      return false;
+    }
+    // do not split '<=' into '<' and '=', or '||' into '|' and '|'
+    if (len == 1 && pos_ + 1 < s_.size()
+        && (s_[pos_+1] == '=' || (s_[pos_+1] == tok[0]
+                                  && (tok[0] == '&' || tok[0] == '|')))) {
+      return false;
+    }
+    pos_ += len;
+    return true;
+  }
 
-std::string BTagCalibration::token(const BTagEntry::Parameters &par)
-{
-  std::stringstream buff;
-  buff << par.operatingPoint << ", "
-       << par.measurementType << ", "
-       << par.sysType;
-  return buff.str();
-}
+  void expect(const char *tok)
+  {
+    if (!accept(tok)) {
+      ok_ = false;
+    }
+  }
 
+  int ternary()
+  {
+    int cond = logicalOr();
+    if (!accept("?")) {
+      return cond;
+    }
+    int a = ternary();
+    expect(":");
+    int b = ternary();
+    if (!ok_ || cond < 0 || a < 0 || b < 0) {
+      ok_ = false;
+      return -1;
+    }
+    bool isInt = nodes_[a].isInt && nodes_[b].isInt;
+    if (nodes_[cond].isConst) {
+      int n = nodes_[cond].value ? a : b;
+      nodes_[n].isInt = isInt;
+      return n;
+    }
+    return add(kTernary, 0., false, isInt, cond, a, b);
+  }
 
+  int logicalOr()
+  {
+    int n = logicalAnd();
+    while (ok_ && accept("||")) {
+      n = binary(BTagFormula::OR, n, logicalAnd());
+    }
+    return n;
+  }
 
+  int logicalAnd()
+  {
+    int n = equality();
+    while (ok_ && accept("&&")) {
+      n = binary(BTagFormula::AND, n, equality());
+    }
+    return n;
+  }
 
-class BTagCalibrationReader::BTagCalibrationReaderImpl
-{
-  friend class BTagCalibrationReader;
+  int equality()
+  {
+    int n = relational();
+    while (ok_) {
+      if (accept("==")) {
+        n = binary(BTagFormula::EQ, n, relational());
+      } else if (accept("!=")) {
+        n = binary(BTagFormula::NE, n, relational());
+      } else {
+        break;
+      }
+    }
+    return n;
+  }
 
-private:
-  BTagCalibrationReaderImpl(BTagEntry::OperatingPoint op, 
-                            std::string sysType);
+  int relational()
+  {
+    int n = additive();
+    while (ok_) {
+      if (accept("<=")) {
+        n = binary(BTagFormula::LE, n, additive());
+      } else if (accept(">=")) {
+        n = binary(BTagFormula::GE, n, additive());
+      } else if (accept("<")) {
+        n = binary(BTagFormula::LT, n, additive());
+      } else if (accept(">")) {
+        n = binary(BTagFormula::GT, n, additive());
+      } else {
+        break;
+      }
+    }
+    return n;
+  }
 
-  void load(const BTagCalibration & c,
-            BTagEntry::JetFlavor jf,
-            std::string measurementType);
+  int additive()
+  {
+    int n = multiplicative();
+    while (ok_) {
+      if (accept("+")) {
+        n = binary(BTagFormula::ADD, n, multiplicative());
+      } else if (accept("-")) {
+        n = binary(BTagFormula::SUB, n, multiplicative());
+      } else {
+        break;
+      }
+    }
+    return n;
+  }
 
-  double eval(BTagEntry::JetFlavor jf, 
-              float eta, 
-              float pt, 
-              float discr) const;
+  int multiplicative()
+  {
+    int n = prefix();
+    while (ok_) {
+      if (accept("*")) {
+        n = binary(BTagFormula::MUL, n, prefix());
+      } else if (accept("/")) {
+        n = binary(BTagFormula::DIV, n, prefix());
+      } else {
+        break;
+      }
+    }
+    return n;
+  }
 
-  std::pair<float, float> min_max_pt(BTagEntry::JetFlavor jf, 
-                                     float eta, 
-                                     float discr) const;
+  int prefix()
+  {
+    if (accept("-")) {
+      int a = prefix();
+      return unary(BTagFormula::NEG, a, a >= 0 && nodes_[a].isInt);
+    }
+    if (accept("+")) {
+      return prefix();
+    }
+    if (accept("!")) {
+      return unary(BTagFormula::NOT, prefix(), true);
+    }
+    return primary();
+  }
 
-  struct TmpEntry {
-    float etaMin;
-    float etaMax;
-    float ptMin;
-    float ptMax;
-    float discrMin;
-    float discrMax;
-    TF1 func;
-  };
+  int primary()
+  {
+    skipSpace();
+    if (pos_ >= s_.size()) {
+      ok_ = false;
+      return -1;
+    }
 
-  BTagEntry::OperatingPoint op_;
-  std::string sysType_;
-  std::vector<std::vector<TmpEntry> > tmpData_;  // first index: jetFlavor
-  std::vector<bool> useAbsEta_;                  // first index: jetFlavor
-};
+    char ch = s_[pos_];
+    if (isdigit(ch) || (ch == '.' && pos_ + 1 < s_.size()
+                                  && isdigit(s_[pos_+1]))) {
+      const char *begin = s_.c_str() + pos_;
+      char *end = 0;
+      double value = strtod(begin, &end);
+      std::string literal(begin, end - begin);
+      pos_ += end - begin;
+      if (literal.find_first_of("xX") != std::string::npos) {
+        ok_ = false;                             // no hex literals
+        return -1;
+      }
+      bool isInt = literal.find_first_of(".eE") == std::string::npos;
+      return add(BTagFormula::PUSH_CONST, value, true, isInt);
+    }
 
+    if (accept("(")) {
+      int n = ternary();
+      expect(")");
+      return ok_ ? n : -1;
+    }
 
-BTagCalibrationReader::BTagCalibrationReaderImpl::BTagCalibrationReaderImpl(
-                                             BTagEntry::OperatingPoint op,
-                                             std::string sysType):
-  op_(op),
-  sysType_(sysType),
-  tmpData_(3),
-  useAbsEta_(3, true)
-{}
+    if (isalpha(ch) || ch == '_') {
+      size_t begin = pos_;
+      while (pos_ < s_.size()) {
+        if (isalnum(s_[pos_]) || s_[pos_] == '_') {
+          ++pos_;
+        } else if (s_.compare(pos_, 2, "::") == 0) {
+          pos_ += 2;
+        } else {
+          break;
+        }
+      }
+      std::string name = s_.substr(begin, pos_ - begin);
+      if (name == "x") {
+        accept("[0]");
+        return add(BTagFormula::PUSH_X, 0., false, false);
+      }
+      return function(name);
+    }
 
-void BTagCalibrationReader::BTagCalibrationReaderImpl::load(
-                                             const BTagCalibration & c,
-                                             BTagEntry::JetFlavor jf,
-                                             std::string measurementType)
-{
-  if (tmpData_[jf].size()) {
-std::cerr << "ERROR in BTagCalibrationReader: "
-          << "Data for this jet-flavor is already loaded: "
-          << jf;
-throw std::exception();
+    ok_ = false;
+    return -1;
   }
 
-  BTagEntry::Parameters params(op_, measurementType, sysType_);
-  const std::vector<BTagEntry> &entries = c.getEntries(params);
-
-  for (const auto &be : entries) {
-    if (be.params.jetFlavor != jf) {
-      continue;
+  int function(const std::string &name)
+  {
+    int op = -1;
+    int nargs = 1;
+    if (name == "log" || name == "TMath::Log") {
+      op = BTagFormula::LOG;
+    } else if (name == "log10" || name == "TMath::Log10") {
+      op = BTagFormula::LOG10;
+    } else if (name == "exp" || name == "TMath::Exp") {
+      op = BTagFormula::EXP;
+    } else if (name == "sqrt" || name == "TMath::Sqrt") {
+      op = BTagFormula::SQRT;
+    } else if (name == "abs" || name == "fabs" || name == "TMath::Abs") {
+      op = BTagFormula::ABS;
+    } else if (name == "pow" || name == "TMath::Power") {
+      op = BTagFormula::POW;
+      nargs = 2;
+    } else if (name == "min" || name == "TMath::Min") {
+      op = BTagFormula::MIN;
+      nargs = 2;
+    } else if (name == "max" || name == "TMath::Max") {
+      op = BTagFormula::MAX;
+      nargs = 2;
+    }
+    if (op < 0 || !accept("(")) {
+      ok_ = false;
+      return -1;
+    }
+    int a = ternary();
+    int n = -1;
+    if (nargs == 1) {
+      bool isInt = op == BTagFormula::ABS && a >= 0 && nodes_[a].isInt;
+      n = unary(op, a, isInt);
+    } else {
+      expect(",");
+      n = binary(op, a, ternary());
     }
+    expect(")");
+    return ok_ ? n : -1;
+  }
 
-    TmpEntry te;
-    te.etaMin = be.params.etaMin;
-    te.etaMax = be.params.etaMax;
-    te.ptMin = be.params.ptMin;
-    te.ptMax = be.params.ptMax;
-    te.discrMin = be.params.discrMin;
-    te.discrMax = be.params.discrMax;
+  const std::string &s_;
+  size_t pos_;
+  bool ok_;
+  std::vector<FormulaNode> nodes_;
+};
 
-    if (op_ == BTagEntry::OP_RESHAPING) {
-      te.func = TF1("", be.formula.c_str(),
-                    be.params.discrMin, be.params.discrMax);
-    } else {
-      te.func = TF1("", be.formula.c_str(),
-                    be.params.ptMin, be.params.ptMax);
+// emits the bytecode for a (sub-)tree, keeping track of the stack depth
+class FormulaEmitter
+{
+public:
+  FormulaEmitter(const FormulaParser &p,
+                 std::vector<BTagFormula::Instruction> &code):
+    p_(p), code_(code), depth_(0), maxDepth_(0), hasJumps_(false) {}
+
+  void emit(int i)
+  {
+    const FormulaNode &n = p_.node(i);
+    switch (n.op) {
+      case BTagFormula::PUSH_CONST:
+        push(BTagFormula::PUSH_CONST, n.value, 1);
+        return;
+      case BTagFormula::PUSH_X:
+        push(BTagFormula::PUSH_X, 0., 1);
+        return;
+      case kTernary: {
+        emit(n.child[0]);
+        size_t jumpIfFalse = code_.size();
+        push(BTagFormula::JUMP_IF_FALSE, 0., -1);
+        int depth = depth_;
+        emit(n.child[1]);
+        size_t jump = code_.size();
+        push(BTagFormula::JUMP, 0., 0);
+        code_[jumpIfFalse].arg = int(code_.size());
+        depth_ = depth;
+        emit(n.child[2]);
+        code_[jump].arg = int(code_.size());
+        hasJumps_ = true;
+        return;
+      }
+    }
+
+    if (n.child[1] < 0) {                        // unary op
+      emit(n.child[0]);
+      push(n.op, 0., 0);
+      return;
     }
 
-    tmpData_[be.params.jetFlavor].push_back(te);
-    if (te.etaMin < 0) {
-      useAbsEta_[be.params.jetFlavor] = false;
+    // use the '<op>_CONST' instructions if one operand is a constant
+    const FormulaNode &a = p_.node(n.child[0]);
+    const FormulaNode &b = p_.node(n.child[1]);
+    int constOp = -1;
+    if (b.isConst) {
+      switch (n.op) {
+        case BTagFormula::ADD: constOp = BTagFormula::ADD_CONST; break;
+        case BTagFormula::SUB: constOp = BTagFormula::SUB_CONST; break;
+        case BTagFormula::MUL: constOp = BTagFormula::MUL_CONST; break;
+        case BTagFormula::DIV: constOp = BTagFormula::DIV_CONST; break;
+      }
+      if (constOp >= 0) {
+        emit(n.child[0]);
+        push(constOp, b.value, 0);
+        return;
+      }
+    }
+    if (a.isConst) {
+      switch (n.op) {
+        case BTagFormula::ADD: constOp = BTagFormula::ADD_CONST; break;
+        case BTagFormula::SUB: constOp = BTagFormula::RSUB_CONST; break;
+        case BTagFormula::MUL: constOp = BTagFormula::MUL_CONST; break;
+        case BTagFormula::DIV: constOp = BTagFormula::RDIV_CONST; break;
+      }
+      if (constOp >= 0) {
+        emit(n.child[1]);
+        push(constOp, a.value, 0);
+        return;
+      }
     }
+
+    emit(n.child[0]);
+    emit(n.child[1]);
+    push(n.op, 0., -1);
+  }
+
+  int maxDepth() const {return maxDepth_;}
+  bool hasJumps() const {return hasJumps_;}
+
+private:
+  void push(int op, double value, int stackChange)
+  {
+    BTagFormula::Instruction in;
+    in.op = op;
+    in.arg = 0;
+    in.value = value;
+    code_.push_back(in);
+    depth_ += stackChange;
+    maxDepth_ = depth_ > maxDepth_ ? depth_ : maxDepth_;
+  }
+
+  const FormulaParser &p_;
+  std::vector<BTagFormula::Instruction> &code_;
+  int depth_;
+  int maxDepth_;
+  bool hasJumps_;
+};
+
+}  // namespace
+
+
+bool BTagFormula::compile(const std::string &formula)
+{
+  code_.clear();
+  mapped_ = 0;
+  mappedSize_ = 0;
+  owner_.reset();
+  stackSize_ = 0;
+  hasJumps_ = false;
+
+  FormulaParser parser(formula);
+  int root = parser.parse();
+  if (!parser.ok() || root < 0) {
+    return false;
+  }
+
+  std::vector<Instruction> code;
+  FormulaEmitter emitter(parser, code);
+  emitter.emit(root);
+  if (emitter.maxDepth() > kMaxStackSize) {
+    return false;
   }
+
+  code_.swap(code);
+  stackSize_ = emitter.maxDepth();
+  hasJumps_ = emitter.hasJumps();
+  return true;
 }
 
-double BTagCalibrationReader::BTagCalibrationReaderImpl::eval(
-                                             BTagEntry::JetFlavor jf,
-                                             float eta,
-                                             float pt,
-                                             float discr) const
+bool BTagFormula::assign(const Instruction *code, int size)
 {
-  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
-  if (useAbsEta_[jf] && eta < 0) {
-    eta = -eta;
+  if (!check(code, size)) {
+    return false;
   }
+  code_.assign(code, code + size);
+  return true;
+}
 
-  // search linearly through eta, pt and discr ranges and eval
-  // future: find some clever data structure based on intervals
-  const auto &entries = tmpData_.at(jf);
-  for (unsigned i=0; i<entries.size(); ++i) {
-    const auto &e = entries.at(i);
-    if (
-      e.etaMin <= eta && eta < e.etaMax                   // find eta
-      && e.ptMin <= pt && pt < e.ptMax                    // check pt
-    ){
-      if (use_discr) {                                    // discr. reshaping?
-        if (e.discrMin <= discr && discr < e.discrMax) {  // check discr
-          return e.func.Eval(discr);
-        }
-      } else {
-        return e.func.Eval(pt);
+bool BTagFormula::reference(const Instruction *code, int size,
+                            const std::shared_ptr<const void> &owner)
+{
+  if (!owner || !check(code, size)) {
+    return false;
+  }
+  mapped_ = code;
+  mappedSize_ = size;
+  owner_ = owner;
+  return true;
+}
+
+bool BTagFormula::check(const Instruction *code, int size)
+{
+  code_.clear();
+  mapped_ = 0;
+  mappedSize_ = 0;
+  owner_.reset();
+  stackSize_ = 0;
+  hasJumps_ = false;
+  if (size <= 0) {
+    return false;
+  }
+
+  // follow the stack depth through the code, jumps must go forward
+  std::vector<int> depth(size + 1, -1);
+  depth[0] = 0;
+  int maxDepth = 0;
+  bool hasJumps = false;
+  for (int pc = 0; pc < size; ++pc) {
+    const Instruction &in = code[pc];
+    int d = depth[pc];
+    if (d < 0) {                                 // unreachable
+      return false;
+    }
+    int pops = 0, pushes = 0;
+    switch (in.op) {
+      case PUSH_CONST: case PUSH_X:
+        pushes = 1;
+        break;
+      case ADD: case SUB: case MUL: case DIV:
+      case LT: case LE: case GT: case GE: case EQ: case NE: case AND: case OR:
+      case POW: case MIN: case MAX:
+        pops = 2; pushes = 1;
+        break;
+      case ADD_CONST: case MUL_CONST: case SUB_CONST: case RSUB_CONST:
+      case DIV_CONST: case RDIV_CONST: case NEG: case NOT:
+      case LOG: case LOG10: case EXP: case SQRT: case ABS:
+        pops = 1; pushes = 1;
+        break;
+      case JUMP_IF_FALSE:
+        pops = 1;
+        break;
+      case JUMP:
+        break;
+      default:
+        return false;
+    }
+    if (d < pops) {
+      return false;
+    }
+    d += pushes - pops;
+    maxDepth = d > maxDepth ? d : maxDepth;
+
+    int targets[2] = {pc + 1, -1};
+    if (in.op == JUMP_IF_FALSE || in.op == JUMP) {
+      if (in.arg <= pc || in.arg > size) {
+        return false;
+      }
+      targets[in.op == JUMP ? 0 : 1] = in.arg;
+      hasJumps = true;
+    }
+    for (int t = 0; t < 2; ++t) {
+      if (targets[t] < 0) {
+        continue;
       }
+      if (depth[targets[t]] >= 0 && depth[targets[t]] != d) {
+        return false;
+      }
+      depth[targets[t]] = d;
     }
   }
+  if (depth[size] != 1 || maxDepth > kMaxStackSize) {
+    return false;
+  }
 
-  return 0.;  // default value
+  stackSize_ = maxDepth;
+  hasJumps_ = hasJumps;
+  return true;
 }
 
-std::pair<float, float> BTagCalibrationReader::BTagCalibrationReaderImpl::min_max_pt(
-                                               BTagEntry::JetFlavor jf, 
-                                               float eta, 
-                                               float discr) const
+double BTagFormula::eval(double x) const
 {
-  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
-  if (useAbsEta_[jf] && eta < 0) {
-    eta = -eta;
+  const int size = codeSize();
+  if (!size) {
+    return 0.;
   }
 
-  const auto &entries = tmpData_.at(jf);
+  double stack[kMaxStackSize];
+  int sp = -1;
+  const Instruction *code = codeData();
+  for (int pc = 0; pc < size; ++pc) {
+    const Instruction &in = code[pc];
+    switch (in.op) {
+      case PUSH_CONST: stack[++sp] = in.value;                          break;
+      case PUSH_X:     stack[++sp] = x;                                 break;
+      case ADD:        --sp; stack[sp] = stack[sp] + stack[sp+1];       break;
+      case SUB:        --sp; stack[sp] = stack[sp] - stack[sp+1];       break;
+      case MUL:        --sp; stack[sp] = stack[sp] * stack[sp+1];       break;
+      case DIV:        --sp; stack[sp] = stack[sp] / stack[sp+1];       break;
+      case ADD_CONST:  stack[sp] = stack[sp] + in.value;                break;
+      case MUL_CONST:  stack[sp] = stack[sp] * in.value;                break;
+      case SUB_CONST:  stack[sp] = stack[sp] - in.value;                break;
+      case RSUB_CONST: stack[sp] = in.value - stack[sp];                break;
+      case DIV_CONST:  stack[sp] = stack[sp] / in.value;                break;
+      case RDIV_CONST: stack[sp] = in.value / stack[sp];                break;
+      case NEG:        stack[sp] = -stack[sp];                          break;
+      case NOT:        stack[sp] = !stack[sp];                          break;
+      case LT:         --sp; stack[sp] = stack[sp] < stack[sp+1];       break;
+      case LE:         --sp; stack[sp] = stack[sp] <= stack[sp+1];      break;
+      case GT:         --sp; stack[sp] = stack[sp] > stack[sp+1];       break;
+      case GE:         --sp; stack[sp] = stack[sp] >= stack[sp+1];      break;
+      case EQ:         --sp; stack[sp] = stack[sp] == stack[sp+1];      break;
+      case NE:         --sp; stack[sp] = stack[sp] != stack[sp+1];      break;
+      case AND:        --sp; stack[sp] = stack[sp] && stack[sp+1];      break;
+      case OR:         --sp; stack[sp] = stack[sp] || stack[sp+1];      break;
+      case LOG:        stack[sp] = std::log(stack[sp]);                 break;
+      case LOG10:      stack[sp] = std::log10(stack[sp]);               break;
+      case EXP:        stack[sp] = std::exp(stack[sp]);                 break;
+      case SQRT:       stack[sp] = std::sqrt(stack[sp]);                break;
+      case ABS:        stack[sp] = std::fabs(stack[sp]);                break;
+      case POW:        --sp; stack[sp] = std::pow(stack[sp], stack[sp+1]); break;
+      case MIN:        --sp; stack[sp] = applyBinary(MIN, stack[sp], stack[sp+1]); break;
+      case MAX:        --sp; stack[sp] = applyBinary(MAX, stack[sp], stack[sp+1]); break;
+      case JUMP_IF_FALSE: if (!stack[sp--]) pc = in.arg - 1;            break;
+      case JUMP:       pc = in.arg - 1;                                 break;
+    }
+  }
+  return stack[0];
+}
+
+void BTagFormula::eval_batch(const double *x, double *out, int n) const
+{
+  if (empty() || hasJumps_) {
+    for (int i = 0; i < n; ++i) {
+      out[i] = eval(x[i]);
+    }
+    return;
+  }
+
+  // same as eval(), but every stack slot holds a block of values
+  double stack[kMaxStackSize][kBatchSize];
+  const Instruction *code = codeData();
+  const int size = codeSize();
+  for (int start = 0; start < n; start += kBatchSize) {
+    const int m = n - start < kBatchSize ? n - start : kBatchSize;
+    const double *xs = x + start;
+    int sp = -1;
+    for (int pc = 0; pc < size; ++pc) {
+      const Instruction &in = code[pc];
+      const double v = in.value;
+      double *a = sp >= 0 ? stack[sp] : 0;       // top of the stack
+      double *b = sp >= 1 ? stack[sp-1] : 0;     // binary ops: b = b op a
+#define BTAG_LANES(stmt) for (int l = 0; l < m; ++l) {stmt;}
+      switch (in.op) {
+        case PUSH_CONST: a = stack[++sp]; BTAG_LANES(a[l] = v)            break;
+        case PUSH_X:     a = stack[++sp]; BTAG_LANES(a[l] = xs[l])        break;
+        case ADD:        --sp; BTAG_LANES(b[l] = b[l] + a[l])             break;
+        case SUB:        --sp; BTAG_LANES(b[l] = b[l] - a[l])             break;
+        case MUL:        --sp; BTAG_LANES(b[l] = b[l] * a[l])             break;
+        case DIV:        --sp; BTAG_LANES(b[l] = b[l] / a[l])             break;
+        case ADD_CONST:  BTAG_LANES(a[l] = a[l] + v)                      break;
+        case MUL_CONST:  BTAG_LANES(a[l] = a[l] * v)                      break;
+        case SUB_CONST:  BTAG_LANES(a[l] = a[l] - v)                      break;
+        case RSUB_CONST: BTAG_LANES(a[l] = v - a[l])                      break;
+        case DIV_CONST:  BTAG_LANES(a[l] = a[l] / v)                      break;
+        case RDIV_CONST: BTAG_LANES(a[l] = v / a[l])                      break;
+        case NEG:        BTAG_LANES(a[l] = -a[l])                         break;
+        case NOT:        BTAG_LANES(a[l] = !a[l])                         break;
+        case LT:         --sp; BTAG_LANES(b[l] = b[l] < a[l])             break;
+        case LE:         --sp; BTAG_LANES(b[l] = b[l] <= a[l])            break;
+        case GT:         --sp; BTAG_LANES(b[l] = b[l] > a[l])             break;
+        case GE:         --sp; BTAG_LANES(b[l] = b[l] >= a[l])            break;
+        case EQ:         --sp; BTAG_LANES(b[l] = b[l] == a[l])            break;
+        case NE:         --sp; BTAG_LANES(b[l] = b[l] != a[l])            break;
+        case AND:        --sp; BTAG_LANES(b[l] = b[l] && a[l])            break;
+        case OR:         --sp; BTAG_LANES(b[l] = b[l] || a[l])            break;
+        case LOG:        BTAG_LANES(a[l] = std::log(a[l]))                break;
+        case LOG10:      BTAG_LANES(a[l] = std::log10(a[l]))              break;
+        case EXP:        BTAG_LANES(a[l] = std::exp(a[l]))                break;
+        case SQRT:       BTAG_LANES(a[l] = std::sqrt(a[l]))               break;
+        case ABS:        BTAG_LANES(a[l] = std::fabs(a[l]))               break;
+        case POW:        --sp; BTAG_LANES(b[l] = std::pow(b[l], a[l]))    break;
+        case MIN:        --sp; BTAG_LANES(b[l] = applyBinary(MIN, b[l], a[l])) break;
+        case MAX:        --sp; BTAG_LANES(b[l] = applyBinary(MAX, b[l], a[l])) break;
+      }
+#undef BTAG_LANES
+    }
+    for (int l = 0; l < m; ++l) {
+      out[start + l] = stack[0][l];
+    }
+  }
+}
+
+
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// read-only mapping of a whole file, unmapped when going out of scope
+class MappedFile
+{
+public:
+  MappedFile(const std::string &filename): data_(0), size_(0)
+  {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        data_ = static_cast<const char*>(p);
+        size_ = st.st_size;
+      }
+    }
+    close(fd);
+  }
+  ~MappedFile()
+  {
+    if (data_) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  const char *data() const {return data_;}
+  size_t size() const {return size_;}
+
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  const char *data_;
+  size_t size_;
+};
+
+inline std::string makeToken(int op,
+                             const std::string &measurementType,
+                             const std::string &sysType)
+{
+  return std::to_string(op) + ", " + measurementType + ", " + sysType;
+}
+
+}  // namespace
+
+
+BTagCalibration::BTagCalibration(const std::string &taggr):
+  tagger_(taggr),
+  shared_(false)
+{}
+
+BTagCalibration::BTagCalibration(const BTagCalibration &other):
+  shared_(false)
+{
+  *this = other;
+}
+
+BTagCalibration& BTagCalibration::operator=(const BTagCalibration &other)
+{
+  if (this == &other) {
+    return *this;
+  }
+  std::unique_lock<std::mutex> lock1(parseMutex_, std::defer_lock);
+  std::unique_lock<std::mutex> lock2(other.parseMutex_, std::defer_lock);
+  std::lock(lock1, lock2);
+  checkNotShared("operator=");
+  tagger_ = other.tagger_;
+  data_ = other.data_;
+  unparsed_ = other.unparsed_;
+  csvData_ = other.csvData_;
+  cached_ = other.cached_;
+  cacheData_ = other.cacheData_;
+  return *this;
+}
+
+BTagCalibration::BTagCalibration(const std::string &taggr,
+                                 const std::string &filename):
+  tagger_(taggr),
+  shared_(false)
+{
+  MappedFile file(filename);
+  if (file.data()) {
+    readCSV(file.data(), file.size());
+    return;
+  }
+  std::ifstream ifs(filename);                   // e.g. empty file
+  readCSV(ifs);
+  ifs.close();
+}
+
+BTagCalibration::BTagCalibration(const std::string &taggr,
+                                 const std::string &filename,
+                                 const std::string &cacheFile):
+  tagger_(taggr),
+  shared_(false)
+{
+  MappedFile file(filename);
+  std::string content;
+  if (!file.data()) {
+    std::ifstream ifs(filename, std::ios::binary);
+    std::stringstream buff;
+    buff << ifs.rdbuf();
+    ifs.close();
+    content = buff.str();
+  }
+  const char *data = file.data() ? file.data() : content.data();
+  const size_t size = file.data() ? file.size() : content.size();
+
+  // reading the csv once for the checksum is cheap, parsing it is not
+  const uint64_t sum = checksum(data, size);
+  if (readCache(cacheFile, sum)) {
+    return;
+  }
+  readCSV(data, size);
+  if (!writeCache(cacheFile, sum)) {
+std::cerr << "WARNING in BTagCalibration: "
+          << "Could not write cache file: "
+          << cacheFile << std::endl;
+  }
+}
+
+BTagCalibration::BTagCalibration(const std::string &taggr,
+                                 const std::string &filename,
+                                 LoadMode mode):
+  tagger_(taggr),
+  shared_(false)
+{
+  std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(filename);
+  if (!file->data()) {
+    std::ifstream ifs(filename);                 // e.g. empty file
+    readCSV(ifs);
+    ifs.close();
+    return;
+  }
+  if (mode == LOAD_ALL) {
+    readCSV(file->data(), file->size());
+    return;
+  }
+
+  // keep the file mapped as long as there are unparsed lines in it
+  csvData_ = std::shared_ptr<const char>(file, file->data());
+  readCSV(file->data(), file->size(), true);
+  if (unparsed_.empty()) {
+    csvData_.reset();
+  }
+}
+
+void BTagCalibration::addEntry(const BTagEntry &entry)
+{
+  std::string tok = token(entry.params);
+  std::lock_guard<std::mutex> lock(parseMutex_);
+  checkNotShared("addEntry");
+  parseOnDemand(tok);                            // keeps the csv order
+  data_[tok].push_back(entry);
+}
+
+const std::vector<BTagEntry>& BTagCalibration::getEntries(
+  const BTagEntry::Parameters &par) const
+{
+  std::string tok = token(par);
+  // the entries of tok do not change anymore once parsed (shared_ makes the
+  // mutators throw), so the reference stays valid without the lock
+  std::lock_guard<std::mutex> lock(parseMutex_);
+  shared_ = true;
+  parseOnDemand(tok);
+  if (!data_.count(tok)) {
+std::cerr << "ERROR in BTagCalibration: "
+          << "(OperatingPoint, measurementType, sysType) not available: "
+          << tok;
+throw std::exception();
+  }
+  return data_.at(tok);
+}
+
+std::vector<BTagCalibration::EntryRef> BTagCalibration::getEntryRefs(
+  const BTagEntry::Parameters &par) const
+{
+  std::string tok = token(par);
+  std::lock_guard<std::mutex> lock(parseMutex_);
+  shared_ = true;
+  std::vector<EntryRef> refs;
+  std::map<std::string, std::vector<uint32_t> >::const_iterator i
+    = cached_.find(tok);
+  if (i != cached_.end()) {
+    for (size_t j = 0; j < i->second.size(); ++j) {
+      refs.push_back(cachedEntryRef(i->second[j]));
+    }
+    return refs;
+  }
+
+  parseOnDemand(tok);
+  if (!data_.count(tok)) {
+std::cerr << "ERROR in BTagCalibration: "
+          << "(OperatingPoint, measurementType, sysType) not available: "
+          << tok;
+throw std::exception();
+  }
+  const std::vector<BTagEntry> &entries = data_.at(tok);
+  for (size_t j = 0; j < entries.size(); ++j) {
+    const BTagEntry &be = entries[j];
+    EntryRef ref;
+    ref.jetFlavor = be.params.jetFlavor;
+    ref.etaMin = be.params.etaMin;
+    ref.etaMax = be.params.etaMax;
+    ref.ptMin = be.params.ptMin;
+    ref.ptMax = be.params.ptMax;
+    ref.discrMin = be.params.discrMin;
+    ref.discrMax = be.params.discrMax;
+    ref.formula = be.formula.data();
+    ref.formulaSize = be.formula.size();
+    ref.compiled = be.compiled;
+    ref.csvLine = be.csvLine;
+    ref.entry = &be;
+    refs.push_back(ref);
+  }
+  return refs;
+}
+
+void BTagCalibration::readCSV(const std::string &s)
+{
+  readCSV(s.data(), s.size());
+}
+
+void BTagCalibration::readCSV(std::istream &s)
+{
+  std::stringstream buff;
+  buff << s.rdbuf();
+  readCSV(buff.str());
+}
+
+void BTagCalibration::readCSV(const char *data, size_t size)
+{
+  {
+    std::lock_guard<std::mutex> lock(parseMutex_);
+    checkNotShared("readCSV");
+  }
+  parseAll();                                    // keeps the csv order
+  readCSV(data, size, false);
+}
+
+void BTagCalibration::checkNotShared(const char *method) const
+{
+  if (shared_) {
+std::cerr << "ERROR in BTagCalibration::" << method << ": "
+          << "getEntries() has handed out references to the entries already, "
+          << "they must not change anymore";
+throw std::exception();
+  }
+}
+
+void BTagCalibration::readCSV(const char *data, size_t size, bool onDemand)
+{
+  const char *end = data + size;
+  const char *lineEnd = std::find(data, end, '\n');
+
+  // firstline might be the header
+  static const std::string header("OperatingPoint");
+  unsigned lineNumber = 1;
+  if (std::search(data, lineEnd, header.begin(), header.end()) == lineEnd) {
+    if (onDemand) {
+      indexCSVLine(data, lineEnd, lineNumber);
+    } else {
+      addCSVLine(data, lineEnd, lineNumber);
+    }
+  }
+
+  while (lineEnd != end) {
+    const char *line = lineEnd + 1;
+    lineEnd = std::find(line, end, '\n');
+    ++lineNumber;
+    const char *lineTrimmed = lineEnd;
+    trimRange(line, lineTrimmed);
+    if (line == lineTrimmed) {  // skip empty lines
+      continue;
+    }
+    if (onDemand) {
+      indexCSVLine(line, lineTrimmed, lineNumber);
+    } else {
+      addCSVLine(line, lineTrimmed, lineNumber);
+    }
+  }
+}
+
+void BTagCalibration::addCSVLine(const char *begin, const char *end,
+                                 unsigned lineNumber)
+{
+  BTagEntry entry;
+  entry.parseCSVLine(begin, end, false);  // formula is checked when loaded
+  entry.csvLine = lineNumber;
+  data_[token(entry.params)].push_back(std::move(entry));
+}
+
+void BTagCalibration::indexCSVLine(const char *begin, const char *end,
+                                   unsigned lineNumber)
+{
+  // only the first three tokens are needed for token()
+  const char *tokBegin[3];
+  const char *tokEnd[3];
+  unsigned nTokens = 0;
+  for (const char *pos = begin; nTokens < 3; ++pos) {
+    const char *b = pos;
+    pos = std::find(pos, end, ',');
+    const char *e = pos;
+    trimRange(b, e);
+    if (b != e) {
+      tokBegin[nTokens] = b;
+      tokEnd[nTokens] = e;
+      ++nTokens;
+    }
+    if (pos == end) {
+      break;
+    }
+  }
+  int op = -1;
+  if (nTokens == 3) {
+    try {
+      op = parseInt(tokBegin[0], tokEnd[0]);
+    } catch (std::exception &) {}
+  }
+  if (op < 0 || op > 3) {
+    addCSVLine(begin, end, lineNumber);          // reports the error
+    return;
+  }
+
+  std::string measurementType, sysType;
+  assignCleaned(measurementType, tokBegin[1], tokEnd[1]);
+  assignCleaned(sysType, tokBegin[2], tokEnd[2]);
+  std::transform(measurementType.begin(), measurementType.end(),
+                 measurementType.begin(), ::tolower);
+  std::transform(sysType.begin(), sysType.end(),
+                 sysType.begin(), ::tolower);
+  UnparsedLine line = {size_t(begin - csvData_.get()), size_t(end - begin),
+                       lineNumber};
+  unparsed_[makeToken(op, measurementType, sysType)].push_back(line);
+}
+
+// callers hold parseMutex_
+void BTagCalibration::parseOnDemand(const std::string &tok) const
+{
+  std::map<std::string, std::vector<uint32_t> >::iterator c
+    = cached_.find(tok);
+  if (c != cached_.end()) {
+    std::vector<BTagEntry> &vec = data_[tok];
+    for (size_t j = 0; j < c->second.size(); ++j) {
+      vec.push_back(cachedEntry(c->second[j]));
+    }
+    cached_.erase(c);
+  }
+
+  std::map<std::string, std::vector<UnparsedLine> >::iterator i
+    = unparsed_.find(tok);
+  if (i == unparsed_.end()) {
+    return;
+  }
+
+  std::vector<BTagEntry> &vec = data_[tok];
+  const std::vector<UnparsedLine> &lines = i->second;
+  for (size_t j = 0; j < lines.size(); ++j) {
+    const char *line = csvData_.get() + lines[j].offset;
+    BTagEntry entry;
+    entry.parseCSVLine(line, line + lines[j].size, false);
+    entry.csvLine = lines[j].number;
+    vec.push_back(std::move(entry));
+  }
+  unparsed_.erase(i);
+  if (unparsed_.empty()) {
+    csvData_.reset();
+  }
+}
+
+void BTagCalibration::parseAll() const
+{
+  std::lock_guard<std::mutex> lock(parseMutex_);
+  while (!unparsed_.empty()) {
+    std::string tok = unparsed_.begin()->first;
+    parseOnDemand(tok);
+  }
+  while (!cached_.empty()) {
+    std::string tok = cached_.begin()->first;
+    parseOnDemand(tok);
+  }
+}
+
+void BTagCalibration::makeCSV(std::ostream &s) const
+{ 
+  parseAll();
+  s << tagger_ << ";" << BTagEntry::makeCSVHeader();
+  for (std::map<std::string, std::vector<BTagEntry> >::const_iterator i 
+           = data_.cbegin(); i != data_.cend(); ++i) {
+    const std::vector<BTagEntry> &vec = i->second;
+    for (std::vector<BTagEntry>::const_iterator j 
+             = vec.cbegin(); j != vec.cend(); ++j) {
+      s << j->makeCSVLine();
+    }
+  }
+}
+
+std::string BTagCalibration::makeCSV() const
+{
+  std::stringstream buff;
+  makeCSV(buff);
+  return buff.str();
+}
+
+std::string BTagCalibration::token(const BTagEntry::Parameters &par)
+{
+  return makeToken(par.operatingPoint, par.measurementType, par.sysType);
+}
+
+
+
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+// Layout of the cache file (native byte order, checked with byteOrder):
+// CacheHeader, nEntries x CacheEntry, nInstructions x Instruction, and the
+// strings (measurement types, sys types, formulas) without terminators.
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint64_t csvChecksum;
+  uint32_t nEntries;
+  uint32_t nInstructions;
+  uint32_t stringBytes;
+  uint32_t reserved;
+};
+
+struct CacheEntry {
+  int32_t operatingPoint;
+  int32_t jetFlavor;
+  float etaMin;
+  float etaMax;
+  float ptMin;
+  float ptMax;
+  float discrMin;
+  float discrMax;
+  uint32_t measurementType[2];                   // offset, size
+  uint32_t sysType[2];
+  uint32_t formula[2];
+  uint32_t code[2];                              // size 0: not compiled
+  uint32_t csvLine;
+  uint32_t reserved;
+};
+
+const char kCacheMagic[8] = {'B', 'T', 'A', 'G', 'C', 'A', 'L', '\0'};
+const uint32_t kCacheByteOrder = 0x01020304;
+
+static_assert(sizeof(CacheHeader) % 8 == 0 && sizeof(CacheEntry) % 8 == 0,
+              "BTagCalibration cache: instructions must stay aligned");
+static_assert(sizeof(BTagFormula::Instruction) == 16,
+              "BTagCalibration cache: unexpected Instruction layout");
+
+inline bool inRange(const uint32_t range[2], size_t size)
+{
+  return range[0] <= size && range[1] <= size - range[0];
+}
+
+inline void addString(std::string &pool, const std::string &str,
+                      uint32_t range[2])
+{
+  range[0] = pool.size();
+  range[1] = str.size();
+  pool += str;
+}
+
+}  // namespace
+
+
+uint64_t BTagCalibration::checksum(const std::string &csvContent)
+{
+  return checksum(csvContent.data(), csvContent.size());
+}
+
+uint64_t BTagCalibration::checksum(const char *data, size_t size)
+{
+  // 64 bit FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool BTagCalibration::readCache(const std::string &cacheFile,
+                                uint64_t csvChecksum)
+{
+  {
+    std::lock_guard<std::mutex> lock(parseMutex_);
+    checkNotShared("readCache");
+  }
+  std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(cacheFile);
+  if (!file->data() || file->size() < sizeof(CacheHeader)) {
+    return false;
+  }
+
+  const CacheHeader &h = *reinterpret_cast<const CacheHeader*>(file->data());
+  if (memcmp(h.magic, kCacheMagic, sizeof(kCacheMagic))
+      || h.version != kCacheVersion
+      || h.byteOrder != kCacheByteOrder
+      || h.csvChecksum != csvChecksum
+      || file->size() != sizeof(CacheHeader)
+                        + uint64_t(h.nEntries) * sizeof(CacheEntry)
+                        + uint64_t(h.nInstructions)
+                          * sizeof(BTagFormula::Instruction)
+                        + h.stringBytes) {
+    return false;
+  }
+
+  // check all records, but keep them where they are: readers take them
+  // from the mapping, see cachedEntryRef()
+  std::shared_ptr<const char> mapped(file, file->data());
+  const CacheEntry *entries = reinterpret_cast<const CacheEntry*>(
+    file->data() + sizeof(CacheHeader));
+  const BTagFormula::Instruction *code =
+    reinterpret_cast<const BTagFormula::Instruction*>(entries + h.nEntries);
+  const char *strings = reinterpret_cast<const char*>(code + h.nInstructions);
+
+  std::map<std::string, std::vector<uint32_t> > cached;
+  for (uint32_t i = 0; i < h.nEntries; ++i) {
+    const CacheEntry &ce = entries[i];
+    BTagFormula f;
+    if (ce.operatingPoint < 0 || ce.operatingPoint > 3
+        || ce.jetFlavor < 0 || ce.jetFlavor > 2
+        || !inRange(ce.measurementType, h.stringBytes)
+        || !inRange(ce.sysType, h.stringBytes)
+        || !inRange(ce.formula, h.stringBytes)
+        || !inRange(ce.code, h.nInstructions)
+        || (ce.code[1] && !f.reference(code + ce.code[0], ce.code[1], mapped))) {
+      return false;
+    }
+    cached[makeToken(ce.operatingPoint,
+                     std::string(strings + ce.measurementType[0],
+                                 ce.measurementType[1]),
+                     std::string(strings + ce.sysType[0], ce.sysType[1]))
+          ].push_back(i);
+  }
+
+  data_.clear();
+  unparsed_.clear();
+  csvData_.reset();
+  cached_.swap(cached);
+  cacheData_ = mapped;
+  return true;
+}
+
+// records of the cache file, checked by readCache() already
+BTagEntry BTagCalibration::cachedEntry(uint32_t record) const
+{
+  const EntryRef ref = cachedEntryRef(record);
+  const CacheEntry &ce = reinterpret_cast<const CacheEntry*>(
+    cacheData_.get() + sizeof(CacheHeader))[record];
+  const char *strings = ref.formula - ce.formula[0];
+
+  BTagEntry be;
+  be.formula.assign(ref.formula, ref.formulaSize);
+  be.params = BTagEntry::Parameters(
+    BTagEntry::OperatingPoint(ce.operatingPoint),
+    std::string(strings + ce.measurementType[0], ce.measurementType[1]),
+    std::string(strings + ce.sysType[0], ce.sysType[1]),
+    ref.jetFlavor,
+    ref.etaMin,
+    ref.etaMax,
+    ref.ptMin,
+    ref.ptMax,
+    ref.discrMin,
+    ref.discrMax
+  );
+  be.csvLine = ref.csvLine;
+  if (!ref.compiled.empty()) {
+    be.compiled.assign(ref.compiled.codeData(), ref.compiled.codeSize());
+  }
+  return be;
+}
+
+BTagCalibration::EntryRef BTagCalibration::cachedEntryRef(
+  uint32_t record) const
+{
+  const CacheHeader &h = *reinterpret_cast<const CacheHeader*>(
+    cacheData_.get());
+  const CacheEntry *entries = reinterpret_cast<const CacheEntry*>(
+    cacheData_.get() + sizeof(CacheHeader));
+  const BTagFormula::Instruction *code =
+    reinterpret_cast<const BTagFormula::Instruction*>(entries + h.nEntries);
+  const char *strings = reinterpret_cast<const char*>(code + h.nInstructions);
+  const CacheEntry &ce = entries[record];
+
+  EntryRef ref;
+  ref.jetFlavor = BTagEntry::JetFlavor(ce.jetFlavor);
+  ref.etaMin = ce.etaMin;
+  ref.etaMax = ce.etaMax;
+  ref.ptMin = ce.ptMin;
+  ref.ptMax = ce.ptMax;
+  ref.discrMin = ce.discrMin;
+  ref.discrMax = ce.discrMax;
+  ref.formula = strings + ce.formula[0];
+  ref.formulaSize = ce.formula[1];
+  if (ce.code[1]) {
+    ref.compiled.reference(code + ce.code[0], ce.code[1], cacheData_);
+  }
+  ref.csvLine = ce.csvLine;
+  ref.entry = 0;
+  return ref;
+}
+
+bool BTagCalibration::writeCache(const std::string &cacheFile,
+                                 uint64_t csvChecksum) const
+{
+  parseAll();
+  std::vector<CacheEntry> entries;
+  std::vector<BTagFormula::Instruction> code;
+  std::string strings;
+  for (std::map<std::string, std::vector<BTagEntry> >::const_iterator i
+           = data_.cbegin(); i != data_.cend(); ++i) {
+    const std::vector<BTagEntry> &vec = i->second;
+    for (std::vector<BTagEntry>::const_iterator j
+             = vec.cbegin(); j != vec.cend(); ++j) {
+      CacheEntry ce;
+      memset(&ce, 0, sizeof(ce));
+      ce.operatingPoint = j->params.operatingPoint;
+      ce.jetFlavor = j->params.jetFlavor;
+      ce.etaMin = j->params.etaMin;
+      ce.etaMax = j->params.etaMax;
+      ce.ptMin = j->params.ptMin;
+      ce.ptMax = j->params.ptMax;
+      ce.discrMin = j->params.discrMin;
+      ce.discrMax = j->params.discrMax;
+      addString(strings, j->params.measurementType, ce.measurementType);
+      addString(strings, j->params.sysType, ce.sysType);
+      addString(strings, j->formula, ce.formula);
+      ce.csvLine = j->csvLine;
+
+      BTagFormula f = j->compiled;
+      if (f.empty()) {
+        f.compile(j->formula);                   // stays empty for TF1
+      }
+      ce.code[0] = code.size();
+      ce.code[1] = f.codeSize();
+      code.insert(code.end(), f.codeData(), f.codeData() + f.codeSize());
+      entries.push_back(ce);
+    }
+  }
+
+  CacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, kCacheMagic, sizeof(kCacheMagic));
+  h.version = kCacheVersion;
+  h.byteOrder = kCacheByteOrder;
+  h.csvChecksum = csvChecksum;
+  h.nEntries = entries.size();
+  h.nInstructions = code.size();
+  h.stringBytes = strings.size();
+
+  // write to a temporary file and rename it, so that concurrent jobs never
+  // see a half written cache
+  std::stringstream tmpName;
+  tmpName << cacheFile << ".tmp" << getpid();
+  std::ofstream ofs(tmpName.str().c_str(), std::ios::binary);
+  ofs.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  if (entries.size()) {
+    ofs.write(reinterpret_cast<const char*>(&entries[0]),
+              entries.size() * sizeof(CacheEntry));
+  }
+  if (code.size()) {
+    ofs.write(reinterpret_cast<const char*>(&code[0]),
+              code.size() * sizeof(BTagFormula::Instruction));
+  }
+  ofs.write(strings.data(), strings.size());
+  ofs.close();
+  if (!ofs || std::rename(tmpName.str().c_str(), cacheFile.c_str())) {
+    std::remove(tmpName.str().c_str());
+    return false;
+  }
+  return true;
+}
+
+
+
+#include <cmath>
+#include <limits>
+#include <mutex>
+
+class BTagCalibrationReader::BTagCalibrationReaderImpl
+{
+  friend class BTagCalibrationReader;
+
+private:
+  BTagCalibrationReaderImpl(BTagEntry::OperatingPoint op, 
+                            const std::string & sysType,
+                            const std::vector<std::string> & otherSysTypes);
+
+  void load(const BTagCalibration & c,
+            BTagEntry::JetFlavor jf,
+            std::string measurementType);
+
+  double eval(BTagEntry::JetFlavor jf, 
+              float eta, 
+              float pt, 
+              float discr) const;
+
+  void eval_all(BTagEntry::JetFlavor jf,
+                float eta,
+                float pt,
+                float discr,
+                double *out) const;
+
+  void eval_some(BTagEntry::JetFlavor jf,
+                 float eta,
+                 float pt,
+                 float discr,
+                 const int *sys,
+                 int n,
+                 double *out) const;
+
+  void eval_batch(size_t n,
+                  const BTagEntry::JetFlavor *jf,
+                  const float *eta,
+                  const float *pt,
+                  const float *discr,
+                  double *out) const;
+
+  std::pair<float, float> min_max_pt(BTagEntry::JetFlavor jf, 
+                                     float eta, 
+                                     float discr) const;
+
+  bool eval_clamped(BTagEntry::JetFlavor jf,
+                    float eta,
+                    double pt,
+                    float discr,
+                    const int *sys,
+                    int n,
+                    double *out) const;
+
+  // eval_some() and min_max_pt() for an eta folded already; sys 0 stands
+  // for all sysTypes
+  void evalFolded(BTagEntry::JetFlavor jf,
+                  float eta,
+                  float pt,
+                  float discr,
+                  const int *sys,
+                  int n,
+                  double *out) const;
+  std::pair<float, float> ptRange(BTagEntry::JetFlavor jf,
+                                  float eta,
+                                  float discr) const;
+
+  struct TmpEntry {
+    int sys;                                     // index into sysTypes_
+    float etaMin;
+    float etaMax;
+    float ptMin;
+    float ptMax;
+    float discrMin;
+    float discrMax;
+    BTagFormula formula;
+    std::shared_ptr<TF1> func;                   // fallback, if no formula
+    std::shared_ptr<std::mutex> funcMutex;       // TF1::Eval is not const
+    const double *table;                         // if tabulated, see below
+    int tableSize;
+    double tableX0;
+    double tableInvStep;
+  };
+
+  double evalEntry(const TmpEntry &e, double x) const {
+    if (e.table) {
+      return interpolate(e, x);
+    }
+    return evalExact(e, x);
+  }
+  static double evalExact(const TmpEntry &e, double x) {
+    if (e.func) {
+      std::lock_guard<std::mutex> lock(*e.funcMutex);
+      return e.func->Eval(x);
+    }
+    return e.formula.eval(x);
+  }
+
+  // Optional tabulation: every entry is sampled on a uniform grid over its
+  // pt (or discr) range, which is refined until the interpolation error is
+  // bounded by tabTolerance_. The bound comes from enclosures of the
+  // derivatives of the formula per grid cell, found by running its bytecode
+  // on intervals of Taylor coefficients (taylorEnclosure). The grids of one
+  // flavor are stored back to back in tables_, as doubles. Entries that
+  // cannot be bounded (steps, kinks, TF1) or do not converge keep their
+  // formula.
+  void tabulate(BTagEntry::JetFlavor jf);
+  double interpolate(const TmpEntry &e, double x) const {
+    const int n = e.tableSize;
+    double t = (x - e.tableX0) * e.tableInvStep;
+    t = t < 0. ? 0. : (t > n - 1 ? n - 1 : t);
+    int i = int(t);
+    i = i > n - 2 ? n - 2 : i;
+    const double f = t - i;
+    const double *y = e.table + i;
+    if (!tabCubic_) {
+      return y[0] + f * (y[1] - y[0]);
+    }
+    // Catmull-Rom spline, linearly extrapolated at the ends
+    const double ym = i > 0 ? y[-1] : 2.*y[0] - y[1];
+    const double yp = i < n - 2 ? y[2] : 2.*y[1] - y[0];
+    return y[0] + 0.5 * f * (y[1] - ym + f * (2.*ym - 5.*y[0] + 4.*y[1] - yp
+                                              + f * (3.*(y[0] - y[1]) + yp - ym)));
+  }
+
+  // Interval index over the entries of one jet flavor: the sorted bin edges
+  // of all entries (of all sysTypes) span a grid, and every grid cell holds
+  // per sysType the first entry (in csv order) covering it, which is exactly
+  // what the linear scan finds. The discr axis is only used for reshaping.
+  // If the grid would get too large (irregular binning), valid is false and
+  // the linear scan is used.
+  struct BinIndex {
+    BinIndex(): valid(false) {}
+    bool valid;
+    std::vector<float> etaEdges;
+    std::vector<float> ptEdges;
+    std::vector<float> discrEdges;
+    std::vector<int> cells;                      // [cell][sys]: entry or -1
+  };
+
+  void buildIndex(BTagEntry::JetFlavor jf);
+  int findCell(BTagEntry::JetFlavor jf,
+               float eta,
+               float pt,
+               float discr) const;
+  const TmpEntry * findEntry(BTagEntry::JetFlavor jf,
+                             float eta,
+                             float pt,
+                             float discr) const;
+  const TmpEntry * scanEntries(BTagEntry::JetFlavor jf,
+                               int sys,
+                               float eta,
+                               float pt,
+                               float discr) const;
+
+  // pt range of min_max_pt() per eta and discr bin: the edges of the default
+  // sysType's entries span a grid, and the linear scan gives the same result
+  // everywhere in a cell. Discr bin 0 stands for a discr outside of all
+  // entries (or nan); the first matching entry still counts there, as the
+  // scan takes it without checking discr. Only reshaping uses discr bins.
+  struct PtRangeIndex {
+    PtRangeIndex(): valid(false), nDiscr(1) {}
+    bool valid;
+    int nDiscr;                                  // discr bins, including bin 0
+    std::vector<float> etaEdges;
+    std::vector<float> discrEdges;
+    std::vector<std::pair<float, float> > ranges;  // [eta bin][discr bin]
+  };
+
+  void buildPtRanges(BTagEntry::JetFlavor jf);
+  std::pair<float, float> scanPtRange(BTagEntry::JetFlavor jf,
+                                      float eta,
+                                      float discr) const;
+
+  BTagEntry::OperatingPoint op_;
+  std::vector<std::string> sysTypes_;            // first one is the default
+  std::vector<std::vector<TmpEntry> > tmpData_;  // first index: jetFlavor
+  std::vector<bool> useAbsEta_;                  // first index: jetFlavor
+  std::vector<std::vector<int> > sysIndices_;    // first index: jetFlavor
+  std::vector<BinIndex> index_;                  // first index: jetFlavor
+  std::vector<PtRangeIndex> ptRanges_;           // first index: jetFlavor
+  double tabTolerance_;                          // 0: no tabulation
+  bool tabCubic_;
+  std::vector<std::vector<double> > tables_;     // first index: jetFlavor
+  std::vector<double> tabError_;                 // first index: jetFlavor
+  bool lockFree_;                                // no TF1 fallback loaded
+};
+
+
+namespace {
+
+// max. number of cells times sysTypes per flavor before falling back to the
+// linear scan
+const size_t kMaxIndexCells = 1 << 18;
+
+void sortedEdges(std::vector<float> &edges)
+{
+  std::sort(edges.begin(), edges.end());
+  edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+}
+
+// index of the bin [edges[i], edges[i+1]) containing x, or -1
+inline int findBin(const std::vector<float> &edges, float x)
+{
+  int i = int(std::upper_bound(edges.begin(), edges.end(), x)
+              - edges.begin()) - 1;
+  if (i < 0 || i >= int(edges.size()) - 1) {
+    return -1;
+  }
+  return i;
+}
+
+// range of bins [first, second) covered by the interval [lo, hi)
+inline std::pair<int, int> binRange(const std::vector<float> &edges,
+                                    float lo,
+                                    float hi)
+{
+  int first = int(std::lower_bound(edges.begin(), edges.end(), lo)
+                  - edges.begin());
+  int second = int(std::lower_bound(edges.begin(), edges.end(), hi)
+                   - edges.begin());
+  return std::make_pair(first, second);
+}
+
+// entries with nan bounds are never found by the linear scan
+template <class Entry>
+bool hasNanBounds(const Entry &e, bool use_discr)
+{
+  return std::isnan(e.etaMin) || std::isnan(e.etaMax)
+         || std::isnan(e.ptMin) || std::isnan(e.ptMax)
+         || (use_discr && (std::isnan(e.discrMin) || std::isnan(e.discrMax)));
+}
+
+}  // namespace
+
+
+BTagCalibrationReader::BTagCalibrationReaderImpl::BTagCalibrationReaderImpl(
+                                             BTagEntry::OperatingPoint op,
+                                             const std::string & sysType,
+                                             const std::vector<std::string> & otherSysTypes):
+  op_(op),
+  sysTypes_(1, sysType),
+  tmpData_(3),
+  useAbsEta_(3, true),
+  sysIndices_(3),
+  index_(3),
+  ptRanges_(3),
+  tabTolerance_(0.),
+  tabCubic_(false),
+  tables_(3),
+  tabError_(3, 0.),
+  lockFree_(true)
+{
+  for (const auto &sys : otherSysTypes) {
+    if (std::find(sysTypes_.begin(), sysTypes_.end(), sys) != sysTypes_.end()) {
+std::cerr << "ERROR in BTagCalibrationReader: "
+          << "sysType given more than once: "
+          << sys;
+throw std::exception();
+    }
+    sysTypes_.push_back(sys);
+  }
+}
+
+void BTagCalibrationReader::BTagCalibrationReaderImpl::load(
+                                             const BTagCalibration & c,
+                                             BTagEntry::JetFlavor jf,
+                                             std::string measurementType)
+{
+  if (tmpData_[jf].size()) {
+std::cerr << "ERROR in BTagCalibrationReader: "
+          << "Data for this jet-flavor is already loaded: "
+          << jf;
+throw std::exception();
+  }
+
+  for (unsigned sys = 0; sys < sysTypes_.size(); ++sys) {
+    BTagEntry::Parameters params(op_, measurementType, sysTypes_[sys]);
+    const std::vector<BTagCalibration::EntryRef> entries
+      = c.getEntryRefs(params);
+
+    for (const auto &be : entries) {
+      if (be.jetFlavor != jf) {
+        continue;
+      }
+
+      TmpEntry te;
+      te.table = 0;
+      te.tableSize = 0;
+      te.tableX0 = 0.;
+      te.tableInvStep = 0.;
+      te.sys = sys;
+      te.etaMin = be.etaMin;
+      te.etaMax = be.etaMax;
+      te.ptMin = be.ptMin;
+      te.ptMax = be.ptMax;
+      te.discrMin = be.discrMin;
+      te.discrMax = be.discrMax;
+
+      // compile natively (unless done already, e.g. in a cache file, whose
+      // bytecode is used in place), use TF1 only if the formula is not
+      // understood
+      const std::string formula(be.formula, be.formulaSize);
+      if (!be.compiled.empty()) {
+        te.formula = be.compiled;
+      } else if (!te.formula.compile(formula)) {
+        if (op_ == BTagEntry::OP_RESHAPING) {
+          te.func = std::make_shared<TF1>("", formula.c_str(),
+                                          be.discrMin, be.discrMax);
+        } else {
+          te.func = std::make_shared<TF1>("", formula.c_str(),
+                                          be.ptMin, be.ptMax);
+        }
+        // formulas read from csv files are only checked here
+        if (te.func->IsZombie()) {
+          // report where the line is in the csv, not how it looks after
+          // parsing (entries made in code have no line)
+          const std::string where = be.csvLine
+            ? "line " + std::to_string(be.csvLine) + ": " + formula
+            : (be.entry ? be.entry->makeCSVLine() : formula);
+std::cerr << "ERROR in BTagCalibration: "
+          << "Invalid csv line; formula does not compile: "
+          << where;
+throw std::exception();
+        }
+        te.funcMutex = std::make_shared<std::mutex>();
+        lockFree_ = false;
+      }
+
+      tmpData_[be.jetFlavor].push_back(te);
+      if (te.etaMin < 0) {
+        useAbsEta_[be.jetFlavor] = false;
+      }
+    }
+    if (!tmpData_[jf].empty() && tmpData_[jf].back().sys == int(sys)) {
+      sysIndices_[jf].push_back(sys);
+    }
+  }
+
+  buildIndex(jf);
+  buildPtRanges(jf);
+  if (tabTolerance_ > 0.) {
+    tabulate(jf);
+  }
+}
+
+namespace {
+
+// Interval arithmetic for the error bound of the tabulation. Every result is
+// widened by one ulp per side (two after library functions), more than the
+// rounding of the operation, so the intervals enclose the exact results.
+struct Interval {
+  double lo;
+  double hi;
+};
+
+inline Interval pointInterval(double v)
+{
+  Interval r = {v, v};
+  return r;
+}
+
+inline Interval widened(double lo, double hi, int ulps=1)
+{
+  for (int i = 0; i < ulps; ++i) {
+    lo = std::nextafter(lo, -std::numeric_limits<double>::infinity());
+    hi = std::nextafter(hi, std::numeric_limits<double>::infinity());
+  }
+  Interval r = {lo, hi};
+  return r;
+}
+
+inline Interval operator+(Interval a, Interval b)
+{
+  return widened(a.lo + b.lo, a.hi + b.hi);
+}
+
+inline Interval operator-(Interval a, Interval b)
+{
+  return widened(a.lo - b.hi, a.hi - b.lo);
+}
+
+inline Interval operator*(Interval a, Interval b)
+{
+  const double p[4] = {a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi};
+  return widened(*std::min_element(p, p + 4), *std::max_element(p, p + 4));
+}
+
+// b must not contain 0
+inline Interval operator/(Interval a, Interval b)
+{
+  const double q[4] = {a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi};
+  return widened(*std::min_element(q, q + 4), *std::max_element(q, q + 4));
+}
+
+inline bool containsZero(Interval a) {return a.lo <= 0. && a.hi >= 0.;}
+inline double magnitude(Interval a) {return std::max(-a.lo, a.hi);}
+
+// Taylor coefficients f^(k)(xi) / k! of one stack value, k <= kMaxTaylorOrder,
+// enclosed for all xi in the interval the formula is evaluated on
+const int kMaxTaylorOrder = 4;
+struct Taylor {
+  Interval c[kMaxTaylorOrder + 1];
+  bool isConst;                                  // exact constant c[0].lo
+};
+
+inline Taylor constantTaylor(double v)
+{
+  Taylor t;
+  t.c[0] = pointInterval(v);
+  for (int k = 1; k <= kMaxTaylorOrder; ++k) {
+    t.c[k] = pointInterval(0.);
+  }
+  t.isConst = true;
+  return t;
+}
+
+// truth value of a condition on the whole interval: 1, 0, or -1 if it
+// changes (or may change) inside
+inline int truth(const Taylor &t)
+{
+  if (t.c[0].lo == 0. && t.c[0].hi == 0.) {
+    return 0;
+  }
+  return containsZero(t.c[0]) ? -1 : 1;
+}
+
+Taylor taylorMul(const Taylor &a, const Taylor &b, int order)
+{
+  Taylor r;
+  r.isConst = false;
+  for (int k = 0; k <= order; ++k) {
+    r.c[k] = a.c[0] * b.c[k];
+    for (int j = 1; j <= k; ++j) {
+      r.c[k] = r.c[k] + a.c[j] * b.c[k - j];
+    }
+  }
+  return r;
+}
+
+bool taylorDiv(const Taylor &a, const Taylor &b, int order, Taylor &r)
+{
+  if (containsZero(b.c[0])) {
+    return false;
+  }
+  r.isConst = false;
+  for (int k = 0; k <= order; ++k) {
+    Interval s = a.c[k];
+    for (int j = 0; j < k; ++j) {
+      s = s - r.c[j] * b.c[k - j];
+    }
+    r.c[k] = s / b.c[0];
+  }
+  return true;
+}
+
+Taylor taylorExp(const Taylor &u, int order)
+{
+  Taylor r;
+  r.isConst = false;
+  r.c[0] = widened(std::exp(u.c[0].lo), std::exp(u.c[0].hi), 2);
+  for (int k = 1; k <= order; ++k) {
+    Interval s = pointInterval(0.);
+    for (int j = 1; j <= k; ++j) {
+      s = s + pointInterval(j) * u.c[j] * r.c[k - j];
+    }
+    r.c[k] = s / pointInterval(k);
+  }
+  return r;
+}
+
+bool taylorLog(const Taylor &u, int order, Taylor &r)
+{
+  if (!(u.c[0].lo > 0.)) {
+    return false;
+  }
+  r.isConst = false;
+  r.c[0] = widened(std::log(u.c[0].lo), std::log(u.c[0].hi), 2);
+  for (int k = 1; k <= order; ++k) {
+    Interval s = pointInterval(0.);
+    for (int j = 1; j < k; ++j) {
+      s = s + pointInterval(j) * r.c[j] * u.c[k - j];
+    }
+    r.c[k] = (u.c[k] - s / pointInterval(k)) / u.c[0];
+  }
+  return true;
+}
+
+bool taylorSqrt(const Taylor &u, int order, Taylor &r)
+{
+  if (!(u.c[0].lo > 0.)) {
+    return false;
+  }
+  r.isConst = false;
+  r.c[0] = widened(std::sqrt(u.c[0].lo), std::sqrt(u.c[0].hi));
+  for (int k = 1; k <= order; ++k) {
+    Interval s = u.c[k];
+    for (int j = 1; j < k; ++j) {
+      s = s - r.c[j] * r.c[k - j];
+    }
+    r.c[k] = s / (pointInterval(2.) * r.c[0]);
+  }
+  return true;
+}
+
+// u^p for a constant p
+bool taylorPow(const Taylor &u, double p, int order, Taylor &r)
+{
+  if (p == 0.) {
+    r = constantTaylor(1.);
+    return true;
+  }
+  if (!(u.c[0].lo > 0.)) {
+    // non-positive bases only for small integer powers
+    if (p != std::floor(p) || p < 0. || p > 16.) {
+      return false;
+    }
+    r = u;
+    for (int i = 1; i < int(p); ++i) {
+      r = taylorMul(r, u, order);
+    }
+    return true;
+  }
+  const double a = std::pow(u.c[0].lo, p);
+  const double b = std::pow(u.c[0].hi, p);
+  r.isConst = false;
+  r.c[0] = widened(std::min(a, b), std::max(a, b), 2);
+  for (int k = 1; k <= order; ++k) {
+    Interval s = pointInterval(0.);
+    for (int j = 0; j < k; ++j) {
+      const Interval f = pointInterval(p) * pointInterval(k - j)
+                         - pointInterval(j);
+      s = s + f * u.c[k - j] * r.c[j];
+    }
+    r.c[k] = s / (pointInterval(k) * u.c[0]);
+  }
+  return true;
+}
+
+bool taylorBinary(int op, const Taylor &a, const Taylor &b, int order,
+                  Taylor &r)
+{
+  if (a.isConst && b.isConst) {                  // as the formula does it
+    r = constantTaylor(applyBinary(op, a.c[0].lo, b.c[0].lo));
+    return true;
+  }
+  const Interval &x = a.c[0];
+  const Interval &y = b.c[0];
+  int decided = -1;                              // for steps: 0 or 1
+  switch (op) {
+    case BTagFormula::ADD:
+    case BTagFormula::SUB:
+      r.isConst = false;
+      for (int k = 0; k <= order; ++k) {
+        r.c[k] = op == BTagFormula::ADD ? a.c[k] + b.c[k] : a.c[k] - b.c[k];
+      }
+      return true;
+    case BTagFormula::MUL:
+      r = taylorMul(a, b, order);
+      return true;
+    case BTagFormula::DIV:
+      return taylorDiv(a, b, order, r);
+    case BTagFormula::POW:
+      if (b.isConst) {
+        return taylorPow(a, b.c[0].lo, order, r);
+      } else {
+        Taylor l;
+        if (!taylorLog(a, order, l)) {
+          return false;
+        }
+        r = taylorExp(taylorMul(b, l, order), order);
+        return true;
+      }
+    case BTagFormula::MIN:
+    case BTagFormula::MAX:
+      if (x.hi <= y.lo) {
+        r = op == BTagFormula::MIN ? a : b;
+        return true;
+      }
+      if (y.hi <= x.lo) {
+        r = op == BTagFormula::MIN ? b : a;
+        return true;
+      }
+      return false;
+    case BTagFormula::LT:
+      decided = x.hi < y.lo ? 1 : (x.lo >= y.hi ? 0 : -1);
+      break;
+    case BTagFormula::LE:
+      decided = x.hi <= y.lo ? 1 : (x.lo > y.hi ? 0 : -1);
+      break;
+    case BTagFormula::GT:
+      decided = x.lo > y.hi ? 1 : (x.hi <= y.lo ? 0 : -1);
+      break;
+    case BTagFormula::GE:
+      decided = x.lo >= y.hi ? 1 : (x.hi < y.lo ? 0 : -1);
+      break;
+    case BTagFormula::EQ:
+    case BTagFormula::NE:
+      if (x.hi < y.lo || y.hi < x.lo) {
+        decided = op == BTagFormula::NE;
+      }
+      break;
+    case BTagFormula::AND:
+    case BTagFormula::OR: {
+      const int ta = truth(a), tb = truth(b);
+      if (op == BTagFormula::AND) {
+        decided = (ta == 0 || tb == 0) ? 0 : ((ta == 1 && tb == 1) ? 1 : -1);
+      } else {
+        decided = (ta == 1 || tb == 1) ? 1 : ((ta == 0 && tb == 0) ? 0 : -1);
+      }
+      break;
+    }
+  }
+  if (decided < 0) {                             // step inside
+    return false;
+  }
+  r = constantTaylor(decided);
+  return true;
+}
+
+bool taylorUnary(int op, const Taylor &u, int order, Taylor &r)
+{
+  if (u.isConst) {
+    r = constantTaylor(applyUnary(op, u.c[0].lo));
+    return true;
+  }
+  switch (op) {
+    case BTagFormula::NEG:
+      r.isConst = false;
+      for (int k = 0; k <= order; ++k) {
+        r.c[k] = pointInterval(0.) - u.c[k];
+      }
+      return true;
+    case BTagFormula::NOT:
+      if (truth(u) < 0) {
+        return false;
+      }
+      r = constantTaylor(!truth(u));
+      return true;
+    case BTagFormula::LOG:
+      return taylorLog(u, order, r);
+    case BTagFormula::LOG10:
+      if (!taylorLog(u, order, r)) {
+        return false;
+      }
+      for (int k = 0; k <= order; ++k) {        // 1/ln(10) is rounded, too
+        r.c[k] = r.c[k] * widened(1. / std::log(10.), 1. / std::log(10.));
+      }
+      return true;
+    case BTagFormula::EXP:
+      r = taylorExp(u, order);
+      return true;
+    case BTagFormula::SQRT:
+      return taylorSqrt(u, order, r);
+    case BTagFormula::ABS:
+      if (u.c[0].lo >= 0.) {
+        r = u;
+        return true;
+      }
+      if (u.c[0].hi <= 0.) {
+        return taylorUnary(BTagFormula::NEG, u, order, r);
+      }
+      return false;                              // kink inside
+  }
+  return false;
+}
+
+inline bool isFinite(const Taylor &t, int order)
+{
+  for (int k = 0; k <= order; ++k) {
+    if (!std::isfinite(t.c[k].lo) || !std::isfinite(t.c[k].hi)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs the bytecode of f on Taylor coefficients, with x = [a, b]: out[k]
+// encloses f^(k)(xi) / k! for all xi in [a, b], k <= order. Returns false if
+// that is not possible: steps, kinks or poles in [a, b], or no bytecode.
+bool taylorEnclosure(const BTagFormula &f, double a, double b, int order,
+                     Interval *out)
+{
+  const int size = f.codeSize();
+  if (!size) {
+    return false;
+  }
+  const BTagFormula::Instruction *code = f.codeData();
+  Taylor stack[BTagFormula::kMaxStackSize];
+  int sp = -1;
+  for (int pc = 0; pc < size; ++pc) {
+    const BTagFormula::Instruction &in = code[pc];
+    Taylor r;
+    switch (in.op) {
+      case BTagFormula::PUSH_CONST:
+        stack[++sp] = constantTaylor(in.value);
+        continue;
+      case BTagFormula::PUSH_X:
+        r = constantTaylor(0.);
+        r.c[0].lo = a;
+        r.c[0].hi = b;
+        r.c[1] = pointInterval(1.);
+        r.isConst = (a == b);
+        stack[++sp] = r;
+        continue;
+      case BTagFormula::ADD_CONST:
+      case BTagFormula::SUB_CONST:
+      case BTagFormula::MUL_CONST:
+      case BTagFormula::DIV_CONST: {
+        const int op = in.op == BTagFormula::ADD_CONST ? BTagFormula::ADD
+                     : (in.op == BTagFormula::SUB_CONST ? BTagFormula::SUB
+                     : (in.op == BTagFormula::MUL_CONST ? BTagFormula::MUL
+                                                        : BTagFormula::DIV));
+        if (!taylorBinary(op, stack[sp], constantTaylor(in.value), order, r)) {
+          return false;
+        }
+        break;
+      }
+      case BTagFormula::RSUB_CONST:
+      case BTagFormula::RDIV_CONST: {
+        const int op = in.op == BTagFormula::RSUB_CONST ? BTagFormula::SUB
+                                                        : BTagFormula::DIV;
+        if (!taylorBinary(op, constantTaylor(in.value), stack[sp], order, r)) {
+          return false;
+        }
+        break;
+      }
+      case BTagFormula::NEG: case BTagFormula::NOT:
+      case BTagFormula::LOG: case BTagFormula::LOG10: case BTagFormula::EXP:
+      case BTagFormula::SQRT: case BTagFormula::ABS:
+        if (!taylorUnary(in.op, stack[sp], order, r)) {
+          return false;
+        }
+        break;
+      case BTagFormula::JUMP_IF_FALSE: {
+        const int t = truth(stack[sp--]);
+        if (t < 0) {
+          return false;
+        }
+        if (!t) {
+          pc = in.arg - 1;
+        }
+        continue;
+      }
+      case BTagFormula::JUMP:
+        pc = in.arg - 1;
+        continue;
+      default:                                   // binary
+        --sp;
+        if (!taylorBinary(in.op, stack[sp], stack[sp + 1], order, r)) {
+          return false;
+        }
+        break;
+    }
+    if (!isFinite(r, order)) {
+      return false;
+    }
+    stack[sp] = r;
+  }
+  for (int k = 0; k <= order; ++k) {
+    out[k] = stack[0].c[k];
+  }
+  return true;
+}
+
+}  // namespace
+
+
+void BTagCalibrationReader::BTagCalibrationReaderImpl::tabulate(
+                                             BTagEntry::JetFlavor jf)
+{
+  const int kMaxTablePoints = 4097;
+  const int order = tabCubic_ ? 4 : 2;
+  const double eps = std::numeric_limits<double>::epsilon();
+  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
+  auto &entries = tmpData_[jf];
+  std::vector<double> &tables = tables_[jf];
+  std::vector<int> offsets(entries.size(), -1);
+  std::vector<double> m2, m3, m4;                // max. |f''|, ... per cell
+  double maxError = 0.;
+
+  for (unsigned i = 0; i < entries.size(); ++i) {
+    TmpEntry &e = entries[i];
+    const double lo = use_discr ? e.discrMin : e.ptMin;
+    const double hi = use_discr ? e.discrMax : e.ptMax;
+    if (!(lo < hi) || !std::isfinite(lo) || !std::isfinite(hi)) {
+      continue;
+    }
+
+    for (int nIntervals = 1; nIntervals < kMaxTablePoints; nIntervals *= 2) {
+      const double step = (hi - lo) / nIntervals;
+      m2.assign(nIntervals, 0.);
+      m3.assign(nIntervals, 0.);
+      m4.assign(nIntervals, 0.);
+      // rounding of the stored values, of the grid positions and of the
+      // interpolation, a few ulps each
+      double rounding = 0.;
+      bool bounded = true;
+      for (int k = 0; k < nIntervals && bounded; ++k) {
+        Interval c[kMaxTaylorOrder + 1];
+        bounded = taylorEnclosure(e.formula, lo + k * step,
+                                  k + 1 < nIntervals ? lo + (k + 1) * step : hi,
+                                  order, c);
+        if (bounded) {
+          m2[k] = 2. * magnitude(c[2]);
+          if (tabCubic_) {
+            m3[k] = 6. * magnitude(c[3]);
+            m4[k] = 24. * magnitude(c[4]);
+          }
+          rounding = std::max(rounding, 16. * eps * (magnitude(c[0])
+                              + (std::fabs(lo) + std::fabs(hi)) * magnitude(c[1])));
+        }
+      }
+      if (!bounded) {
+        break;                                   // steps etc., keep formula
+      }
+
+      // Linear: |f - p| <= h^2/8 max|f''| in a cell. Cubic: the Hermite
+      // spline through the cell with exact slopes is off by at most
+      // h^4/384 max|f''''|, and Catmull-Rom's slopes (in units of h) by
+      // h^3/6 max|f'''| around inner nodes (central differences) and
+      // h^2/2 max|f''| at the ends (forward differences), weighted with at
+      // most 4/27 each.
+      double error = 0.;
+      for (int k = 0; k < nIntervals; ++k) {
+        double err;
+        if (!tabCubic_) {
+          err = step * step / 8. * m2[k];
+        } else {
+          const double h3 = step * step * step / 6.;
+          const double slope0 = k > 0 ? h3 * std::max(m3[k - 1], m3[k])
+                                      : step * step / 2. * m2[k];
+          const double slope1 = k + 1 < nIntervals
+                                ? h3 * std::max(m3[k], m3[k + 1])
+                                : step * step / 2. * m2[k];
+          err = step * step * step * step / 384. * m4[k]
+                + 4. / 27. * (slope0 + slope1);
+        }
+        error = std::max(error, err);
+      }
+      error += rounding;
+
+      if (error <= tabTolerance_) {
+        offsets[i] = int(tables.size());
+        e.tableSize = nIntervals + 1;
+        for (int k = 0; k <= nIntervals; ++k) {
+          tables.push_back(evalExact(e, k < nIntervals ? lo + k * step : hi));
+        }
+        e.tableX0 = lo;
+        e.tableInvStep = 1. / step;
+        maxError = error > maxError ? error : maxError;
+        break;
+      }
+    }
+  }
+
+  // the table storage does not move anymore, set the pointers
+  for (unsigned i = 0; i < entries.size(); ++i) {
+    if (offsets[i] >= 0) {
+      entries[i].table = &tables[offsets[i]];
+    } else {
+      entries[i].tableSize = 0;
+    }
+  }
+  tabError_[jf] = maxError;
+}
+
+void BTagCalibrationReader::BTagCalibrationReaderImpl::buildIndex(
+                                             BTagEntry::JetFlavor jf)
+{
+  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
+  const auto &entries = tmpData_[jf];
+  const size_t nSys = sysTypes_.size();
+  BinIndex idx;
+
+  for (const auto &e : entries) {
+    if (hasNanBounds(e, use_discr)) {
+      continue;
+    }
+    idx.etaEdges.push_back(e.etaMin);
+    idx.etaEdges.push_back(e.etaMax);
+    idx.ptEdges.push_back(e.ptMin);
+    idx.ptEdges.push_back(e.ptMax);
+    if (use_discr) {
+      idx.discrEdges.push_back(e.discrMin);
+      idx.discrEdges.push_back(e.discrMax);
+    }
+  }
+  sortedEdges(idx.etaEdges);
+  sortedEdges(idx.ptEdges);
+  sortedEdges(idx.discrEdges);
+
+  size_t nEta = idx.etaEdges.size() > 1 ? idx.etaEdges.size() - 1 : 0;
+  size_t nPt = idx.ptEdges.size() > 1 ? idx.ptEdges.size() - 1 : 0;
+  size_t nDiscr = 1;
+  if (use_discr) {
+    nDiscr = idx.discrEdges.size() > 1 ? idx.discrEdges.size() - 1 : 0;
+  }
+  if (nEta && nPt && nDiscr
+      && nEta > kMaxIndexCells / nSys / nPt / nDiscr) {
+    index_[jf] = BinIndex();                              // linear scan
+    return;
+  }
+  idx.cells.assign(nEta * nPt * nDiscr * nSys, -1);
+
+  // paint the entries in reverse order, so the first matching one wins
+  for (int i = int(entries.size()) - 1; i >= 0; --i) {
+    const auto &e = entries[i];
+    if (hasNanBounds(e, use_discr)) {
+      continue;
+    }
+    std::pair<int, int> etaBins = binRange(idx.etaEdges, e.etaMin, e.etaMax);
+    std::pair<int, int> ptBins = binRange(idx.ptEdges, e.ptMin, e.ptMax);
+    std::pair<int, int> discrBins(0, 1);
+    if (use_discr) {
+      discrBins = binRange(idx.discrEdges, e.discrMin, e.discrMax);
+    }
+    for (int ie = etaBins.first; ie < etaBins.second; ++ie) {
+      for (int ip = ptBins.first; ip < ptBins.second; ++ip) {
+        for (int id = discrBins.first; id < discrBins.second; ++id) {
+          idx.cells[((ie * nPt + ip) * nDiscr + id) * nSys + e.sys] = i;
+        }
+      }
+    }
+  }
+
+  idx.valid = true;
+  index_[jf] = idx;
+}
+
+int BTagCalibrationReader::BTagCalibrationReaderImpl::findCell(
+                                             BTagEntry::JetFlavor jf,
+                                             float eta,
+                                             float pt,
+                                             float discr) const
+{
+  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
+  const BinIndex &idx = index_[jf];
+
+  int ie = findBin(idx.etaEdges, eta);
+  int ip = findBin(idx.ptEdges, pt);
+  int id = use_discr ? findBin(idx.discrEdges, discr) : 0;
+  if (ie < 0 || ip < 0 || id < 0) {
+    return -1;
+  }
+  int nPt = int(idx.ptEdges.size()) - 1;
+  int nDiscr = use_discr ? int(idx.discrEdges.size()) - 1 : 1;
+  return (ie * nPt + ip) * nDiscr + id;
+}
+
+const BTagCalibrationReader::BTagCalibrationReaderImpl::TmpEntry *
+BTagCalibrationReader::BTagCalibrationReaderImpl::scanEntries(
+                                             BTagEntry::JetFlavor jf,
+                                             int sys,
+                                             float eta,
+                                             float pt,
+                                             float discr) const
+{
+  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
+
+  // search linearly through eta, pt and discr ranges
+  const auto &entries = tmpData_.at(jf);
+  for (unsigned i=0; i<entries.size(); ++i) {
+    const auto &e = entries.at(i);
+    if (e.sys != sys) {
+      continue;
+    }
+    if (
+      e.etaMin <= eta && eta < e.etaMax                   // find eta
+      && e.ptMin <= pt && pt < e.ptMax                    // check pt
+    ){
+      if (use_discr) {                                    // discr. reshaping?
+        if (e.discrMin <= discr && discr < e.discrMax) {  // check discr
+          return &e;
+        }
+      } else {
+        return &e;
+      }
+    }
+  }
+
+  return 0;
+}
+
+const BTagCalibrationReader::BTagCalibrationReaderImpl::TmpEntry *
+BTagCalibrationReader::BTagCalibrationReaderImpl::findEntry(
+                                             BTagEntry::JetFlavor jf,
+                                             float eta,
+                                             float pt,
+                                             float discr) const
+{
+  const BinIndex &idx = index_[jf];
+  if (!idx.valid) {
+    return scanEntries(jf, 0, eta, pt, discr);
+  }
+  int cell = findCell(jf, eta, pt, discr);
+  int i = cell < 0 ? -1 : idx.cells[cell * sysTypes_.size()];
+  return i < 0 ? 0 : &tmpData_[jf][i];
+}
+
+double BTagCalibrationReader::BTagCalibrationReaderImpl::eval(
+                                             BTagEntry::JetFlavor jf,
+                                             float eta,
+                                             float pt,
+                                             float discr) const
+{
+  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
+  if (useAbsEta_[jf] && eta < 0) {
+    eta = -eta;
+  }
+
+  const TmpEntry *e = findEntry(jf, eta, pt, discr);
+  if (!e) {
+    return 0.;  // default value
+  }
+  return evalEntry(*e, use_discr ? discr : pt);
+}
+
+void BTagCalibrationReader::BTagCalibrationReaderImpl::eval_batch(
+                                             size_t n,
+                                             const BTagEntry::JetFlavor *jf,
+                                             const float *eta,
+                                             const float *pt,
+                                             const float *discr,
+                                             double *out) const
+{
+  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
+  const int kBatch = BTagFormula::kBatchSize;
+  std::pair<const TmpEntry *, int> jets[kBatch];  // entry and jet in block
+  double xs[kBatch];
+  double ys[kBatch];
+
+  for (size_t start = 0; start < n; start += kBatch) {
+    const int m = n - start < size_t(kBatch) ? int(n - start) : kBatch;
+
+    // look up the entries of the block
+    int nJets = 0;
+    for (int l = 0; l < m; ++l) {
+      const size_t j = start + l;
+      const BTagEntry::JetFlavor f = jf[j];
+      const float d = discr ? discr[j] : 0.f;
+      const float et = (useAbsEta_[f] && eta[j] < 0) ? -eta[j] : eta[j];
+      const TmpEntry *e = findEntry(f, et, pt[j], d);
+      if (!e) {
+        out[j] = 0.;  // default value
+      } else if (e->func || e->table) {
+        out[j] = evalEntry(*e, use_discr ? d : pt[j]);
+      } else {
+        jets[nJets++] = std::make_pair(e, l);
+      }
+    }
+
+    // evaluate all jets sharing an entry with one call
+    std::sort(jets, jets + nJets);
+    for (int first = 0; first < nJets; ) {
+      const TmpEntry *e = jets[first].first;
+      int last = first;
+      for (; last < nJets && jets[last].first == e; ++last) {
+        const size_t j = start + jets[last].second;
+        xs[last - first] = use_discr ? discr[j] : pt[j];
+      }
+      e->formula.eval_batch(xs, ys, last - first);
+      for (int k = first; k < last; ++k) {
+        out[start + jets[k].second] = ys[k - first];
+      }
+      first = last;
+    }
+  }
+}
+
+void BTagCalibrationReader::BTagCalibrationReaderImpl::eval_all(
+                                             BTagEntry::JetFlavor jf,
+                                             float eta,
+                                             float pt,
+                                             float discr,
+                                             double *out) const
+{
+  if (useAbsEta_[jf] && eta < 0) {
+    eta = -eta;
+  }
+  evalFolded(jf, eta, pt, discr, 0, int(sysTypes_.size()), out);
+}
+
+void BTagCalibrationReader::BTagCalibrationReaderImpl::eval_some(
+                                             BTagEntry::JetFlavor jf,
+                                             float eta,
+                                             float pt,
+                                             float discr,
+                                             const int *sys,
+                                             int n,
+                                             double *out) const
+{
+  if (useAbsEta_[jf] && eta < 0) {
+    eta = -eta;
+  }
+  evalFolded(jf, eta, pt, discr, sys, n, out);
+}
+
+bool BTagCalibrationReader::BTagCalibrationReaderImpl::eval_clamped(
+                                             BTagEntry::JetFlavor jf,
+                                             float eta,
+                                             double pt,
+                                             float discr,
+                                             const int *sys,
+                                             int n,
+                                             double *out) const
+{
+  if (useAbsEta_[jf] && eta < 0) {
+    eta = -eta;
+  }
+
+  // same clamping as the users of min_max_pt() do by hand
+  std::pair<float, float> bounds = ptRange(jf, eta, discr);
+  float pt_for_eval = pt;
+  bool is_out_of_bounds = false;
+  if (pt < bounds.first) {
+    pt_for_eval = bounds.first + 1e-5;
+    is_out_of_bounds = true;
+  } else if (pt >= bounds.second) {
+    pt_for_eval = bounds.second - 0.1;
+    is_out_of_bounds = true;
+  }
+
+  evalFolded(jf, eta, pt_for_eval, discr, sys, n, out);
+  return is_out_of_bounds;
+}
+
+void BTagCalibrationReader::BTagCalibrationReaderImpl::evalFolded(
+                                             BTagEntry::JetFlavor jf,
+                                             float eta,
+                                             float pt,
+                                             float discr,
+                                             const int *sys,
+                                             int n,
+                                             double *out) const
+{
+  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
+  const double x = use_discr ? discr : pt;
+  const int nSys = int(sysTypes_.size());
+  const auto &entries = tmpData_[jf];
+  const BinIndex &idx = index_[jf];
+
+  if (idx.valid) {
+    int cell = findCell(jf, eta, pt, discr);
+    const int *slots = cell < 0 ? 0 : &idx.cells[cell * nSys];
+    for (int k = 0; k < n; ++k) {
+      int i = slots ? slots[sys ? sys[k] : k] : -1;
+      out[k] = i < 0 ? 0. : evalEntry(entries[i], x);
+    }
+    return;
+  }
+
+  for (int k = 0; k < n; ++k) {
+    const TmpEntry *e = scanEntries(jf, sys ? sys[k] : k, eta, pt, discr);
+    out[k] = e ? evalEntry(*e, x) : 0.;
+  }
+}
+
+void BTagCalibrationReader::BTagCalibrationReaderImpl::buildPtRanges(
+                                             BTagEntry::JetFlavor jf)
+{
+  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
+  PtRangeIndex idx;
+
+  // entries with nan bounds never match, their edges are not needed
+  for (const auto &e : tmpData_[jf]) {
+    if (e.sys != 0) {
+      continue;
+    }
+    if (!std::isnan(e.etaMin) && !std::isnan(e.etaMax)) {
+      idx.etaEdges.push_back(e.etaMin);
+      idx.etaEdges.push_back(e.etaMax);
+    }
+    if (use_discr && !std::isnan(e.discrMin) && !std::isnan(e.discrMax)) {
+      idx.discrEdges.push_back(e.discrMin);
+      idx.discrEdges.push_back(e.discrMax);
+    }
+  }
+  sortedEdges(idx.etaEdges);
+  sortedEdges(idx.discrEdges);
+
+  size_t nEta = idx.etaEdges.size() > 1 ? idx.etaEdges.size() - 1 : 0;
+  size_t nDiscr = 1;
+  if (use_discr) {
+    nDiscr += idx.discrEdges.size() > 1 ? idx.discrEdges.size() - 1 : 0;
+  }
+  if (nEta > kMaxIndexCells / nDiscr) {
+    ptRanges_[jf] = PtRangeIndex();                       // linear scan
+    return;
+  }
+
+  // the lower edges of a cell lie inside of every entry covering it
+  idx.ranges.resize(nEta * nDiscr);
+  for (size_t ie = 0; ie < nEta; ++ie) {
+    for (size_t id = 0; id < nDiscr; ++id) {
+      float discr = id ? idx.discrEdges[id - 1]
+                       : std::numeric_limits<float>::quiet_NaN();
+      idx.ranges[ie * nDiscr + id] = scanPtRange(jf, idx.etaEdges[ie], discr);
+    }
+  }
+
+  idx.valid = true;
+  idx.nDiscr = int(nDiscr);
+  ptRanges_[jf] = idx;
+}
+
+std::pair<float, float> BTagCalibrationReader::BTagCalibrationReaderImpl::scanPtRange(
+                                               BTagEntry::JetFlavor jf, 
+                                               float eta, 
+                                               float discr) const
+{
+  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
+
+  const auto &entries = tmpData_.at(jf);
   float min_pt = -1., max_pt = -1.;
   for (const auto & e: entries) {
+    if (e.sys != 0) {                                     // default sysType
+      continue;
+    }
     if (
       e.etaMin <= eta && eta < e.etaMax                   // find eta
     ){
@@ -520,10 +3021,40 @@ std::pair<float, float> BTagCalibrationReader::BTagCalibrationReaderImpl::min_ma
   return std::make_pair(min_pt, max_pt);
 }
 
+std::pair<float, float> BTagCalibrationReader::BTagCalibrationReaderImpl::min_max_pt(
+                                               BTagEntry::JetFlavor jf, 
+                                               float eta, 
+                                               float discr) const
+{
+  if (useAbsEta_[jf] && eta < 0) {
+    eta = -eta;
+  }
+  return ptRange(jf, eta, discr);
+}
+
+std::pair<float, float> BTagCalibrationReader::BTagCalibrationReaderImpl::ptRange(
+                                               BTagEntry::JetFlavor jf,
+                                               float eta,
+                                               float discr) const
+{
+  bool use_discr = (op_ == BTagEntry::OP_RESHAPING);
+  const PtRangeIndex &idx = ptRanges_.at(jf);
+  if (!idx.valid) {
+    return scanPtRange(jf, eta, discr);
+  }
+  int ie = findBin(idx.etaEdges, eta);
+  if (ie < 0) {
+    return std::make_pair(-1.f, -1.f);                    // no entry
+  }
+  int id = use_discr ? findBin(idx.discrEdges, discr) + 1 : 0;
+  return idx.ranges[ie * idx.nDiscr + id];
+}
+
 
 BTagCalibrationReader::BTagCalibrationReader(BTagEntry::OperatingPoint op,
-                                             std::string sysType):
-  pimpl(new BTagCalibrationReaderImpl(op, sysType)) {}
+                                             const std::string & sysType,
+                                             const std::vector<std::string> & otherSysTypes):
+  pimpl(new BTagCalibrationReaderImpl(op, sysType, otherSysTypes)) {}
 
 void BTagCalibrationReader::load(const BTagCalibration & c,
                                  BTagEntry::JetFlavor jf,
@@ -540,6 +3071,57 @@ double BTagCalibrationReader::eval(BTagEntry::JetFlavor jf,
   return pimpl->eval(jf, eta, pt, discr);
 }
 
+void BTagCalibrationReader::eval_all(BTagEntry::JetFlavor jf,
+                                     float eta,
+                                     float pt,
+                                     float discr,
+                                     double *out) const
+{
+  pimpl->eval_all(jf, eta, pt, discr, out);
+}
+
+void BTagCalibrationReader::eval_some(BTagEntry::JetFlavor jf,
+                                      float eta,
+                                      float pt,
+                                      float discr,
+                                      const int *sys,
+                                      int n,
+                                      double *out) const
+{
+  pimpl->eval_some(jf, eta, pt, discr, sys, n, out);
+}
+
+bool BTagCalibrationReader::eval_all_clamped(BTagEntry::JetFlavor jf,
+                                             float eta,
+                                             double pt,
+                                             float discr,
+                                             double *out) const
+{
+  return pimpl->eval_clamped(jf, eta, pt, discr, 0,
+                             int(pimpl->sysTypes_.size()), out);
+}
+
+bool BTagCalibrationReader::eval_some_clamped(BTagEntry::JetFlavor jf,
+                                              float eta,
+                                              double pt,
+                                              float discr,
+                                              const int *sys,
+                                              int n,
+                                              double *out) const
+{
+  return pimpl->eval_clamped(jf, eta, pt, discr, sys, n, out);
+}
+
+void BTagCalibrationReader::eval_batch(size_t n,
+                                       const BTagEntry::JetFlavor *jf,
+                                       const float *eta,
+                                       const float *pt,
+                                       const float *discr,
+                                       double *out) const
+{
+  pimpl->eval_batch(n, jf, eta, pt, discr, out);
+}
+
 std::pair<float, float> BTagCalibrationReader::min_max_pt(BTagEntry::JetFlavor jf, 
                                                           float eta, 
                                                           float discr) const
@@ -547,4 +3129,207 @@ std::pair<float, float> BTagCalibrationReader::min_max_pt(BTagEntry::JetFlavor j
   return pimpl->min_max_pt(jf, eta, discr);
 }
 
+void BTagCalibrationReader::setTabulation(double maxAbsError, bool cubic)
+{
+  pimpl->tabTolerance_ = maxAbsError;
+  pimpl->tabCubic_ = cubic;
+}
+
+double BTagCalibrationReader::tabulationError(BTagEntry::JetFlavor jf) const
+{
+  return pimpl->tabError_[jf];
+}
+
+bool BTagCalibrationReader::lockFree() const
+{
+  return pimpl->lockFree_;
+}
+
+const std::vector<std::string>& BTagCalibrationReader::sysTypes() const
+{
+  return pimpl->sysTypes_;
+}
+
+int BTagCalibrationReader::sysIndex(const std::string & sysType) const
+{
+  const std::vector<std::string> &sys = pimpl->sysTypes_;
+  std::vector<std::string>::const_iterator it =
+    std::find(sys.begin(), sys.end(), sysType);
+  return it == sys.end() ? -1 : int(it - sys.begin());
+}
+
+const std::vector<int>& BTagCalibrationReader::sysIndices(BTagEntry::JetFlavor jf) const
+{
+  return pimpl->sysIndices_[jf];
+}
+
+
+
+#include <climits>
+#include <mutex>
+
+namespace {
+
+struct Registry {
+  // checksums of the files seen so far, with the file status they are for
+  struct Checksum {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtimeNsec;
+    uint64_t checksum;
+  };
+
+  std::mutex mutex;
+  std::map<std::string, Checksum> checksums;     // by path
+  // not owned: calibrations are deleted when the last user is gone, readers
+  // copy what they need when they are built
+  std::map<std::string, std::weak_ptr<const BTagCalibration> > calibrations;
+  std::map<std::string, std::weak_ptr<const BTagCalibrationReader> > readers;
+};
+
+Registry & registry()
+{
+  static Registry r;
+  return r;
+}
+
+std::string absolutePath(const std::string &filename)
+{
+  char buff[PATH_MAX];
+  return realpath(filename.c_str(), buff) ? std::string(buff) : filename;
+}
+
+// checksum of the file content, computed again only if the file changed
+uint64_t fileChecksum(Registry &reg, const std::string &path)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st)) {
+    return 0;
+  }
+  Registry::Checksum &c = reg.checksums[path];
+  if (c.dev == st.st_dev && c.ino == st.st_ino && c.size == st.st_size
+      && c.mtime == st.st_mtim.tv_sec && c.mtimeNsec == st.st_mtim.tv_nsec) {
+    return c.checksum;
+  }
+  MappedFile file(path);
+  c.dev = st.st_dev;
+  c.ino = st.st_ino;
+  c.size = st.st_size;
+  c.mtime = st.st_mtim.tv_sec;
+  c.mtimeNsec = st.st_mtim.tv_nsec;
+  c.checksum = BTagCalibration::checksum(file.data(), file.size());
+  return c.checksum;
+}
+
+std::shared_ptr<const BTagCalibration> findCalibration(
+  Registry &reg,
+  const std::string &tagger,
+  const std::string &filename,
+  BTagCalibration::LoadMode mode,
+  const std::string &cacheFile,
+  std::string &key)
+{
+  const std::string path = absolutePath(filename);
+  std::stringstream buff;
+  buff << path << '\n' << tagger << '\n';
+  const std::string prefix = buff.str();
+  buff << std::hex << fileChecksum(reg, path);
+  key = buff.str();
+
+  std::weak_ptr<const BTagCalibration> &cached = reg.calibrations[key];
+  std::shared_ptr<const BTagCalibration> calib = cached.lock();
+  if (!calib) {
+    // forget older versions of this file, and calibrations nobody uses anymore
+    std::map<std::string, std::weak_ptr<const BTagCalibration> >::iterator i
+      = reg.calibrations.begin();
+    while (i != reg.calibrations.end()) {
+      if (&i->second != &cached
+          && (i->second.expired() || !i->first.compare(0, prefix.size(), prefix))) {
+        reg.calibrations.erase(i++);
+      } else {
+        ++i;
+      }
+    }
+    if (cacheFile.empty()) {
+      calib = std::make_shared<BTagCalibration>(tagger, path, mode);
+    } else {
+      calib = std::make_shared<BTagCalibration>(tagger, path, cacheFile);
+    }
+    cached = calib;
+  }
+  return calib;
+}
+
+}  // namespace
+
+
+std::shared_ptr<const BTagCalibration> BTagCalibrationRegistry::calibration(
+                                             const std::string &tagger,
+                                             const std::string &filename,
+                                             BTagCalibration::LoadMode mode,
+                                             const std::string &cacheFile)
+{
+  Registry &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  std::string key;
+  return findCalibration(reg, tagger, filename, mode, cacheFile, key);
+}
+
+std::shared_ptr<const BTagCalibrationReader> BTagCalibrationRegistry::reader(
+                                             const std::string &tagger,
+                                             const std::string &filename,
+                                             BTagEntry::OperatingPoint op,
+                                             const std::string &measurementType_bc,
+                                             const std::string &measurementType_udsg,
+                                             const std::string &sysType,
+                                             const std::vector<std::string> &otherSysTypes,
+                                             double tabulationTolerance,
+                                             BTagCalibration::LoadMode mode,
+                                             const std::string &cacheFile,
+                                             bool tabulationCubic)
+{
+  Registry &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  std::string key;
+  std::shared_ptr<const BTagCalibration> calib =
+    findCalibration(reg, tagger, filename, mode, cacheFile, key);
+
+  std::stringstream buff;
+  buff.precision(17);
+  buff << key << '\n' << op << '\n' << measurementType_bc << '\n'
+       << measurementType_udsg << '\n' << sysType;
+  for (size_t i = 0; i < otherSysTypes.size(); ++i) {
+    buff << ',' << otherSysTypes[i];
+  }
+  buff << '\n' << tabulationTolerance << (tabulationCubic ? " cubic" : "");
+
+  std::weak_ptr<const BTagCalibrationReader> &cached = reg.readers[buff.str()];
+  std::shared_ptr<const BTagCalibrationReader> reader = cached.lock();
+  if (reader) {
+    return reader;
+  }
+
+  // drop the keys of readers nobody uses anymore
+  std::map<std::string, std::weak_ptr<const BTagCalibrationReader> >::iterator i
+    = reg.readers.begin();
+  while (i != reg.readers.end()) {
+    if (i->second.expired() && &i->second != &cached) {
+      reg.readers.erase(i++);
+    } else {
+      ++i;
+    }
+  }
 
+  std::shared_ptr<BTagCalibrationReader> newReader =
+    std::make_shared<BTagCalibrationReader>(op, sysType, otherSysTypes);
+  if (tabulationTolerance > 0.) {
+    newReader->setTabulation(tabulationTolerance, tabulationCubic);
+  }
+  newReader->load(*calib, BTagEntry::FLAV_B, measurementType_bc);
+  newReader->load(*calib, BTagEntry::FLAV_C, measurementType_bc);
+  newReader->load(*calib, BTagEntry::FLAV_UDSG, measurementType_udsg);
+  cached = newReader;
+  return newReader;
+}
@@ -0,0 +1,609 @@
+#include "../include/BTaggingScaleFactors.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+
+
+namespace {
+
+  /// multiplies the nominal weight by the central jet weight, and the b/c or udsg variations by up and down
+  void multiplyVariations( BTaggingScaleFactors::Weights& weights, const double* jetweight, bool bc ) {
+    weights.nominal *= jetweight[BTaggingScaleFactors::SYS_CENTRAL];
+    if (bc) {
+      weights.bc_up *= jetweight[BTaggingScaleFactors::SYS_UP];
+      weights.bc_down *= jetweight[BTaggingScaleFactors::SYS_DOWN];
+      weights.udsg_up *= jetweight[BTaggingScaleFactors::SYS_CENTRAL];
+      weights.udsg_down *= jetweight[BTaggingScaleFactors::SYS_CENTRAL];
+    }
+    else {
+      weights.bc_up *= jetweight[BTaggingScaleFactors::SYS_CENTRAL];
+      weights.bc_down *= jetweight[BTaggingScaleFactors::SYS_CENTRAL];
+      weights.udsg_up *= jetweight[BTaggingScaleFactors::SYS_UP];
+      weights.udsg_down *= jetweight[BTaggingScaleFactors::SYS_DOWN];
+    }
+  }
+
+} // namespace
+
+
+BTaggingScaleFactors::BTaggingScaleFactors():
+  m_workingPointCut( -1 ), m_statOverflows( false ), m_deferredFills( false ) {
+}
+
+
+void BTaggingScaleFactors::setReader( const std::shared_ptr<const BTagCalibrationReader>& reader, const double& workingPointCut ) {
+
+  if (reader && reader->sysTypes().size() < N_SYS) {
+    throw std::runtime_error( "BTaggingScaleFactors needs a reader with the sysTypes central, up and down" );
+  }
+  m_reader = reader;
+  m_workingPointCut = workingPointCut;
+
+}
+
+
+BTaggingScaleFactors::Jet::Jet( const double& pt_, const double& eta_, const int& hadronFlavour_ ):
+  pt( pt_ ), eta( eta_ ), hadronFlavour( hadronFlavour_ ),
+  flavor( jetFlavor(hadronFlavour_) ), effFlavour( BTaggingScaleFactors::effFlavour(hadronFlavour_) ),
+  bc( (hadronFlavour_ == 5) || (hadronFlavour_ == 4) ), inTracker( !(fabs(eta_) > 2.4) ) {
+}
+
+
+BTagEntry::JetFlavor BTaggingScaleFactors::jetFlavor( const int& hadronFlavour ) {
+
+  const int flavour = std::abs(hadronFlavour);
+  if (flavour == 5) {
+    return BTagEntry::FLAV_B;
+  }
+  if (flavour == 4 || flavour == 15) {
+    return BTagEntry::FLAV_C;
+  }
+  return BTagEntry::FLAV_UDSG;
+
+}
+
+
+double BTaggingScaleFactors::getJetWeight( const double& pt, const double& eta, const int& hadronFlavour, bool isTagged,
+                                           const double& sigma_bc, const double& sigma_udsg, const int& category ) const {
+
+  const BTagEntry::JetFlavor flavorEnum = jetFlavor(hadronFlavour);
+
+  double MaxEta = 2.4;
+  double abs_eta = fabs(eta);
+  if (abs_eta > MaxEta) {
+    // outside tracker range
+    return 1.;
+  }
+
+  // range checking (pt clamped into the range of the scale factors), double uncertainty if beyond
+  double sf[N_SYS];
+  const bool is_out_of_bounds = m_reader->eval_all_clamped(flavorEnum, eta, pt, 0., sf);
+  double sigmaScale_bc = sigma_bc;
+  double sigmaScale_udsg = sigma_udsg;
+  // double uncertainty in case jet outside normal kinematics
+  if (is_out_of_bounds) {
+    sigmaScale_bc *= 2;
+    sigmaScale_udsg *= 2;
+  }
+
+  double scalefactor = sf[SYS_CENTRAL];
+  // the variations of b and c jets are chosen by the signed flavour
+  const bool bc = (hadronFlavour == 5) || (hadronFlavour == 4);
+  const double sigma = bc ? sigma_bc : sigma_udsg;
+  const double sigmaScale = bc ? sigmaScale_bc : sigmaScale_udsg;
+  if (sigma > std::numeric_limits<double>::epsilon()) {
+    scalefactor = sigmaScale*(sf[SYS_UP] - scalefactor) + scalefactor;
+  }
+  else if (sigma < -std::numeric_limits<double>::epsilon()) {
+    scalefactor = fabs(sigmaScale)*(sf[SYS_DOWN] - scalefactor) + scalefactor;
+  }
+  if (scalefactor == 0) {
+    throw std::runtime_error( "Scale factor returned is zero!" );
+  }
+
+  double effMC = getEfficiency(category, pt, eta, hadronFlavour);
+  if (isTagged) {
+    return scalefactor;
+  }
+  return (1 - (scalefactor * effMC)) / (1 - effMC);
+
+}
+
+
+void BTaggingScaleFactors::multiplyJetWeights( Weights& weights, const double& pt, const double& eta, const int& hadronFlavour, bool isTagged,
+                                               const int& category ) const {
+
+  multiplyJetWeights(weights, Jet(pt, eta, hadronFlavour), isTagged, category);
+
+}
+
+
+void BTaggingScaleFactors::multiplyJetWeights( Weights& weights, const Jet& jet, bool isTagged, const int& category ) const {
+
+  // same steps as getJetWeight, but the lookups are done once for all variations
+  if (!jet.inTracker) {
+    // outside tracker range
+    return;
+  }
+
+  double sf[N_SYS];
+  getScaleFactors(jet, sf);
+  const double effMC = getEfficiency(category, jet);
+  double jetweight[N_SYS];
+  for (int sys = 0; sys < N_SYS; ++sys) {
+    jetweight[sys] = isTagged ? sf[sys] : (1 - (sf[sys] * effMC)) / (1 - effMC);
+  }
+  multiplyVariations(weights, jetweight, jet.bc);
+
+}
+
+
+void BTaggingScaleFactors::multiplyJetWeights( Weights& weights, const size_t& n, const float* pt, const float* eta, const int* hadronFlavour,
+                                               const float* discr, const int& category ) const {
+
+  double jetweight[BLOCK_SIZE][N_SYS];
+  bool bc[BLOCK_SIZE];
+  for (size_t start = 0; start < n; start += BLOCK_SIZE) {
+    const size_t nInTracker = blockJetWeights(std::min<size_t>(n - start, BLOCK_SIZE), pt + start, eta + start, hadronFlavour + start,
+                                              discr + start, category, N_SYS, 1., 1., jetweight, bc);
+    // in the same order as for single jets
+    for (size_t l = 0; l < nInTracker; ++l) {
+      multiplyVariations(weights, jetweight[l], bc[l]);
+    }
+  }
+
+}
+
+
+double BTaggingScaleFactors::nominalWeight( const size_t& n, const float* pt, const float* eta, const int* hadronFlavour,
+                                            const float* discr, const int& category ) const {
+
+  double jetweight[BLOCK_SIZE][N_SYS];
+  bool bc[BLOCK_SIZE];
+  double weight = 1.;
+  for (size_t start = 0; start < n; start += BLOCK_SIZE) {
+    const size_t nInTracker = blockJetWeights(std::min<size_t>(n - start, BLOCK_SIZE), pt + start, eta + start, hadronFlavour + start,
+                                              discr + start, category, 1, 0., 0., jetweight, bc);
+    for (size_t l = 0; l < nInTracker; ++l) {
+      weight *= jetweight[l][SYS_CENTRAL];
+    }
+  }
+  return weight;
+
+}
+
+
+double BTaggingScaleFactors::variationWeight( const size_t& n, const float* pt, const float* eta, const int* hadronFlavour,
+                                              const float* discr, const double& sigma_bc, const double& sigma_udsg,
+                                              const int& category ) const {
+
+  // the variation getJetWeight takes for b and c and for udsg jets
+  const double eps = std::numeric_limits<double>::epsilon();
+  const int sys_bc = sigma_bc > eps ? SYS_UP : (sigma_bc < -eps ? SYS_DOWN : SYS_CENTRAL);
+  const int sys_udsg = sigma_udsg > eps ? SYS_UP : (sigma_udsg < -eps ? SYS_DOWN : SYS_CENTRAL);
+
+  double jetweight[BLOCK_SIZE][N_SYS];
+  bool bc[BLOCK_SIZE];
+  double weight = 1.;
+  for (size_t start = 0; start < n; start += BLOCK_SIZE) {
+    const size_t nInTracker = blockJetWeights(std::min<size_t>(n - start, BLOCK_SIZE), pt + start, eta + start, hadronFlavour + start,
+                                              discr + start, category, N_SYS, sigma_bc, sigma_udsg, jetweight, bc);
+    for (size_t l = 0; l < nInTracker; ++l) {
+      weight *= jetweight[l][bc[l] ? sys_bc : sys_udsg];
+    }
+  }
+  return weight;
+
+}
+
+
+size_t BTaggingScaleFactors::blockJetWeights( const size_t& n, const float* pt, const float* eta, const int* hadronFlavour, const float* discr,
+                                              const int& category, const int& nSys, const double& sigma_bc, const double& sigma_udsg,
+                                              double (*jetweight)[N_SYS], bool* bc ) const {
+
+  BTagEntry::JetFlavor flavor[BLOCK_SIZE];
+  EffFlavour effFlavour[BLOCK_SIZE];
+  float ptInTracker[BLOCK_SIZE];
+  float etaInTracker[BLOCK_SIZE];
+  bool tagged[BLOCK_SIZE];
+
+  // jets of the block within the tracker range
+  size_t nInTracker = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const Jet jet(pt[i], eta[i], hadronFlavour[i]);
+    if (!jet.inTracker) {
+      continue;
+    }
+    flavor[nInTracker] = jet.flavor;
+    effFlavour[nInTracker] = jet.effFlavour;
+    ptInTracker[nInTracker] = pt[i];
+    etaInTracker[nInTracker] = eta[i];
+    bc[nInTracker] = jet.bc;
+    tagged[nInTracker] = isTagged(discr[i]);
+    ++nInTracker;
+  }
+
+  // scale factors, as getScaleFactors (or getJetWeight) for the sysTypes asked for
+  double sf[BLOCK_SIZE][N_SYS];
+  for (size_t l = 0; l < nInTracker; ++l) {
+    double* sfl = &sf[0][0] + l * nSys;
+    const bool outOfBounds = m_reader->eval_some_clamped(flavor[l], etaInTracker[l], ptInTracker[l], 0., 0, nSys, sfl);
+    if (nSys > SYS_DOWN) {
+      const double sigmaScale = fabs(bc[l] ? sigma_bc : sigma_udsg) * (outOfBounds ? 2. : 1.);
+      const double scalefactor = sfl[SYS_CENTRAL];
+      sfl[SYS_UP] = sigmaScale*(sfl[SYS_UP] - scalefactor) + scalefactor;
+      sfl[SYS_DOWN] = sigmaScale*(sfl[SYS_DOWN] - scalefactor) + scalefactor;
+    }
+    for (int sys = 0; sys < nSys; ++sys) {
+      if (sfl[sys] == 0) {
+        throw std::runtime_error( "Scale factor returned is zero!" );
+      }
+    }
+  }
+
+  // efficiencies, with the table of each flavour found once per block
+  double effMC[BLOCK_SIZE];
+  const EffTable* tables[N_EFF_FLAVOURS];
+  for (int flavour = 0; flavour < N_EFF_FLAVOURS; ++flavour) {
+    const size_t index = category * N_EFF_FLAVOURS + flavour;
+    const bool found = category >= 0 && index < m_effTables.size() && !m_effTables[index].eff.empty();
+    tables[flavour] = found ? &m_effTables[index] : 0;
+  }
+  for (size_t l = 0; l < nInTracker; ++l) {
+    const EffTable* table = tables[effFlavour[l]];
+    // 0 without a map, as efficiency()
+    effMC[l] = table ? table->eff[table->etaAxis.findBin(etaInTracker[l]) * (table->ptAxis.nBins + 2)
+                                  + table->ptAxis.findBin(ptInTracker[l])] : 0.;
+  }
+
+  for (size_t l = 0; l < nInTracker; ++l) {
+    const double* sfl = &sf[0][0] + l * nSys;
+    for (int sys = 0; sys < nSys; ++sys) {
+      jetweight[l][sys] = tagged[l] ? sfl[sys] : (1 - (sfl[sys] * effMC[l])) / (1 - effMC[l]);
+    }
+  }
+  return nInTracker;
+
+}
+
+
+void BTaggingScaleFactors::getScaleFactors( const Jet& jet, double* sf ) const {
+
+  // range checking, double uncertainty if beyond
+  const double sigmaScale = m_reader->eval_all_clamped(jet.flavor, jet.eta, jet.pt, 0., sf) ? 2. : 1.;
+  const double scalefactor = sf[SYS_CENTRAL];
+  sf[SYS_UP] = sigmaScale*(sf[SYS_UP] - scalefactor) + scalefactor;
+  sf[SYS_DOWN] = sigmaScale*(sf[SYS_DOWN] - scalefactor) + scalefactor;
+  if (sf[SYS_CENTRAL] == 0 || sf[SYS_UP] == 0 || sf[SYS_DOWN] == 0) {
+    throw std::runtime_error( "Scale factor returned is zero!" );
+  }
+
+}
+
+
+void BTaggingScaleFactors::setEfficiency( const int& category, EffFlavour flavour, const TH2& hPass, const TH2& hAll ) {
+
+  if (category < 0) {
+    throw std::runtime_error( "Negative efficiency category" );
+  }
+  if (m_effTables.size() < size_t(category + 1) * N_EFF_FLAVOURS) {
+    m_effTables.resize((category + 1) * N_EFF_FLAVOURS);
+  }
+  std::unique_ptr<TH2> hEff( (TH2*) hPass.Clone() );
+  hEff->SetDirectory( 0 );
+  hEff->Divide( &hAll );
+  fillEffTable(m_effTables[category * N_EFF_FLAVOURS + flavour], *hEff);
+
+}
+
+
+double BTaggingScaleFactors::getEfficiency( const int& category, const double& pt, const double& eta, const int& hadronFlavour ) const {
+
+  return efficiency(category, effFlavour(hadronFlavour), pt, eta);
+
+}
+
+
+double BTaggingScaleFactors::getEfficiency( const int& category, const Jet& jet ) const {
+
+  return efficiency(category, jet.effFlavour, jet.pt, jet.eta);
+
+}
+
+
+double BTaggingScaleFactors::efficiency( const int& category, EffFlavour flavour, const double& pt, const double& eta ) const {
+
+  // flat tables, nothing is allocated or changed here
+  const size_t index = category * N_EFF_FLAVOURS + flavour;
+  if (category < 0 || index >= m_effTables.size() || m_effTables[index].eff.empty()) {
+    // what the (empty) histogram default constructed by the former map lookup gave
+    return 0.;
+  }
+  const EffTable& table = m_effTables[index];
+  int binx = table.ptAxis.findBin(pt);
+  int biny = table.etaAxis.findBin(eta);
+  return table.eff[biny * (table.ptAxis.nBins + 2) + binx];
+
+}
+
+
+void BTaggingScaleFactors::fillEffTable( EffTable& table, const TH2& hEff ) {
+
+  const TAxis* axes[2] = {hEff.GetXaxis(), hEff.GetYaxis()};
+  EffAxis* tableAxes[2] = {&table.ptAxis, &table.etaAxis};
+  for (int i = 0; i < 2; ++i) {
+    tableAxes[i]->nBins = axes[i]->GetNbins();
+    tableAxes[i]->min = axes[i]->GetXmin();
+    tableAxes[i]->max = axes[i]->GetXmax();
+    const TArrayD* edges = axes[i]->GetXbins();
+    tableAxes[i]->edges.assign(edges->GetArray(), edges->GetArray() + edges->GetSize());
+  }
+
+  const int nx = table.ptAxis.nBins + 2;
+  const int ny = table.etaAxis.nBins + 2;
+  table.eff.resize(nx * ny);
+  for (int biny = 0; biny < ny; ++biny) {
+    for (int binx = 0; binx < nx; ++binx) {
+      table.eff[biny * nx + binx] = hEff.GetBinContent(binx, biny);
+    }
+  }
+
+}
+
+
+int BTaggingScaleFactors::EffAxis::findBin( const double& x ) const {
+
+  if (x < min) {
+    return 0;
+  }
+  if (!(x < max)) {
+    return nBins + 1;
+  }
+  if (edges.empty()) {
+    return 1 + int(nBins * (x - min) / (max - min));
+  }
+  // number of edges <= x, as TMath::BinarySearch + 1
+  return std::upper_bound(edges.begin(), edges.end(), x) - edges.begin();
+
+}
+
+
+void BTaggingScaleFactors::bookEfficiency( const int& category, EffFlavour flavour, TH2F* hPass, TH2F* hAll ) {
+
+  if (category < 0) {
+    throw std::runtime_error( "Negative efficiency category" );
+  }
+  if (m_effCounters.size() < size_t(category + 1) * N_EFF_FLAVOURS * 2) {
+    m_effCounters.resize((category + 1) * N_EFF_FLAVOURS * 2);
+  }
+  m_statOverflows = TH1::StatOverflows();
+
+  TH2F* hists[2] = {hAll, hPass};
+  for (int tagged = 0; tagged < 2; ++tagged) {
+    // the binning of the booked histogram, with counts starting at zero
+    EffCounter& counter = m_effCounters[(category * N_EFF_FLAVOURS + flavour) * 2 + tagged];
+    if (!hists[tagged]) {
+      counter = EffCounter();
+      continue;
+    }
+    EffTable binning;
+    fillEffTable(binning, *hists[tagged]);
+    counter.hist = hists[tagged];
+    counter.ptAxis = binning.ptAxis;
+    counter.etaAxis = binning.etaAxis;
+    counter.counts.assign(binning.eff.size(), 0.);
+    counter.entries = 0.;
+    std::fill(counter.stats, counter.stats + 7, 0.);
+  }
+
+}
+
+
+void BTaggingScaleFactors::fillEfficiency( const int& category, const int& hadronFlavour, bool isTagged, const double& pt, const double& eta ) {
+
+  const size_t index = (category * N_EFF_FLAVOURS + effFlavour(hadronFlavour)) * 2;
+  if (category < 0 || index >= m_effCounters.size() || !m_effCounters[index + 1].hist) {
+    throw std::runtime_error( "Efficiency histograms are not booked for this jet category" );
+  }
+  // without hAll only the tagged jets are counted
+  const int first = m_effCounters[index].hist ? 0 : 1;
+  if (!m_deferredFills) {
+    if (!first) {
+      m_effCounters[index].hist->Fill(pt, eta);
+    }
+    if (isTagged) {
+      m_effCounters[index + 1].hist->Fill(pt, eta);
+    }
+    return;
+  }
+
+  // same bin and statistics as TH2::Fill( pt, eta ), done for both histograms at once
+  const EffCounter& pass = m_effCounters[index + 1];
+  const int binx = pass.ptAxis.findBin(pt);
+  const int biny = pass.etaAxis.findBin(eta);
+  const int bin = biny * (pass.ptAxis.nBins + 2) + binx;
+  const bool inRange = binx > 0 && binx <= pass.ptAxis.nBins && biny > 0 && biny <= pass.etaAxis.nBins;
+  for (int tagged = first; tagged <= (isTagged ? 1 : 0); ++tagged) {
+    EffCounter& counter = m_effCounters[index + tagged];
+    counter.counts[bin] += 1.;
+    counter.entries += 1.;
+    if (inRange || m_statOverflows) {
+      counter.stats[0] += 1.;
+      counter.stats[1] += 1.;
+      counter.stats[2] += pt;
+      counter.stats[3] += pt * pt;
+      counter.stats[4] += eta;
+      counter.stats[5] += eta * eta;
+      counter.stats[6] += pt * eta;
+    }
+  }
+
+}
+
+
+double BTaggingScaleFactors::pendingEfficiencyFills() const {
+
+  double entries = 0.;
+  for (std::vector<EffCounter>::const_iterator counter = m_effCounters.begin(); counter != m_effCounters.end(); ++counter) {
+    entries += counter->entries;
+  }
+  return entries;
+
+}
+
+
+void BTaggingScaleFactors::flushEfficiencies() {
+
+  for (std::vector<EffCounter>::iterator counter = m_effCounters.begin(); counter != m_effCounters.end(); ++counter) {
+    if (counter->entries == 0.) {
+      continue;
+    }
+    TH2F* hist = counter->hist;
+    double stats[7];
+    hist->GetStats(stats);
+    for (size_t bin = 0; bin < counter->counts.size(); ++bin) {
+      if (counter->counts[bin] == 0.) {
+        continue;
+      }
+      hist->AddBinContent(bin, counter->counts[bin]);
+      if (hist->GetSumw2N()) {
+        hist->GetSumw2()->fArray[bin] += counter->counts[bin];
+      }
+    }
+    for (int i = 0; i < 7; ++i) {
+      stats[i] += counter->stats[i];
+    }
+    hist->PutStats(stats);
+    hist->SetEntries(hist->GetEntries() + counter->entries);
+
+    std::fill(counter->counts.begin(), counter->counts.end(), 0.);
+    counter->entries = 0.;
+    std::fill(counter->stats, counter->stats + 7, 0.);
+  }
+
+}
+
+
+void BTaggingReshapingWeights::setReader( const std::shared_ptr<const BTagCalibrationReader>& reader ) {
+
+  for (int flav = 0; flav < 3; ++flav) {
+    const std::vector<int>& sys = reader->sysIndices(BTagEntry::JetFlavor(flav));
+    if (sys.empty() || sys[0] != 0) {
+      throw std::runtime_error( "No central reshaping scale factors for all jet flavours" );
+    }
+    m_sys[flav] = sys;
+    m_slot[flav].assign(reader->sysTypes().size(), 0);
+    for (size_t i = 0; i < sys.size(); ++i) {
+      m_slot[flav][sys[i]] = i;
+    }
+  }
+  m_reader = reader;
+
+}
+
+
+void BTaggingReshapingWeights::multiplyJetWeights( double* weights, double* sf, const double& pt, const double& eta, const int& hadronFlavour,
+                                                   const double& discr ) const {
+
+  const double abs_eta = fabs(eta);
+  if (abs_eta > 2.4) {
+    // outside tracker range
+    return;
+  }
+  const BTagEntry::JetFlavor flavorEnum = BTaggingScaleFactors::jetFlavor(hadronFlavour);
+
+  // evaluated at the closest pt with scale factors, for the systematics that apply to this
+  // flavour (central first)
+  const std::vector<int>& sys = m_sys[flavorEnum];
+  m_reader->eval_some_clamped(flavorEnum, abs_eta, float(pt), discr, &sys[0], sys.size(), sf);
+  const double central = sf[0];
+  if (central == 0.) {
+    // discriminator value not covered
+    return;
+  }
+
+  // systematics that apply to this flavour must cover every discriminator value the central one does
+  for (size_t i = 1; i < sys.size(); ++i) {
+    if (sf[i] == 0.) {
+      throw std::runtime_error( "Scale factor returned is zero!" );
+    }
+  }
+
+  const int* slot = &m_slot[flavorEnum][0];
+  const size_t nWeights = m_slot[flavorEnum].size();
+  weights[0] *= central;
+  for (size_t i = 1; i < nWeights; ++i) {
+    // slot 0 for the systematics without entries for this flavour
+    weights[i] *= sf[slot[i]];
+  }
+
+}
+
+
+void BTaggingMultiWPScaleFactors::setNWorkingPoints( const size_t& n ) {
+
+  m_workingPoints.assign(n, BTaggingScaleFactors());
+
+}
+
+
+int BTaggingMultiWPScaleFactors::tagLevel( const double& discr ) const {
+
+  int level = 0;
+  while (level < int(m_workingPoints.size()) && m_workingPoints[level].isTagged(discr)) {
+    ++level;
+  }
+  return level;
+
+}
+
+
+void BTaggingMultiWPScaleFactors::multiplyJetWeights( Weights& weights, const BTaggingScaleFactors::Jet& jet, const double& discr,
+                                                      const int& category ) const {
+
+  if (!jet.inTracker) {
+    // outside tracker range
+    return;
+  }
+
+  // probabilities to fall between the tightest working point passed and the loosest one failed,
+  // in MC (efficiencies) and data (scale factors times efficiencies); the efficiency cancels if the
+  // tightest one is passed, as in BTaggingScaleFactors::multiplyJetWeights
+  const int level = tagLevel(discr);
+  const int nWorkingPoints = m_workingPoints.size();
+  double pMC = 1.;
+  double pData[N_SYS] = {1., 1., 1.};
+  double sf[N_SYS];
+  if (level > 0) {
+    const BTaggingScaleFactors& passed = m_workingPoints[level - 1];
+    passed.getScaleFactors(jet, sf);
+    const double eff = (level < nWorkingPoints) ? passed.getEfficiency(category, jet) : 1.;
+    pMC = eff;
+    for (int sys = 0; sys < N_SYS; ++sys) {
+      pData[sys] = sf[sys] * eff;
+    }
+  }
+  if (level < nWorkingPoints) {
+    const BTaggingScaleFactors& failed = m_workingPoints[level];
+    failed.getScaleFactors(jet, sf);
+    const double eff = failed.getEfficiency(category, jet);
+    pMC -= eff;
+    for (int sys = 0; sys < N_SYS; ++sys) {
+      pData[sys] -= sf[sys] * eff;
+    }
+    if (level > 0 && !(pMC > 0.)) {
+      // no MC jets between the two working points (equal efficiencies), nothing to correct
+      return;
+    }
+  }
+
+  double jetweight[N_SYS];
+  for (int sys = 0; sys < N_SYS; ++sys) {
+    jetweight[sys] = pData[sys] / pMC;
+  }
+  multiplyVariations(weights, jetweight, jet.bc);
+
+}
@@ -1,16 +1,22 @@
 #include "include/BTaggingScaleTool.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <limits>
+#include <memory>
 
 #include <TFile.h>
 
+#include "core/include/SLogWriter.h"
+
+#include "include/BTaggingLogger.h"
+
 //
 // constructor
 //
 BTaggingScaleTool::BTaggingScaleTool( SCycleBase* parent, 
                                       const char* name ) : 
-  SToolBase( parent ), m_name( name ) {
+  SToolBase( parent ), m_name( name ), m_debugOutput( false ) {
 
   SetLogName( name );
 
@@ -36,10 +42,6 @@ BTaggingScaleTool::BTaggingScaleTool( SCycleBase* parent,
   // wpCuts["Medium"] = 0.890;
   // wpCuts["Tight"] = 0.95;
  
-  currentWorkingPointCut = -1;
-  currentWorkingPointCut_veto = -1;
-  m_effMaps.clear();
-  m_effMaps_veto.clear();
   DeclareProperty( m_name + "_Tagger",    m_tagger = "CSVv2" );
   DeclareProperty( m_name + "_Tagger_veto",    m_tagger_veto = "CSVv2" );
  
@@ -48,6 +50,11 @@ BTaggingScaleTool::BTaggingScaleTool( SCycleBase* parent,
 
   DeclareProperty( m_name + "_CsvFile", m_csvFile = sframe_dir + "/../BTaggingTools/csv/subjet_CSVv2_Moriond17_B_H.csv"); //subjet_CSVv2_ichep.csv" );//subjet_CSVv2_ichep.csv
   DeclareProperty( m_name + "_CsvFile_veto", m_csvFile_veto = sframe_dir + "/../BTaggingTools/csv/CSVv2_Moriond17_B_H.csv" );
+  // binary caches of the parsed csv files, written on first use; empty: no cache
+  DeclareProperty( m_name + "_CacheFile", m_cacheFile = "" );
+  DeclareProperty( m_name + "_CacheFile_veto", m_cacheFile_veto = "" );
+  // parse only the csv lines of the requested working points and systematics
+  DeclareProperty( m_name + "_LoadOnDemand", m_loadOnDemand = false );
 
   DeclareProperty( m_name + "_MeasurementType_udsg", m_measurementType_udsg = "incl" );//"incl" 
   DeclareProperty( m_name + "_MeasurementType_bc", m_measurementType_bc = "lt" );//"lt"
@@ -55,17 +62,55 @@ BTaggingScaleTool::BTaggingScaleTool( SCycleBase* parent,
   DeclareProperty( m_name + "_MeasurementType_veto_udsg", m_measurementType_veto_udsg = "incl" ); //incl//comb
   DeclareProperty( m_name + "_MeasurementType_veto_bc", m_measurementType_veto_bc = "mujets" );
 
+  // discriminator reshaping, used with WorkingPoint "Reshaping"
+  DeclareProperty( m_name + "_MeasurementType_reshaping", m_measurementType_reshaping = "iterativefit" );
+  DeclareProperty( m_name + "_ReshapingSysTypes", m_reshapingSysTypes = {"up_jes", "down_jes", "up_lf", "down_lf", "up_hf", "down_hf",
+                                                                         "up_hfstats1", "down_hfstats1", "up_hfstats2", "down_hfstats2",
+                                                                         "up_lfstats1", "down_lfstats1", "up_lfstats2", "down_lfstats2",
+                                                                         "up_cferr1", "down_cferr1", "up_cferr2", "down_cferr2"} );
+
+
+  DeclareProperty( m_name + "_TabulationTolerance", m_tabulationTolerance = 0. ); // 0: evaluate formulas exactly
+  DeclareProperty( m_name + "_TabulationCubic", m_tabulationCubic = false ); // cubic instead of linear interpolation
 
   DeclareProperty( m_name + "_EffHistDirectory", m_effHistDirectory = "bTagEff" );
   DeclareProperty( m_name + "_EffFile", m_effFile = sframe_dir + "/../BTaggingTools/efficiencies/bTagEffs_35p9_vMediumAk4_LooseAk8_lepVeto.root" );//v2 is medium
+  // count the efficiency fills in flat tables, written into the histograms only by EndInputData
+  DeclareProperty( m_name + "_DeferEfficiencyFills", m_deferEfficiencyFills = false );
   DeclareProperty( m_name + "_EffFile_veto", m_effFile_veto = sframe_dir + "/../BTaggingTools/efficiencies/bTagEffs_35p9_vMediumAk4_LooseAk8_lepVeto.root" );//bTagEffs_15p9_vTightAk4_LooseAk8_lepVeto.root" );//v3 is tight /bTagEffs_15p9_vTightAk4_LooseAk8_lepVeto.root
 
+  // further channels, one entry per channel (a single entry applies to all of them), see getChannelScaleFactors
+  m_channelNames.clear();
+  DeclareProperty( m_name + "_Channels", m_channelNames );
+  DeclareProperty( m_name + "_Channel_Taggers", m_channelTaggers = {"CSVv2"} );
+  DeclareProperty( m_name + "_Channel_WorkingPoints", m_channelWorkingPoints = {"Medium"} );
+  DeclareProperty( m_name + "_Channel_CsvFiles", m_channelCsvFiles = {sframe_dir + "/../BTaggingTools/csv/CSVv2_Moriond17_B_H.csv"} );
+  DeclareProperty( m_name + "_Channel_CacheFiles", m_channelCacheFiles = {""} );
+  DeclareProperty( m_name + "_Channel_MeasurementTypes_bc", m_channelMeasurementTypes_bc = {"mujets"} );
+  DeclareProperty( m_name + "_Channel_MeasurementTypes_udsg", m_channelMeasurementTypes_udsg = {"incl"} );
+  DeclareProperty( m_name + "_Channel_EffFiles", m_channelEffFiles = {sframe_dir + "/../BTaggingTools/efficiencies/bTagEffs_35p9_vMediumAk4_LooseAk8_lepVeto.root"} );
+  DeclareProperty( m_name + "_Channel_JetCategories", m_channelJetCategories = {"jet_ak4"} );
+
+  // working points for getMultiWPScaleFactors, e.g. Loose Medium Tight, with the settings of the main one
+  m_multiWorkingPoints.clear();
+  DeclareProperty( m_name + "_MultiWorkingPoints", m_multiWorkingPoints );
+
+  // jet categories for efficiencies, fixed so that jetCategory() can be resolved at any time
+  m_jetCategories = {"jet", "subjet_softdrop", "jet_ak4"};//"jet",
+  m_flavours = {"b", "c", "udsg"};
+  m_category_jet = jetCategory("jet");
+  m_category_subjet = jetCategory("subjet_softdrop");
+  m_category_veto = jetCategory("jet_ak4");
+
+  m_channels.resize(N_FIXED_CHANNELS);
+
 }
 
 //
 // destructor
 //
 BTaggingScaleTool::~BTaggingScaleTool() {
+  flushLateEfficiencyFills();
   // delete m_calib;
   // delete m_reader;
   // delete m_reader_up;
@@ -74,315 +119,149 @@ BTaggingScaleTool::~BTaggingScaleTool() {
 
 void BTaggingScaleTool::BeginInputData( const SInputData& ) throw( SError ) {
 
+  // writing to m_logger is not thread-safe, so the per-jet functions only do it if
+  // DEBUG messages are printed at all
+  m_debugOutput = (SLogWriter::Instance()->GetMinType() <= DEBUG);
+
+  // before the channels holding them are set up again
+  flushLateEfficiencyFills();
+
   m_logger << INFO << "Initializing BTagCalibrationStandalone" << SLogger::endmsg;
-  m_logger << INFO << "CSV file:    " << m_csvFile << SLogger::endmsg;
-  m_logger << INFO << "CSV file for veto:    " << m_csvFile_veto << SLogger::endmsg;
+  m_logger << INFO << "EffHistDirectory: " << m_effHistDirectory << SLogger::endmsg;
 
-  m_logger << INFO << "Tagger:         " << m_tagger << SLogger::endmsg;
-  m_logger << INFO << "Tagger for veto:         " << m_tagger_veto << SLogger::endmsg;
-  m_logger << INFO << "WorkingPoint: " << m_workingPoint << SLogger::endmsg;
-  m_logger << INFO << "WorkingPoint for veto ak4: " << m_workingPoint_veto << SLogger::endmsg;
+  // one reader per configuration, central/up/down share the bin lookup
+  const std::vector<std::string> otherSysTypes = {"up", "down"};
 
-  m_logger << INFO << "MeasurementType veto udsg: " << m_measurementType_veto_udsg << SLogger::endmsg;
-  m_logger << INFO << "MeasurementType veto  bc: " << m_measurementType_veto_bc << SLogger::endmsg;
+  const BTagCalibration::LoadMode loadMode = m_loadOnDemand ? BTagCalibration::LOAD_ON_DEMAND
+                                                            : BTagCalibration::LOAD_ALL;
 
-  m_logger << INFO << "MeasurementType udsg: " << m_measurementType_udsg << SLogger::endmsg;
-  m_logger << INFO << "MeasurementType bc: " << m_measurementType_bc << SLogger::endmsg;
-  
-  m_logger << INFO << "EffHistDirectory: " << m_effHistDirectory << SLogger::endmsg;
-  m_logger << INFO << "Efficiency file: " << m_effFile << SLogger::endmsg;
-   
-  BTagEntry::OperatingPoint wp = BTagEntry::OP_LOOSE;
-  if (m_workingPoint.find("Loose") != std::string::npos) {
-    wp = BTagEntry::OP_LOOSE;
-    currentWorkingPointCut = wpCuts["Loose"];
+  // the registry keeps calibrations only while they are used: hold the main csv file until
+  // all readers made from it are built, so that it is read only once
+  std::shared_ptr<const BTagCalibration> calibration;
+  try {
+    calibration = BTagCalibrationRegistry::calibration(m_tagger, m_csvFile, loadMode, m_cacheFile);
   }
-  else if (m_workingPoint.find("Medium") != std::string::npos) {
-    wp = BTagEntry::OP_MEDIUM;
-    currentWorkingPointCut = wpCuts["Medium"];
+  catch (const std::exception& e) {
+    throw SError( ("Cannot read " + m_csvFile + " (" + e.what() + ")").c_str(), SError::SkipCycle );
   }
-  else if (m_workingPoint.find("Tight") != std::string::npos) {
-    wp = BTagEntry::OP_TIGHT;
-    currentWorkingPointCut = wpCuts["Tight"];
-  }
-  else if (m_workingPoint.find("Reshaping") != std::string::npos) {
-    wp = BTagEntry::OP_RESHAPING;
-    currentWorkingPointCut = wpCuts["Loose"]; //placeholder
-    m_logger << WARNING << "Reshaping not yet implemented!" << SLogger::endmsg;
-  }
-  else {
-    throw SError( ("Unknown working point: " + m_workingPoint).c_str(), SError::SkipCycle );
-  }
-  
-  BTagEntry::OperatingPoint wp_veto = BTagEntry::OP_LOOSE;
-  if (m_workingPoint_veto.find("Loose") != std::string::npos) {
-    wp_veto = BTagEntry::OP_LOOSE;
-    currentWorkingPointCut_veto = wpCuts["Loose"];
-  }
-  else if (m_workingPoint_veto.find("Medium") != std::string::npos) {
-   
-    std::cout << " working point medium"<<std::endl;
-    wp_veto = BTagEntry::OP_MEDIUM;
-    currentWorkingPointCut_veto = wpCuts["Medium"];
 
+  setupChannels(loadMode);
+
+  if (!m_multiWorkingPoints.empty() && m_channels[CHANNEL_MAIN].operatingPoint == BTagEntry::OP_RESHAPING) {
+    throw SError( (m_name + "_MultiWorkingPoints needs a fixed-cut WorkingPoint, not Reshaping").c_str(), SError::SkipCycle );
   }
-  else if (m_workingPoint_veto.find("Tight") != std::string::npos) {
-    wp_veto = BTagEntry::OP_TIGHT;
-    currentWorkingPointCut_veto = wpCuts["Tight"];
+  m_multiWP.setNWorkingPoints(m_multiWorkingPoints.size());
+  for (size_t i = 0; i < m_multiWorkingPoints.size(); ++i) {
+    const std::string& name = m_multiWorkingPoints[i];
+    BTagEntry::OperatingPoint multiWP = BTagEntry::OP_LOOSE;
+    if (name == "Medium") {
+      multiWP = BTagEntry::OP_MEDIUM;
+    }
+    else if (name == "Tight") {
+      multiWP = BTagEntry::OP_TIGHT;
+    }
+    else if (name != "Loose") {
+      throw SError( ("Unknown working point in " + m_name + "_MultiWorkingPoints: " + name).c_str(), SError::SkipCycle );
+    }
+    if (i > 0 && !(wpCuts[name] > m_multiWP.workingPoint(i - 1).workingPointCut())) {
+      throw SError( (m_name + "_MultiWorkingPoints must be ordered from loose to tight").c_str(), SError::SkipCycle );
+    }
+    try {
+      m_multiWP.workingPoint(i).setReader(BTagCalibrationRegistry::reader(m_tagger, m_csvFile, multiWP,
+                                                                          m_measurementType_bc, m_measurementType_udsg,
+                                                                          "central", otherSysTypes,
+                                                                          m_tabulationTolerance, loadMode, m_cacheFile, m_tabulationCubic),
+                                          wpCuts[name]);
+    }
+    catch (const std::exception& e) {
+      throw SError( ("Cannot read the " + name + " scale factors of " + m_csvFile + " (" + e.what() + ")").c_str(), SError::SkipCycle );
+    }
   }
-  else if (m_workingPoint_veto.find("Reshaping") != std::string::npos ) {
-    wp_veto = BTagEntry::OP_RESHAPING;
-    currentWorkingPointCut_veto = wpCuts["Loose"]; //placeholder
-    m_logger << WARNING << "Reshaping not yet implemented!" << SLogger::endmsg;
+  if (!m_multiWorkingPoints.empty()) {
+    m_logger << INFO << "Working points evaluated together: " << m_multiWorkingPoints.size() << SLogger::endmsg;
   }
-  else {
-    throw SError( ("Unknown working point: " + m_workingPoint_veto).c_str(), SError::SkipCycle );
+
+  // scratch space of getReshapingWeights for the channels with WorkingPoint "Reshaping"
+  size_t nReshapingWeights = 0;
+  for (std::vector<Channel>::const_iterator channel = m_channels.begin(); channel != m_channels.end(); ++channel) {
+    nReshapingWeights = std::max(nReshapingWeights, channel->reshapingWeights.nWeights());
   }
+  m_reshapingScratch.assign(nReshapingWeights, 0.);
 
-  BTagCalibration m_calib(m_tagger, m_csvFile);
+  // read in efficiencies
+  readEfficiencies();
 
-  m_reader.reset(new BTagCalibrationReader(wp, "central"));
-  m_reader_up.reset(new BTagCalibrationReader(wp, "up"));
-  m_reader_down.reset(new BTagCalibrationReader(wp, "down"));
-  
-  m_reader->load(m_calib, BTagEntry::FLAV_B, m_measurementType_bc);
-  m_reader->load(m_calib, BTagEntry::FLAV_C, m_measurementType_bc);
-  m_reader->load(m_calib, BTagEntry::FLAV_UDSG, m_measurementType_udsg);
-  m_reader_up->load(m_calib, BTagEntry::FLAV_B, m_measurementType_bc);
-  m_reader_up->load(m_calib, BTagEntry::FLAV_C, m_measurementType_bc);
-  m_reader_up->load(m_calib, BTagEntry::FLAV_UDSG, m_measurementType_udsg);
-  m_reader_down->load(m_calib, BTagEntry::FLAV_B, m_measurementType_bc);
-  m_reader_down->load(m_calib, BTagEntry::FLAV_C, m_measurementType_bc);
-  m_reader_down->load(m_calib, BTagEntry::FLAV_UDSG, m_measurementType_udsg);
+  return;
 
+}
 
 
-  BTagCalibration m_calib_veto(m_tagger_veto, m_csvFile_veto );
+void BTaggingScaleTool::EndInputData( const SInputData& ) throw( SError ) {
 
-  m_reader_veto.reset(new BTagCalibrationReader(wp_veto, "central"));
-  m_reader_veto_up.reset(new BTagCalibrationReader(wp_veto, "up"));
-  m_reader_veto_down.reset(new BTagCalibrationReader(wp_veto, "down"));
-  
-  m_reader_veto->load(m_calib_veto, BTagEntry::FLAV_B, m_measurementType_veto_bc);
-  m_reader_veto->load(m_calib_veto, BTagEntry::FLAV_C, m_measurementType_veto_bc);
-  m_reader_veto->load(m_calib_veto, BTagEntry::FLAV_UDSG, m_measurementType_veto_udsg);
-  m_reader_veto_up->load(m_calib_veto, BTagEntry::FLAV_B, m_measurementType_veto_bc);
-  m_reader_veto_up->load(m_calib_veto, BTagEntry::FLAV_C, m_measurementType_veto_bc);
-  m_reader_veto_up->load(m_calib_veto, BTagEntry::FLAV_UDSG, m_measurementType_veto_udsg);
-  m_reader_veto_down->load(m_calib_veto, BTagEntry::FLAV_B, m_measurementType_veto_bc);
-  m_reader_veto_down->load(m_calib_veto, BTagEntry::FLAV_C, m_measurementType_veto_bc);
-  m_reader_veto_down->load(m_calib_veto, BTagEntry::FLAV_UDSG, m_measurementType_veto_udsg);
-  // m_reader_veto->load(m_calib_veto, BTagEntry::FLAV_B, m_measurementType_bc);
-  // m_reader_veto->load(m_calib_veto, BTagEntry::FLAV_C, m_measurementType_bc);
-  // m_reader_veto->load(m_calib_veto, BTagEntry::FLAV_UDSG, m_measurementType_udsg);
-  // m_reader_veto_up->load(m_calib_veto, BTagEntry::FLAV_B, m_measurementType_bc);
-  // m_reader_veto_up->load(m_calib_veto, BTagEntry::FLAV_C, m_measurementType_bc);
-  // m_reader_veto_up->load(m_calib_veto, BTagEntry::FLAV_UDSG, m_measurementType_udsg);
-  // m_reader_veto_down->load(m_calib_veto, BTagEntry::FLAV_B, m_measurementType_bc);
-  // m_reader_veto_down->load(m_calib_veto, BTagEntry::FLAV_C, m_measurementType_bc);
-  // m_reader_veto_down->load(m_calib_veto, BTagEntry::FLAV_UDSG, m_measurementType_udsg);
+  flushEfficiencyFills();
 
+}
 
-  
-  // jet categories for efficiencies
-  m_jetCategories = {"jet", "subjet_softdrop"};//"jet",
-  m_jetCategories_veto = {"jet_ak4"};
-  m_flavours = {"b", "c", "udsg"};
-  
-  // read in efficiencies
-  readEfficiencies();
 
-  return;
+void BTaggingScaleTool::flushEfficiencyFills() {
+
+  for (std::vector<Channel>::iterator channel = m_channels.begin(); channel != m_channels.end(); ++channel) {
+    channel->scaleFactors.flushEfficiencies();
+  }
+  for (size_t i = 0; i < m_multiWP.nWorkingPoints(); ++i) {
+    m_multiWP.workingPoint(i).flushEfficiencies();
+  }
+
+}
+
+
+void BTaggingScaleTool::flushLateEfficiencyFills() {
+
+  const double pending = pendingEfficiencyFills();
+  if (pending > 0.) {
+    m_logger << WARNING << pending << " efficiency fills of the previous input data are written into its histograms only now: "
+             << "with " << m_name << "_DeferEfficiencyFills the cycle has to call EndInputData of the tool in its EndInputData, "
+             << "before SFrame writes the histograms" << SLogger::endmsg;
+    flushEfficiencyFills();
+  }
 
 }
 
 
 double BTaggingScaleTool::getScaleFactor( const double& pt, const double& eta, const int& flavour, bool isTagged, const double& sigma_bc, const double& sigma_udsg, const TString& jetCategory ) {
 
-  // Flavor
-  BTagEntry::JetFlavor flavorEnum = BTagEntry::FLAV_UDSG;
-  if  ( fabs(flavour)==5) flavorEnum = BTagEntry::FLAV_B;
-  if  ( fabs(flavour)==15) flavorEnum = BTagEntry::FLAV_C;
-  if  ( fabs(flavour)==4) flavorEnum = BTagEntry::FLAV_C;
+  return getScaleFactor(pt, eta, flavour, isTagged, sigma_bc, sigma_udsg, this->jetCategory(jetCategory));
 
-  double MaxEta = 2.4;
-  double abs_eta = fabs(eta);
-  if (abs_eta > MaxEta) {
-    // outside tracker range
-    return 1.;
-  }
-  
-  // range checking, double uncertainty if beyond
-  std::pair<float, float> sf_bounds = m_reader->min_max_pt(flavorEnum, abs_eta);
-  
-  m_logger << DEBUG << "     flavor " << flavorEnum << " - " << sf_bounds.first << " " << sf_bounds.second <<" jet pt "<< pt<<  SLogger::endmsg;
-
-  float pt_for_eval = pt;
-  bool is_out_of_bounds = false;
-  if (pt < sf_bounds.first) {
-    pt_for_eval = sf_bounds.first + 1e-5;
-    is_out_of_bounds = true;
-  } else if (pt >= sf_bounds.second) {
-    pt_for_eval = sf_bounds.second - 0.1;
-    is_out_of_bounds = true;
-  }
-  m_logger << DEBUG << "*******  out of band ? " << is_out_of_bounds << "so pt_for_eval_used " <<  pt_for_eval << SLogger::endmsg;
-  double sigmaScale_bc = sigma_bc;
-  double sigmaScale_udsg = sigma_udsg;
-  // double uncertainty in case jet outside normal kinematics
-  if (is_out_of_bounds) {
-    m_logger << DEBUG << sf_bounds.first << " - " << sf_bounds.second << SLogger::endmsg;
-    m_logger << DEBUG << "out of bounds, using: " << pt_for_eval << " and " << abs_eta << SLogger::endmsg;
-    sigmaScale_bc *= 2;
-    sigmaScale_udsg *= 2;
-  }
-  
-  m_logger << DEBUG << "getting scale factor " << SLogger::endmsg;
-  double scalefactor = m_reader->eval(flavorEnum, eta, pt_for_eval);
-  m_logger << DEBUG << "scale factor: " << scalefactor << SLogger::endmsg;
-  if ((flavour == 5) || (flavour == 4)) {
-    if ((sigma_bc > std::numeric_limits<double>::epsilon()) || (sigma_bc < -std::numeric_limits<double>::epsilon())) {
-      // m_logger << DEBUG << "limit: " << std::numeric_limits<double>::epsilon() << " value: " << sigma << SLogger::endmsg;
-      if (sigma_bc > 0) {
-        double scalefactor_up =  m_reader_up->eval(flavorEnum, eta, pt_for_eval);
-        scalefactor = sigmaScale_bc*(scalefactor_up - scalefactor) + scalefactor;
-      }
-      else {
-        double scalefactor_down =  m_reader_down->eval(flavorEnum, eta, pt_for_eval);
-        scalefactor = fabs(sigmaScale_bc)*(scalefactor_down - scalefactor) + scalefactor;
-      }
-    }
-  }
-  else {
-    if ((sigma_udsg > std::numeric_limits<double>::epsilon()) || (sigma_udsg < -std::numeric_limits<double>::epsilon())) {
-      // m_logger << DEBUG << "limit: " << std::numeric_limits<double>::epsilon() << " value: " << sigma << SLogger::endmsg;
-      if (sigma_udsg > 0) {
-        double scalefactor_up =  m_reader_up->eval(flavorEnum, eta, pt_for_eval);
-        scalefactor = sigmaScale_udsg*(scalefactor_up - scalefactor) + scalefactor;
-      }
-      else {
-        double scalefactor_down =  m_reader_down->eval(flavorEnum, eta, pt_for_eval);
-        scalefactor = fabs(sigmaScale_udsg)*(scalefactor_down - scalefactor) + scalefactor;
-      }
-    }
-  }
-  if (scalefactor == 0) {
-    throw SError( "Scale factor returned is zero!", SError::SkipCycle );
-  }
-  
-  m_logger << DEBUG << "getting final weight for flav " << flavorEnum << SLogger::endmsg;
-  
-  double jetweight = 1.;
-  // set effMC close to one for now, need to use real value map later
-  double effMC = getEfficiency(pt, eta, flavour, jetCategory);
-  
-  if (isTagged) {
-    m_logger << DEBUG << "     Jet is tagged " << SLogger::endmsg;
-    jetweight *= scalefactor;
-  }
-  else {
-    m_logger << DEBUG << "     Jet is not tagged " << SLogger::endmsg;
-    jetweight *= (1 - (scalefactor * effMC)) / (1 - effMC);
-  }
-  
-  m_logger << DEBUG << " jetweight " << jetweight << SLogger::endmsg;
+}
+
+
+double BTaggingScaleTool::getScaleFactor( const double& pt, const double& eta, const int& flavour, bool isTagged, const double& sigma_bc, const double& sigma_udsg, const JetCategory& jetCategory ) {
+
+  return getChannelScaleFactor(m_channels[CHANNEL_MAIN], pt, eta, flavour, isTagged, sigma_bc, sigma_udsg, jetCategory.index());
 
-  return jetweight;
 }
 
 
-double BTaggingScaleTool::getScaleFactor_veto( const double& pt, const double& eta, const int& flavour, bool isTagged, const double& sigma_bc, const double& sigma_udsg, const TString& jetCategory ) {
-  m_logger << DEBUG << "     flavor " <<  flavour<<  SLogger::endmsg;
-  // Flavor
-  BTagEntry::JetFlavor flavorEnum = BTagEntry::FLAV_UDSG;
-  
-  if  ( fabs(flavour)==5) flavorEnum = BTagEntry::FLAV_B;
-  if  ( fabs(flavour)==15) flavorEnum = BTagEntry::FLAV_C;
-  if  ( fabs(flavour)==4) flavorEnum = BTagEntry::FLAV_C;
+double BTaggingScaleTool::getScaleFactor_veto( const double& pt, const double& eta, const int& flavour, bool isTagged, const double& sigma_bc, const double& sigma_udsg, const TString& ) {
 
-  double MaxEta = 2.4;
-  double abs_eta = fabs(eta);
-  if (abs_eta > MaxEta) {
-    // outside tracker range
-    return 1.;
-  }
-  
-  // range checking, double uncertainty if beyond
-  std::pair<float, float> sf_bounds = m_reader_veto->min_max_pt(flavorEnum, abs_eta);
-  
-  m_logger << DEBUG << "     flavorEnum  " << flavorEnum << " ;pt bound min " << sf_bounds.first << " ;pt bound max " << sf_bounds.second <<" jet pt "<< pt<<  SLogger::endmsg;
-
-  float pt_for_eval = pt;
-  bool is_out_of_bounds = false;
-  if (pt < sf_bounds.first) {
-    pt_for_eval = sf_bounds.first + 1e-5;
-    is_out_of_bounds = true;
-  } else if (pt >= sf_bounds.second) {
-    pt_for_eval = sf_bounds.second - 0.1;
-    is_out_of_bounds = true;
-  }
-  m_logger << DEBUG << "*******  out of band ? " << is_out_of_bounds << "so pt_for_eval_used " <<  pt_for_eval << SLogger::endmsg;
-  double sigmaScale_bc = sigma_bc;
-  double sigmaScale_udsg = sigma_udsg;
-  // double uncertainty in case jet outside normal kinematics
-  if (is_out_of_bounds) {
-    m_logger << DEBUG << sf_bounds.first << " - " << sf_bounds.second << SLogger::endmsg;
-    m_logger << DEBUG << "out of bounds, using: " << pt_for_eval << " and " << abs_eta << SLogger::endmsg;
-    sigmaScale_bc *= 2;
-    sigmaScale_udsg *= 2;
-  }
-  
- 
-  double scalefactor = m_reader_veto->eval(flavorEnum, eta, pt_for_eval);
-  m_logger << DEBUG << "scale factor: " << scalefactor << SLogger::endmsg;
-  if ((flavour == 5) || (flavour == 4)) {
-    if ((sigma_bc > std::numeric_limits<double>::epsilon()) || (sigma_bc < -std::numeric_limits<double>::epsilon())) {
-      // m_logger << DEBUG << "limit: " << std::numeric_limits<double>::epsilon() << " value: " << sigma << SLogger::endmsg;
-      if (sigma_bc > 0) {
-        double scalefactor_up =  m_reader_veto_up->eval(flavorEnum, eta, pt_for_eval);
-        scalefactor = sigmaScale_bc*(scalefactor_up - scalefactor) + scalefactor;
-      }
-      else {
-        double scalefactor_down =  m_reader_veto_down->eval(flavorEnum, eta, pt_for_eval);
-        scalefactor = fabs(sigmaScale_bc)*(scalefactor_down - scalefactor) + scalefactor;
-      }
-    }
-  }
-  else {
-    if ((sigma_udsg > std::numeric_limits<double>::epsilon()) || (sigma_udsg < -std::numeric_limits<double>::epsilon())) {
-      // m_logger << DEBUG << "limit: " << std::numeric_limits<double>::epsilon() << " value: " << sigma << SLogger::endmsg;
-      if (sigma_udsg > 0) {
-        double scalefactor_up =  m_reader_veto_up->eval(flavorEnum, eta, pt_for_eval);
-        scalefactor = sigmaScale_udsg*(scalefactor_up - scalefactor) + scalefactor;
-      }
-      else {
-        double scalefactor_down =  m_reader_veto_down->eval(flavorEnum, eta, pt_for_eval);
-        scalefactor = fabs(sigmaScale_udsg)*(scalefactor_down - scalefactor) + scalefactor;
-      }
-    }
-  }
-  if (scalefactor == 0) {
-    throw SError( "Scale factor returned is zero!", SError::SkipCycle );
+  return getChannelScaleFactor(m_channels[CHANNEL_VETO], pt, eta, flavour, isTagged, sigma_bc, sigma_udsg, m_category_veto.index());
+
+}
+
+
+double BTaggingScaleTool::getChannelScaleFactor( const Channel& channel, const double& pt, const double& eta, const int& flavour, bool isTagged,
+                                                 const double& sigma_bc, const double& sigma_udsg, const int& category ) {
+
+  BTAG_DEBUG_SCOPE;
+  try {
+    const double jetweight = fixedCutScaleFactors(channel).getJetWeight(pt, eta, flavour, isTagged, sigma_bc, sigma_udsg, category);
+    BTAG_REPORT_DEBUG( "flavor " << flavour << ", pt " << pt << ", eta " << eta << ", tagged " << isTagged << ", " << channel.name << " jetweight " << jetweight );
+    return jetweight;
   }
-  
-  m_logger << DEBUG << "getting final weight for flavorEnum  " << flavorEnum << SLogger::endmsg;
-  
-  double jetweight = 1.;
-  // set effMC close to one for now, need to use real value map later
-  double effMC = getEfficiency(pt, eta, flavour, "jet_ak4");/// maybe change "jet_ak4_
-  m_logger << DEBUG << "    Efficiency " << effMC <<SLogger::endmsg;
-  if (isTagged) {
-    m_logger << DEBUG << "     Jet is tagged " << SLogger::endmsg;
-    jetweight *= scalefactor;
-  }
-  else {
-    m_logger << DEBUG << "     Jet is not tagged " << SLogger::endmsg;
-    jetweight *= (1 - (scalefactor * effMC)) / (1 - effMC);
+  catch (const std::runtime_error& e) {
+    throw SError( e.what(), SError::SkipCycle );
   }
-  
-  m_logger << DEBUG << " jetweight " << jetweight << SLogger::endmsg;
 
-  return jetweight;
 }
 
 
@@ -390,14 +269,20 @@ double BTaggingScaleTool::getScaleFactor_veto( const double& pt, const double& e
 
 double BTaggingScaleTool::getScaleFactor( const UZH::Jet& jet, const double& sigma_bc, const double& sigma_udsg, const TString& jetCategory ) {
 
+  return getScaleFactor(jet, sigma_bc, sigma_udsg, this->jetCategory(jetCategory));
+
+}
+double BTaggingScaleTool::getScaleFactor( const UZH::Jet& jet, const double& sigma_bc, const double& sigma_udsg, const JetCategory& jetCategory ) {
+
   double jetweight = getScaleFactor(jet.pt(), jet.eta(), jet.hadronFlavour(), isTagged(jet), sigma_bc, sigma_udsg, jetCategory);
 
   return jetweight;
   
 }
-double BTaggingScaleTool::getScaleFactor_veto( const UZH::Jet& jet, const double& sigma_bc, const double& sigma_udsg, const TString& jetCategory ) {
+double BTaggingScaleTool::getScaleFactor_veto( const UZH::Jet& jet, const double& sigma_bc, const double& sigma_udsg, const TString& ) {
 
-  double jetweight = getScaleFactor_veto(jet.pt(), jet.eta(), jet.hadronFlavour(), isTagged_veto(jet), sigma_bc, sigma_udsg, jetCategory);
+  double jetweight = getChannelScaleFactor(m_channels[CHANNEL_VETO], jet.pt(), jet.eta(), jet.hadronFlavour(), isTagged_veto(jet), sigma_bc, sigma_udsg,
+                                           m_category_veto.index());
 
   return jetweight;
   
@@ -408,15 +293,17 @@ double BTaggingScaleTool::getScaleFactor_veto( const UZH::Jet& jet, const double
 
 double BTaggingScaleTool::getSoftdropSubjetScaleFactor( const UZH::Jet& jet, const double& sigma_bc, const double& sigma_udsg, const TString& jetCategory ) {
 
-  double jetweight = 1;
-  
-  for (int i = 0; i < jet.subjet_softdrop_N(); ++i) {
-    m_logger << DEBUG << "Looking at softdrop subjet " << i
-	     << ", pT=" << jet.subjet_softdrop_pt()[i] << ", eta=" << jet.subjet_softdrop_eta()[i]
-	     << SLogger::endmsg;
-    jetweight *= getScaleFactor(jet.subjet_softdrop_pt()[i], jet.subjet_softdrop_eta()[i], jet.subjet_softdrop_hadronFlavour()[i], isTagged(jet.subjet_softdrop_csv()[i]), sigma_bc, sigma_udsg, jetCategory);
-  }
+  return getSoftdropSubjetScaleFactor(jet, sigma_bc, sigma_udsg, this->jetCategory(jetCategory));
+
+}
+
+
+double BTaggingScaleTool::getSoftdropSubjetScaleFactor( const UZH::Jet& jet, const double& sigma_bc, const double& sigma_udsg, const JetCategory& jetCategory ) {
 
+  BTAG_DEBUG_SCOPE;
+  // all subjets in one batch
+  const double jetweight = getSoftdropSubjetWeight(&jet, 1, sigma_bc, sigma_udsg, jetCategory);
+  BTAG_REPORT_DEBUG( jet.subjet_softdrop_N() << " softdrop subjets, jetweight " << jetweight );
   return jetweight;
   
 }
@@ -427,38 +314,39 @@ double BTaggingScaleTool::getSoftdropSubjetScaleFactor( const UZH::Jet& jet, con
 //
 double BTaggingScaleTool::getScaleFactor( const UZH::JetVec& vJets, const double& sigma_bc, const double& sigma_udsg, const TString& jetCategory) {
 
-  double scale = 1.;
-  
-  m_logger << DEBUG << "BTaggingScaleTool::getScaleFactor" << SLogger::endmsg;
+  return getScaleFactor(vJets, sigma_bc, sigma_udsg, this->jetCategory(jetCategory));
 
-  for (std::vector< UZH::Jet>::const_iterator itJet = vJets.begin(); itJet < vJets.end(); ++itJet) {
-    m_logger << DEBUG << "Looking at jet " << itJet - vJets.begin()
-	     << ", pT=" << (*itJet).pt() << ", eta=" << (*itJet).eta()
-	     << SLogger::endmsg;
+}
 
-    scale *= getScaleFactor(*itJet, sigma_bc, sigma_udsg, jetCategory);
-  }  
+double BTaggingScaleTool::getScaleFactor( const UZH::JetVec& vJets, const double& sigma_bc, const double& sigma_udsg, const JetCategory& jetCategory) {
 
-  m_logger << DEBUG << "BTaggingScaleTool::getScaleFactor done" << SLogger::endmsg;
-  return scale;
+  return getChannelScaleFactor(m_channels[CHANNEL_MAIN], vJets, sigma_bc, sigma_udsg, jetCategory.index());
+
+}
+
+double BTaggingScaleTool::getScaleFactor_veto( const UZH::JetVec& vJets, const double& sigma_bc, const double& sigma_udsg, const TString& ) {
+
+  return getChannelScaleFactor(m_channels[CHANNEL_VETO], vJets, sigma_bc, sigma_udsg, m_category_veto.index());
 
 }
 
-double BTaggingScaleTool::getScaleFactor_veto( const UZH::JetVec& vJets, const double& sigma_bc, const double& sigma_udsg, const TString& jetCategory) {
+double BTaggingScaleTool::getChannelScaleFactor( const Channel& channel, const UZH::JetVec& vJets, const double& sigma_bc, const double& sigma_udsg,
+                                                 const int& category ) {
 
+  BTAG_DEBUG_SCOPE;
   double scale = 1.;
   
-  m_logger << DEBUG << "BTaggingScaleTool::getScaleFactor_veto" << SLogger::endmsg;
+  BTAG_REPORT_DEBUG( "BTaggingScaleTool::getScaleFactor for " << channel.name );
 
   for (std::vector< UZH::Jet>::const_iterator itJet = vJets.begin(); itJet < vJets.end(); ++itJet) {
-    m_logger << DEBUG << "Looking at jet " << itJet - vJets.begin()
-	     << ", pT=" << (*itJet).pt() << ", eta=" << (*itJet).eta()
-	     << SLogger::endmsg;
+    BTAG_REPORT_DEBUG( "Looking at jet " << itJet - vJets.begin()
+	     << ", pT=" << (*itJet).pt() << ", eta=" << (*itJet).eta() );
 
-    scale *= getScaleFactor_veto(*itJet, sigma_bc, sigma_udsg, jetCategory);
+    scale *= getChannelScaleFactor(channel, itJet->pt(), itJet->eta(), itJet->hadronFlavour(), channel.scaleFactors.isTagged(itJet->csv()),
+                                   sigma_bc, sigma_udsg, category);
   }  
 
-  m_logger << DEBUG << "BTaggingScaleTool::getScaleFactor_veto done and wigth tot is " << scale<<  SLogger::endmsg;
+  BTAG_REPORT_DEBUG( "BTaggingScaleTool::getScaleFactor done for " << channel.name << ", weight " << scale );
   return scale;
 
 }
@@ -469,76 +357,419 @@ double BTaggingScaleTool::getScaleFactor_veto( const UZH::JetVec& vJets, const d
 //
 double BTaggingScaleTool::getSoftdropSubjetScaleFactor( const UZH::JetVec& vJets, const double& sigma_bc, const double& sigma_udsg, const TString& jetCategory ) {
 
-  double scale = 1.;
-  
-  m_logger << DEBUG << "BTaggingScaleTool::getSoftdropSubjetScaleFactor" << SLogger::endmsg;
+  return getSoftdropSubjetScaleFactor(vJets, sigma_bc, sigma_udsg, this->jetCategory(jetCategory));
 
-  for (std::vector< UZH::Jet>::const_iterator itJet = vJets.begin(); itJet < vJets.end(); ++itJet) {
-    m_logger << DEBUG << "Looking at jet " << itJet - vJets.begin()
-	     << ", pT=" << (*itJet).pt() << ", eta=" << (*itJet).eta()
-	     << SLogger::endmsg;
+}
 
-    scale *= getSoftdropSubjetScaleFactor(*itJet, sigma_bc, sigma_udsg, jetCategory);
-  }  
+double BTaggingScaleTool::getSoftdropSubjetScaleFactor( const UZH::JetVec& vJets, const double& sigma_bc, const double& sigma_udsg, const JetCategory& jetCategory ) {
 
-  m_logger << DEBUG << "BTaggingScaleTool::getSoftdropSubjetScaleFactor done" << SLogger::endmsg;
+  BTAG_DEBUG_SCOPE;
+  // the subjets of all jets in one batch
+  const double scale = vJets.empty() ? 1. : getSoftdropSubjetWeight(&vJets[0], vJets.size(), sigma_bc, sigma_udsg, jetCategory);
+  BTAG_REPORT_DEBUG( "BTaggingScaleTool::getSoftdropSubjetScaleFactor done for " << vJets.size() << " jets, scale " << scale );
   return scale;
 
 }
 
 
+BTaggingScaleTool::ScaleFactorWeights BTaggingScaleTool::getScaleFactors( const UZH::JetVec& vJets, const TString& jetCategory ) {
+
+  return getScaleFactors(vJets, this->jetCategory(jetCategory));
+
+}
+
+BTaggingScaleTool::ScaleFactorWeights BTaggingScaleTool::getScaleFactors( const UZH::JetVec& vJets, const JetCategory& jetCategory ) {
+
+  return getChannelScaleFactors(m_channels[CHANNEL_MAIN], vJets, jetCategory.index());
+
+}
+
+BTaggingScaleTool::ScaleFactorWeights BTaggingScaleTool::getScaleFactors_veto( const UZH::JetVec& vJets ) {
+
+  return getChannelScaleFactors(m_channels[CHANNEL_VETO], vJets, m_category_veto.index());
+
+}
+
+BTaggingScaleTool::ScaleFactorWeights BTaggingScaleTool::getChannelScaleFactors( const Channel& channel, const UZH::JetVec& vJets, const int& category ) {
+
+  BTAG_DEBUG_SCOPE;
+  const BTaggingScaleFactors& scaleFactors = fixedCutScaleFactors(channel);
+  ScaleFactorWeights weights = {1., 1., 1., 1., 1.};
+  try {
+    for (std::vector< UZH::Jet>::const_iterator itJet = vJets.begin(); itJet < vJets.end(); ++itJet) {
+      scaleFactors.multiplyJetWeights(weights, itJet->pt(), itJet->eta(), itJet->hadronFlavour(),
+                                      scaleFactors.isTagged(itJet->csv()), category);
+    }
+  }
+  catch (const std::runtime_error& e) {
+    throw SError( e.what(), SError::SkipCycle );
+  }
+  BTAG_REPORT_DEBUG( "BTaggingScaleTool::getScaleFactors done for " << channel.name << ", nominal weight " << weights.nominal );
+  return weights;
+
+}
+
+BTaggingScaleTool::ScaleFactorWeights BTaggingScaleTool::getSoftdropSubjetScaleFactors( const UZH::JetVec& vJets, const TString& jetCategory ) {
+
+  return getSoftdropSubjetScaleFactors(vJets, this->jetCategory(jetCategory));
+
+}
+
+BTaggingScaleTool::ScaleFactorWeights BTaggingScaleTool::getSoftdropSubjetScaleFactors( const UZH::JetVec& vJets, const JetCategory& jetCategory ) {
+
+  BTAG_DEBUG_SCOPE;
+  const BTaggingScaleFactors& scaleFactors = fixedCutScaleFactors(m_channels[CHANNEL_MAIN]);
+  // all subjets of the event in one batch
+  const size_t nSubjets = vJets.empty() ? 0 : gatherSoftdropSubjets(&vJets[0], vJets.size());
+  ScaleFactorWeights weights = {1., 1., 1., 1., 1.};
+  try {
+    scaleFactors.multiplyJetWeights(weights, nSubjets, &m_subjetPt[0], &m_subjetEta[0], &m_subjetFlavour[0], &m_subjetCsv[0],
+                                    jetCategory.index());
+  }
+  catch (const std::runtime_error& e) {
+    throw SError( e.what(), SError::SkipCycle );
+  }
+  BTAG_REPORT_DEBUG( "BTaggingScaleTool::getSoftdropSubjetScaleFactors done, nominal weight " << weights.nominal );
+  return weights;
+
+}
+
+
+void BTaggingScaleTool::getChannelScaleFactors( const UZH::JetVec& vJets, std::vector<ScaleFactorWeights>& weights ) {
+
+  BTAG_DEBUG_SCOPE;
+  const ScaleFactorWeights unit = {1., 1., 1., 1., 1.};
+  weights.assign(m_channelNames.size(), unit);
+  try {
+    for (std::vector< UZH::Jet>::const_iterator itJet = vJets.begin(); itJet < vJets.end(); ++itJet) {
+      // flavours and eta range once for all channels
+      const BTaggingScaleFactors::Jet jet(itJet->pt(), itJet->eta(), itJet->hadronFlavour());
+      if (!jet.inTracker) {
+        continue;
+      }
+      const double csv = itJet->csv();
+      for (size_t i = 0; i < weights.size(); ++i) {
+        const Channel& channel = m_channels[N_FIXED_CHANNELS + i];
+        channel.scaleFactors.multiplyJetWeights(weights[i], jet, channel.scaleFactors.isTagged(csv), channel.categories[0]);
+      }
+    }
+  }
+  catch (const std::runtime_error& e) {
+    throw SError( e.what(), SError::SkipCycle );
+  }
+  BTAG_REPORT_DEBUG( "BTaggingScaleTool::getChannelScaleFactors done for " << weights.size() << " channels" );
+
+}
+
+
+double BTaggingScaleTool::getSoftdropSubjetWeight( const UZH::Jet* jets, const size_t& nJets, const double& sigma_bc, const double& sigma_udsg,
+                                                   const JetCategory& jetCategory ) {
+
+  const BTaggingScaleFactors& scaleFactors = fixedCutScaleFactors(m_channels[CHANNEL_MAIN]);
+  const size_t nSubjets = gatherSoftdropSubjets(jets, nJets);
+  try {
+    if (sigma_bc == 0. && sigma_udsg == 0.) {
+      // only the central scale factors are looked up
+      return scaleFactors.nominalWeight(nSubjets, &m_subjetPt[0], &m_subjetEta[0], &m_subjetFlavour[0], &m_subjetCsv[0],
+                                        jetCategory.index());
+    }
+    return scaleFactors.variationWeight(nSubjets, &m_subjetPt[0], &m_subjetEta[0], &m_subjetFlavour[0], &m_subjetCsv[0],
+                                        sigma_bc, sigma_udsg, jetCategory.index());
+  }
+  catch (const std::runtime_error& e) {
+    throw SError( e.what(), SError::SkipCycle );
+  }
+
+}
+
+
+size_t BTaggingScaleTool::gatherSoftdropSubjets( const UZH::Jet* jets, const size_t& nJets ) {
+
+  size_t nSubjets = 0;
+  for (size_t j = 0; j < nJets; ++j) {
+    nSubjets += jets[j].subjet_softdrop_N();
+  }
+  // at least one element, so that the array pointers are valid
+  if (m_subjetPt.size() < nSubjets + 1) {
+    m_subjetPt.resize(nSubjets + 1);
+    m_subjetEta.resize(nSubjets + 1);
+    m_subjetCsv.resize(nSubjets + 1);
+    m_subjetFlavour.resize(nSubjets + 1);
+  }
+
+  // each accessor once per jet
+  size_t k = 0;
+  for (size_t j = 0; j < nJets; ++j) {
+    const int n = jets[j].subjet_softdrop_N();
+    const auto& pt = jets[j].subjet_softdrop_pt();
+    const auto& eta = jets[j].subjet_softdrop_eta();
+    const auto& csv = jets[j].subjet_softdrop_csv();
+    const auto& flavour = jets[j].subjet_softdrop_hadronFlavour();
+    for (int i = 0; i < n; ++i, ++k) {
+      m_subjetPt[k] = pt[i];
+      m_subjetEta[k] = eta[i];
+      m_subjetCsv[k] = csv[i];
+      m_subjetFlavour[k] = flavour[i];
+    }
+  }
+  return nSubjets;
+
+}
+
+
+BTaggingScaleTool::ScaleFactorWeights BTaggingScaleTool::getMultiWPScaleFactors( const UZH::JetVec& vJets, const TString& jetCategory ) {
+
+  return getMultiWPScaleFactors(vJets, this->jetCategory(jetCategory));
+
+}
+
+
+BTaggingScaleTool::ScaleFactorWeights BTaggingScaleTool::getMultiWPScaleFactors( const UZH::JetVec& vJets, const JetCategory& jetCategory ) {
+
+  BTAG_DEBUG_SCOPE;
+  if (!m_multiWP.nWorkingPoints()) {
+    throw SError( ("Multi working point weights need " + m_name + "_MultiWorkingPoints").c_str(), SError::SkipCycle );
+  }
+  const int category = jetCategory.index();
+  if (!m_multiWPCategories[category]) {
+    throw SError( ("No efficiencies of " + m_name + "_MultiWorkingPoints for " + m_jetCategories[category]).Data(), SError::SkipCycle );
+  }
+  ScaleFactorWeights weights = {1., 1., 1., 1., 1.};
+  try {
+    for (std::vector< UZH::Jet>::const_iterator itJet = vJets.begin(); itJet < vJets.end(); ++itJet) {
+      m_multiWP.multiplyJetWeights(weights, BTaggingScaleFactors::Jet(itJet->pt(), itJet->eta(), itJet->hadronFlavour()),
+                                   itJet->csv(), category);
+    }
+  }
+  catch (const std::runtime_error& e) {
+    throw SError( e.what(), SError::SkipCycle );
+  }
+  BTAG_REPORT_DEBUG( "BTaggingScaleTool::getMultiWPScaleFactors done, nominal weight " << weights.nominal );
+  return weights;
+
+}
+
+
+BTaggingScaleTool::ScaleFactorWeights BTaggingScaleTool::getSoftdropSubjetMultiWPScaleFactors( const UZH::JetVec& vJets, const TString& jetCategory ) {
+
+  return getSoftdropSubjetMultiWPScaleFactors(vJets, this->jetCategory(jetCategory));
+
+}
+
+
+BTaggingScaleTool::ScaleFactorWeights BTaggingScaleTool::getSoftdropSubjetMultiWPScaleFactors( const UZH::JetVec& vJets, const JetCategory& jetCategory ) {
+
+  BTAG_DEBUG_SCOPE;
+  if (!m_multiWP.nWorkingPoints()) {
+    throw SError( ("Multi working point weights need " + m_name + "_MultiWorkingPoints").c_str(), SError::SkipCycle );
+  }
+  const int category = jetCategory.index();
+  if (!m_multiWPCategories[category]) {
+    throw SError( ("No efficiencies of " + m_name + "_MultiWorkingPoints for " + m_jetCategories[category]).Data(), SError::SkipCycle );
+  }
+  ScaleFactorWeights weights = {1., 1., 1., 1., 1.};
+  try {
+    for (std::vector< UZH::Jet>::const_iterator itJet = vJets.begin(); itJet < vJets.end(); ++itJet) {
+      for (int i = 0; i < itJet->subjet_softdrop_N(); ++i) {
+        m_multiWP.multiplyJetWeights(weights, BTaggingScaleFactors::Jet(itJet->subjet_softdrop_pt()[i], itJet->subjet_softdrop_eta()[i],
+                                                                        itJet->subjet_softdrop_hadronFlavour()[i]),
+                                     itJet->subjet_softdrop_csv()[i], category);
+      }
+    }
+  }
+  catch (const std::runtime_error& e) {
+    throw SError( e.what(), SError::SkipCycle );
+  }
+  BTAG_REPORT_DEBUG( "BTaggingScaleTool::getSoftdropSubjetMultiWPScaleFactors done, nominal weight " << weights.nominal );
+  return weights;
+
+}
+
+
+void BTaggingScaleTool::getReshapingWeights( const UZH::JetVec& vJets, std::vector<double>& weights ) {
+
+  getChannelReshapingWeights(m_channels[CHANNEL_MAIN], vJets, weights);
+
+}
+
+
+void BTaggingScaleTool::getReshapingWeights_veto( const UZH::JetVec& vJets, std::vector<double>& weights ) {
+
+  getChannelReshapingWeights(m_channels[CHANNEL_VETO], vJets, weights);
+
+}
+
+
+void BTaggingScaleTool::getChannelReshapingWeights( const Channel& channel, const UZH::JetVec& vJets, std::vector<double>& weights ) {
+
+  BTAG_DEBUG_SCOPE;
+  const BTaggingReshapingWeights& reshapingWeights = channel.reshapingWeights;
+  if (!reshapingWeights.nWeights()) {
+    throw SError( ("Reshaping weights need WorkingPoint Reshaping, " + channel.name + " has " + channel.workingPoint).c_str(), SError::SkipCycle );
+  }
+  weights.assign(reshapingWeights.nWeights(), 1.);
+
+  try {
+    for (std::vector< UZH::Jet>::const_iterator itJet = vJets.begin(); itJet < vJets.end(); ++itJet) {
+      reshapingWeights.multiplyJetWeights(&weights[0], &m_reshapingScratch[0], itJet->pt(), itJet->eta(), itJet->hadronFlavour(), itJet->csv());
+    }
+  }
+  catch (const std::runtime_error& e) {
+    throw SError( e.what(), SError::SkipCycle );
+  }
+  BTAG_REPORT_DEBUG( "BTaggingScaleTool::getReshapingWeights done for " << channel.name << ", central weight " << weights[0] );
+
+}
+
+
 /// function to book histograms for efficiencies
 void BTaggingScaleTool::bookHistograms() {
   
+  // before the counters are attached to the new histograms
+  flushLateEfficiencyFills();
+  
   const int nPtBins = 11;
   const int nEtaBins = 4;
   float ptBins[nPtBins+1] = {10, 20, 30, 50, 70, 100, 140, 200, 300, 670, 1000, 1500};
   float etaBins[nEtaBins+1] = {-2.5, -1.5, 0, 1.5, 2.5};
   
-  for (std::vector<TString>::const_iterator jetCat = m_jetCategories.begin(); jetCat != m_jetCategories.end(); ++jetCat) {
-    for (std::vector<TString>::const_iterator flav = m_flavours.begin(); flav != m_flavours.end(); ++flav) {
-      Book( TH2F( *jetCat + "_" + *flav + "_" + m_workingPoint, *jetCat + "_" + *flav + "_" + m_workingPoint, nPtBins, ptBins, nEtaBins, etaBins ), m_effHistDirectory.c_str() );
-      Book( TH2F( *jetCat + "_" + *flav + "_all", *jetCat + "_" + *flav + "_all", nPtBins, ptBins, nEtaBins, etaBins ), m_effHistDirectory.c_str() );
+  // the booked histograms are filled through flat counters, see BTaggingScaleFactors
+  m_effNumerators.assign(m_jetCategories.size(), std::vector<EffNumerator>());
+  for (std::vector<Channel>::iterator channel = m_channels.begin(); channel != m_channels.end(); ++channel) {
+    channel->scaleFactors.setDeferredEfficiencyFills(m_deferEfficiencyFills);
+    if (channel->operatingPoint == BTagEntry::OP_RESHAPING) {
+      continue;
+    }
+    for (std::vector<int>::const_iterator category = channel->categories.begin(); category != channel->categories.end(); ++category) {
+      bookEfficiencies(channel->scaleFactors, *category, channel->workingPoint, nPtBins, ptBins, nEtaBins, etaBins);
+    }
+  }
+  // the _MultiWorkingPoints in every category booked above, with the same denominator
+  for (size_t i = 0; i < m_multiWP.nWorkingPoints(); ++i) {
+    m_multiWP.workingPoint(i).setDeferredEfficiencyFills(m_deferEfficiencyFills);
+    for (size_t category = 0; category < m_effNumerators.size(); ++category) {
+      if (!m_effNumerators[category].empty()) {
+        bookEfficiencies(m_multiWP.workingPoint(i), category, m_multiWorkingPoints[i], nPtBins, ptBins, nEtaBins, etaBins);
+      }
     }
   }
+  
+}
 
+
+void BTaggingScaleTool::bookEfficiencies( BTaggingScaleFactors& scaleFactors, const int& category, const std::string& workingPoint,
+                                          const int& nPtBins, const float* ptBins, const int& nEtaBins, const float* etaBins ) {
+
+  // a working point of the same name has the same cut: its histograms are filled once
+  std::vector<EffNumerator>& numerators = m_effNumerators[category];
+  for (std::vector<EffNumerator>::const_iterator numerator = numerators.begin(); numerator != numerators.end(); ++numerator) {
+    if (numerator->workingPoint == workingPoint) {
+      return;
+    }
+  }
+  const TString& jetCat = m_jetCategories[category];
   for (std::vector<TString>::const_iterator flav = m_flavours.begin(); flav != m_flavours.end(); ++flav) {
-    Book( TH2F("jet_ak4_" + *flav + "_" + m_workingPoint_veto, "jet_ak4_" + *flav + "_" + m_workingPoint_veto, nPtBins, ptBins, nEtaBins, etaBins ), m_effHistDirectory.c_str() );
-    Book( TH2F( "jet_ak4_" + *flav + "_all", "jet_ak4_" + *flav + "_all", nPtBins, ptBins, nEtaBins, etaBins ), m_effHistDirectory.c_str() );
+    TH2F* hPass = Book( TH2F( jetCat + "_" + *flav + "_" + workingPoint, jetCat + "_" + *flav + "_" + workingPoint, nPtBins, ptBins, nEtaBins, etaBins ), m_effHistDirectory.c_str() );
+    // one denominator for all working points of the category
+    TH2F* hAll = 0;
+    if (numerators.empty()) {
+      hAll = Book( TH2F( jetCat + "_" + *flav + "_all", jetCat + "_" + *flav + "_all", nPtBins, ptBins, nEtaBins, etaBins ), m_effHistDirectory.c_str() );
+    }
+    scaleFactors.bookEfficiency(category, BTaggingScaleFactors::EffFlavour(flav - m_flavours.begin()), hPass, hAll);
   }
+  const EffNumerator numerator = {&scaleFactors, workingPoint};
+  numerators.push_back(numerator);
+
+}
+
+
+void BTaggingScaleTool::fillEffCounter( const int& category, const int& flavour, bool isTagged, const double& pt, const double& eta ) {
+
+  if (category < 0 || size_t(category) >= m_effNumerators.size() || m_effNumerators[category].empty()) {
+    throw SError( "Efficiency histograms are not booked for this jet category", SError::SkipCycle );
+  }
+  if (m_effNumerators[category].size() > 1) {
+    throw SError( ("Several working points are booked for " + m_jetCategories[category]
+                   + ": fill them with fillEfficiencies, fillEfficiencies_veto or fillSoftdropSubjetEfficiencies").Data(), SError::SkipCycle );
+  }
+  try {
+    m_effNumerators[category][0].scaleFactors->fillEfficiency(category, flavour, isTagged, pt, eta);
+  }
+  catch (const std::runtime_error& e) {
+    throw SError( e.what(), SError::SkipCycle );
+  }
+
+}
+
+
+void BTaggingScaleTool::fillEffCounters( const int& category, const int& flavour, const double& discr, const double& pt, const double& eta ) {
+
+  if (category < 0 || size_t(category) >= m_effNumerators.size() || m_effNumerators[category].empty()) {
+    throw SError( "Efficiency histograms are not booked for this jet category", SError::SkipCycle );
+  }
+  const std::vector<EffNumerator>& numerators = m_effNumerators[category];
+  try {
+    for (std::vector<EffNumerator>::const_iterator numerator = numerators.begin(); numerator != numerators.end(); ++numerator) {
+      numerator->scaleFactors->fillEfficiency(category, flavour, numerator->scaleFactors->isTagged(discr), pt, eta);
+    }
+  }
+  catch (const std::runtime_error& e) {
+    throw SError( e.what(), SError::SkipCycle );
+  }
+
+}
+
+
+double BTaggingScaleTool::pendingEfficiencyFills() const {
+
+  double entries = 0.;
+  for (std::vector<Channel>::const_iterator channel = m_channels.begin(); channel != m_channels.end(); ++channel) {
+    entries += channel->scaleFactors.pendingEfficiencyFills();
+  }
+  for (size_t i = 0; i < m_multiWP.nWorkingPoints(); ++i) {
+    entries += m_multiWP.workingPoint(i).pendingEfficiencyFills();
+  }
+  return entries;
+
+}
+
+
+/// function to fill b-tagging efficiencies for an individual jet
+void BTaggingScaleTool::fillEfficiency( const double& pt, const double& eta, const int& flavour, bool isTagged, const TString& jetCategory ) {
+
+  fillEfficiency(pt, eta, flavour, isTagged, this->jetCategory(jetCategory));
+
+}
+
+void BTaggingScaleTool::fillEfficiency( const double& pt, const double& eta, const int& flavour, bool isTagged, const JetCategory& jetCategory ) {
+
+  fillEffCounter(jetCategory.index(), flavour, isTagged, pt, eta);
 
-  
 }
 
 
 /// function to fill jet b-tagging efficiencies
 void BTaggingScaleTool::fillEfficiencies( const UZH::JetVec& vJets ) {
   
-  for (std::vector< UZH::Jet>::const_iterator itJet = vJets.begin(); itJet < vJets.end(); ++itJet) {
-    m_logger << DEBUG << "Looking at jet " << itJet - vJets.begin()
-	     << ", pT=" << (*itJet).pt() << ", eta=" << (*itJet).eta()
-	     << SLogger::endmsg;
-    TString flavourString = flavourToString(itJet->hadronFlavour());
-    if (isTagged(*itJet)) {
-      Hist( "jet_" + flavourString + "_" + m_workingPoint, m_effHistDirectory.c_str() )->Fill( itJet->pt(), itJet->eta() );
-    }
-    Hist( "jet_" + flavourString + "_all", m_effHistDirectory.c_str() )->Fill( itJet->pt(), itJet->eta() );
-  }
+  fillEfficiencies(vJets, m_category_jet);
   
 }
 
 /// function to fill jet b-tagging efficiencies for Ak4 used in veto
 void BTaggingScaleTool::fillEfficiencies_veto( const UZH::JetVec& vJets ) {
   
+  fillEfficiencies(vJets, m_category_veto);
+  
+}
+
+void BTaggingScaleTool::fillEfficiencies( const UZH::JetVec& vJets, const JetCategory& jetCategory ) {
+  
+  BTAG_DEBUG_SCOPE;
+  const int category = jetCategory.index();
   for (std::vector< UZH::Jet>::const_iterator itJet = vJets.begin(); itJet < vJets.end(); ++itJet) {
-    m_logger << DEBUG << "Looking at jet " << itJet - vJets.begin()
-	     << ", pT=" << (*itJet).pt() << ", eta=" << (*itJet).eta()
-	     << SLogger::endmsg;
-    TString flavourString = flavourToString(itJet->hadronFlavour());
-    if (isTagged_veto(*itJet)) {
-      Hist( "jet_ak4_" + flavourString + "_" + m_workingPoint_veto, m_effHistDirectory.c_str() )->Fill( itJet->pt(), itJet->eta() );
-    }
-    Hist( "jet_ak4_" + flavourString + "_all", m_effHistDirectory.c_str() )->Fill( itJet->pt(), itJet->eta() );
+    BTAG_REPORT_DEBUG( "Looking at jet " << itJet - vJets.begin()
+	     << ", pT=" << (*itJet).pt() << ", eta=" << (*itJet).eta() );
+    fillEffCounters(category, itJet->hadronFlavour(), itJet->csv(), itJet->pt(), itJet->eta());
   }
   
 }
@@ -546,19 +777,15 @@ void BTaggingScaleTool::fillEfficiencies_veto( const UZH::JetVec& vJets ) {
 /// function to fill subjet b-tagging efficiencies
 void BTaggingScaleTool::fillSoftdropSubjetEfficiencies( const UZH::JetVec& vJets ) {
   
+  BTAG_DEBUG_SCOPE;
+  const int category = m_category_subjet.index();
   for (std::vector< UZH::Jet>::const_iterator itJet = vJets.begin(); itJet < vJets.end(); ++itJet) {
-    m_logger << DEBUG << "Looking at jet " << itJet - vJets.begin()
-	     << ", pT=" << (*itJet).pt() << ", eta=" << (*itJet).eta()
-	     << SLogger::endmsg;
+    BTAG_REPORT_DEBUG( "Looking at jet " << itJet - vJets.begin()
+	     << ", pT=" << (*itJet).pt() << ", eta=" << (*itJet).eta() );
     for (int i = 0; i < itJet->subjet_softdrop_N(); ++i) {
-      m_logger << DEBUG << "Looking at softdrop subjet " << i
-  	     << ", pT=" << itJet->subjet_softdrop_pt()[i] << ", eta=" << itJet->subjet_softdrop_eta()[i]
-  	     << SLogger::endmsg;
-      TString flavourString = flavourToString(itJet->subjet_softdrop_hadronFlavour()[i]);
-      if (isTagged(itJet->subjet_softdrop_csv()[i])) {
-        Hist( "subjet_softdrop_" + flavourString + "_" + m_workingPoint, m_effHistDirectory.c_str() )->Fill( itJet->subjet_softdrop_pt()[i], itJet->subjet_softdrop_eta()[i] );
-      }
-      Hist( "subjet_softdrop_" + flavourString + "_all", m_effHistDirectory.c_str() )->Fill( itJet->subjet_softdrop_pt()[i], itJet->subjet_softdrop_eta()[i] );
+      BTAG_REPORT_DEBUG( "Looking at softdrop subjet " << i
+  	     << ", pT=" << itJet->subjet_softdrop_pt()[i] << ", eta=" << itJet->subjet_softdrop_eta()[i] );
+      fillEffCounters(category, itJet->subjet_softdrop_hadronFlavour()[i], itJet->subjet_softdrop_csv()[i], itJet->subjet_softdrop_pt()[i], itJet->subjet_softdrop_eta()[i]);
     }
   }
   
@@ -568,131 +795,323 @@ void BTaggingScaleTool::fillSoftdropSubjetEfficiencies( const UZH::JetVec& vJets
 /// function to read efficiencies
 void BTaggingScaleTool::readEfficiencies() {
   
-  m_logger << INFO << "Reading in b-tagging efficiencies from file " << m_effFile << SLogger::endmsg;
-  auto inFile = TFile::Open(m_effFile.c_str());
-  
-  for (std::vector<TString>::iterator jetCat = m_jetCategories.begin(); jetCat != m_jetCategories.end(); ++jetCat) {
+  // the main working point can also be asked for the categories of the other channels, with
+  // the efficiencies of the first channel reading them
+  Channel& main = m_channels[CHANNEL_MAIN];
+  std::vector<bool> mainHasCategory(m_jetCategories.size(), false);
+  m_multiWPCategories.assign(m_jetCategories.size(), false);
+  for (std::vector<Channel>::iterator channel = m_channels.begin(); channel != m_channels.end(); ++channel) {
+    // the reshaping scale factors need no efficiencies
+    if (channel->operatingPoint == BTagEntry::OP_RESHAPING) {
+      continue;
+    }
+    m_logger << INFO << "For " << channel->name << ": Reading in b-tagging efficiencies from file " << channel->effFile << SLogger::endmsg;
+    std::unique_ptr<TFile> inFile( TFile::Open(channel->effFile.c_str()) );
+    if (!inFile || inFile->IsZombie()) {
+      throw SError( ("Cannot open efficiency file " + channel->effFile).c_str(), SError::SkipCycle );
+    }
+    for (std::vector<int>::const_iterator category = channel->categories.begin(); category != channel->categories.end(); ++category) {
+      const bool forMain = !mainHasCategory[*category];
+      mainHasCategory[*category] = true;
+      for (std::vector<TString>::const_iterator flav = m_flavours.begin(); flav != m_flavours.end(); ++flav) {
+        const BTaggingScaleFactors::EffFlavour effFlavour = BTaggingScaleFactors::EffFlavour(flav - m_flavours.begin());
+        const TString name = m_effHistDirectory + "/" + m_jetCategories[*category] + "_" + *flav;
+        auto hPass = (TH2F*) inFile->Get( name + "_" + channel->workingPoint );
+        auto hAll = getEfficiencyDenominator( inFile.get(), name, channel->workingPoint );
+        if (!hPass || !hAll) {
+          throw SError( ("Missing efficiency histograms " + name + "_" + channel->workingPoint + " in " + channel->effFile).Data(), SError::SkipCycle );
+        }
+        channel->scaleFactors.setEfficiency(*category, effFlavour, *hPass, *hAll);
+        if (forMain && &*channel != &main) {
+          main.scaleFactors.setEfficiency(*category, effFlavour, *hPass, *hAll);
+        }
+        m_logger << DEBUG << "effi TH2D binsx: " << hPass->GetNbinsX() << " binsy: " << hPass->GetNbinsY() << SLogger::endmsg;
+      }
+      // the _MultiWorkingPoints of a category from the first file with all of them: required in
+      // the categories of the main configuration, optional in the others
+      if (m_multiWorkingPoints.empty() || m_multiWPCategories[*category]) {
+        continue;
+      }
+      m_multiWPCategories[*category] = readMultiWPEfficiencies(inFile.get(), *category);
+      if (!m_multiWPCategories[*category]) {
+        if (&*channel == &main) {
+          throw SError( ("Missing efficiency histograms of " + m_name + "_MultiWorkingPoints for " + m_jetCategories[*category]
+                         + " in " + channel->effFile).Data(), SError::SkipCycle );
+        }
+        m_logger << INFO << "No efficiencies of " << m_name << "_MultiWorkingPoints for " << m_jetCategories[*category]
+                 << " in " << channel->effFile << ", getMultiWPScaleFactors cannot be used for it" << SLogger::endmsg;
+      }
+    }
+    inFile->Close();
+  }
+
+}
+
+
+TH2F* BTaggingScaleTool::getEfficiencyDenominator( TFile* file, const TString& name, const TString& workingPoint ) const {
+
+  // files merged from outputs with different working points have one denominator per working point
+  auto hAll = (TH2F*) file->Get( name + "_" + workingPoint + "_all" );
+  if (!hAll) hAll = (TH2F*) file->Get( name + "_all" );
+  return hAll;
+
+}
+
+
+void BTaggingScaleTool::setupChannels( BTagCalibration::LoadMode loadMode ) {
+
+  // the efficiency histograms booked for the old channels are gone
+  m_effNumerators.clear();
+  m_channels.assign(N_FIXED_CHANNELS + m_channelNames.size(), Channel());
+
+  Channel& main = m_channels[CHANNEL_MAIN];
+  main.name = "main";
+  main.tagger = m_tagger;
+  main.workingPoint = m_workingPoint;
+  main.csvFile = m_csvFile;
+  main.cacheFile = m_cacheFile;
+  main.measurementType_bc = m_measurementType_bc;
+  main.measurementType_udsg = m_measurementType_udsg;
+  main.effFile = m_effFile;
+  main.categories.push_back(m_category_jet.index());
+  main.categories.push_back(m_category_subjet.index());
+
+  Channel& veto = m_channels[CHANNEL_VETO];
+  veto.name = "veto";
+  veto.tagger = m_tagger_veto;
+  veto.workingPoint = m_workingPoint_veto;
+  veto.csvFile = m_csvFile_veto;
+  veto.cacheFile = m_cacheFile_veto;
+  veto.measurementType_bc = m_measurementType_veto_bc;
+  veto.measurementType_udsg = m_measurementType_veto_udsg;
+  veto.effFile = m_effFile_veto;
+  veto.categories.push_back(m_category_veto.index());
+
+  for (size_t i = 0; i < m_channelNames.size(); ++i) {
+    Channel& channel = m_channels[N_FIXED_CHANNELS + i];
+    channel.name = m_channelNames[i];
+    channel.tagger = channelSetting(m_channelTaggers, i, "Taggers");
+    channel.workingPoint = channelSetting(m_channelWorkingPoints, i, "WorkingPoints");
+    // getChannelScaleFactors has fixed-cut weights only
+    if (channel.workingPoint.find("Reshaping") != std::string::npos) {
+      throw SError( ("Channel " + channel.name + ": WorkingPoint Reshaping is only supported for the main and the veto configuration").c_str(),
+                    SError::SkipCycle );
+    }
+    channel.csvFile = channelSetting(m_channelCsvFiles, i, "CsvFiles");
+    channel.cacheFile = channelSetting(m_channelCacheFiles, i, "CacheFiles");
+    channel.measurementType_bc = channelSetting(m_channelMeasurementTypes_bc, i, "MeasurementTypes_bc");
+    channel.measurementType_udsg = channelSetting(m_channelMeasurementTypes_udsg, i, "MeasurementTypes_udsg");
+    channel.effFile = channelSetting(m_channelEffFiles, i, "EffFiles");
+    const std::string& jetCategory = channelSetting(m_channelJetCategories, i, "JetCategories");
+    if (effCategory(jetCategory) < 0) {
+      throw SError( ("Unknown jet category for channel " + channel.name + ": " + jetCategory).c_str(), SError::SkipCycle );
+    }
+    channel.categories.push_back(effCategory(jetCategory));
+  }
+
+  for (std::vector<Channel>::iterator channel = m_channels.begin(); channel != m_channels.end(); ++channel) {
+    setupChannel(*channel, loadMode);
+  }
+
+}
+
+
+void BTaggingScaleTool::setupChannel( Channel& channel, BTagCalibration::LoadMode loadMode ) {
+
+  const std::string wpNames[] = {"Loose", "Medium", "Tight", "Reshaping"};
+  const BTagEntry::OperatingPoint wps[] = {BTagEntry::OP_LOOSE, BTagEntry::OP_MEDIUM, BTagEntry::OP_TIGHT, BTagEntry::OP_RESHAPING};
+  int w = 0;
+  while (w < 4 && channel.workingPoint.find(wpNames[w]) == std::string::npos) {
+    ++w;
+  }
+  if (w == 4) {
+    throw SError( ("Unknown working point for " + channel.name + ": " + channel.workingPoint).c_str(), SError::SkipCycle );
+  }
+  channel.operatingPoint = wps[w];
+  const double workingPointCut = wpCuts[w < 3 ? wpNames[w] : "Loose"]; // placeholder for Reshaping, use getReshapingWeights
+
+  m_logger << INFO << "Channel " << channel.name << ": " << channel.tagger << " " << channel.workingPoint
+           << ", " << channel.csvFile << " (" << channel.measurementType_bc << ", " << channel.measurementType_udsg << ")"
+           << ", efficiencies " << channel.effFile << SLogger::endmsg;
+
+  // one reader per configuration, central/up/down share the bin lookup
+  const std::vector<std::string> otherSysTypes = {"up", "down"};
+
+  // the calibration code reports missing files and entries with a bare std::exception
+  channel.reshapingWeights = BTaggingReshapingWeights();
+  try {
+    // hold the csv file until all readers of the channel are built, so that it is read only once
+    const std::shared_ptr<const BTagCalibration> calibration =
+      BTagCalibrationRegistry::calibration(channel.tagger, channel.csvFile, loadMode, channel.cacheFile);
+
+    if (channel.operatingPoint != BTagEntry::OP_RESHAPING) {
+      // readers are shared with all other tools (and input data blocks) using the same settings
+      channel.scaleFactors.setReader(BTagCalibrationRegistry::reader(channel.tagger, channel.csvFile, channel.operatingPoint,
+                                                                     channel.measurementType_bc, channel.measurementType_udsg,
+                                                                     "central", otherSysTypes,
+                                                                     m_tabulationTolerance, loadMode, channel.cacheFile, m_tabulationCubic),
+                                     workingPointCut);
+    }
+    else {
+      // iterativefit scale factors only: no fixed-cut reader, the cut is kept for isTagged
+      channel.scaleFactors.setReader(std::shared_ptr<const BTagCalibrationReader>(), workingPointCut);
+      m_logger << INFO << "MeasurementType reshaping: " << m_measurementType_reshaping
+               << ", " << m_reshapingSysTypes.size() << " systematics" << SLogger::endmsg;
+      channel.reshapingWeights.setReader(BTagCalibrationRegistry::reader(channel.tagger, channel.csvFile, channel.operatingPoint,
+                                                                         m_measurementType_reshaping, m_measurementType_reshaping,
+                                                                         "central", m_reshapingSysTypes,
+                                                                         m_tabulationTolerance, loadMode, channel.cacheFile, m_tabulationCubic));
+    }
+  }
+  catch (const std::exception& e) {
+    throw SError( ("Channel " + channel.name + ": cannot read the " + channel.workingPoint + " scale factors of " + channel.csvFile
+                   + " (" + e.what() + ")").c_str(), SError::SkipCycle );
+  }
+
+  const BTagEntry::JetFlavor flavors[] = {BTagEntry::FLAV_B, BTagEntry::FLAV_C, BTagEntry::FLAV_UDSG};
+  if (channel.operatingPoint == BTagEntry::OP_RESHAPING) {
+    for (int i = 0; i < 3; ++i) {
+      m_logger << INFO << "Reshaping systematics for flavor " << flavors[i] << ": "
+               << channel.reshapingWeights.nEvaluated(flavors[i]) - 1 << SLogger::endmsg;
+    }
+  }
+
+  if (m_tabulationTolerance > 0.) {
+    const BTagCalibrationReader& reader = channel.operatingPoint == BTagEntry::OP_RESHAPING ? channel.reshapingWeights.reader()
+                                                                                             : channel.scaleFactors.reader();
+    for (int i = 0; i < 3; ++i) {
+      m_logger << INFO << "Tabulated scale factors of " << channel.name << " for flavor " << flavors[i]
+               << (m_tabulationCubic ? " (cubic)" : "")
+               << ", error bound: " << reader.tabulationError(flavors[i])
+               << " (tolerance " << m_tabulationTolerance << ")" << SLogger::endmsg;
+    }
+  }
+
+}
+
+
+bool BTaggingScaleTool::readMultiWPEfficiencies( TFile* file, const int& category ) {
+
+  std::vector<TH2F*> hPass, hAll;
+  for (size_t i = 0; i < m_multiWorkingPoints.size(); ++i) {
     for (std::vector<TString>::const_iterator flav = m_flavours.begin(); flav != m_flavours.end(); ++flav) {
-      auto hPass = (TH2F*) inFile->Get( m_effHistDirectory + "/" + *jetCat + "_" + *flav + "_" + m_workingPoint);
-      auto hAll = (TH2F*) inFile->Get( m_effHistDirectory + "/" + *jetCat + "_" + *flav + "_all");
-      TH2F hEff = *((TH2F*) hPass->Clone( m_effHistDirectory + "_" + *jetCat + "_" + *flav + "_" + m_workingPoint ));
-      hEff.Divide(hAll);
-      // delete hPass;
-      // delete hAll;
-      m_effMaps[(*jetCat + "_" + *flav + "_" + m_workingPoint).Data()] = hEff;
-      m_logger << DEBUG << "effi TH2D binsx: " << hEff.GetNbinsX() << " binsy: " << hEff.GetNbinsY() << SLogger::endmsg;
-    }
-  }
-  inFile->Close();
-  // delete inFile;
-  
-  m_logger << INFO << "For Veto:Reading in b-tagging efficiencies from file " << m_effFile_veto << SLogger::endmsg;
-  auto inFile_veto = TFile::Open(m_effFile_veto.c_str());
-  
-  for (std::vector<TString>::const_iterator flav = m_flavours.begin(); flav != m_flavours.end(); ++flav) {
-    auto hPass_veto = (TH2F*) inFile_veto->Get( m_effHistDirectory + "/" + "jet_ak4_" + *flav + "_" + m_workingPoint_veto);
-    auto hAll_veto = (TH2F*) inFile_veto->Get( m_effHistDirectory + "/" + "jet_ak4_" + *flav + "_all");
-    TH2F hEff_veto = *((TH2F*) hPass_veto->Clone( m_effHistDirectory + "_jet_ak4_" + *flav + "_" + m_workingPoint_veto ));
-    hEff_veto.Divide(hAll_veto);
-    // delete hPass;
-    // delete hAll;
-    m_effMaps_veto[( "jet_ak4_" + *flav + "_" + m_workingPoint_veto).Data()] = hEff_veto;
-    m_logger << DEBUG << "effi Veto TH2D binsx: " << hEff_veto.GetNbinsX() << " binsy: " << hEff_veto.GetNbinsY() << SLogger::endmsg;
+      const TString name = m_effHistDirectory + "/" + m_jetCategories[category] + "_" + *flav;
+      hPass.push_back( (TH2F*) file->Get( name + "_" + m_multiWorkingPoints[i].c_str() ) );
+      hAll.push_back( getEfficiencyDenominator( file, name, m_multiWorkingPoints[i] ) );
+      if (!hPass.back() || !hAll.back()) {
+        return false;
+      }
+    }
   }
-  
-  inFile_veto->Close();
+  for (size_t i = 0, k = 0; i < m_multiWorkingPoints.size(); ++i) {
+    for (size_t flav = 0; flav < m_flavours.size(); ++flav, ++k) {
+      m_multiWP.workingPoint(i).setEfficiency(category, BTaggingScaleFactors::EffFlavour(flav), *hPass[k], *hAll[k]);
+    }
+  }
+  return true;
+
+}
+
+
+const BTaggingScaleFactors& BTaggingScaleTool::fixedCutScaleFactors( const Channel& channel ) const {
+
+  if (channel.operatingPoint == BTagEntry::OP_RESHAPING) {
+    throw SError( ("The " + channel.name + " configuration has WorkingPoint Reshaping, its weights are given by getReshapingWeights"
+                   + std::string(&channel == &m_channels[CHANNEL_VETO] ? "_veto" : "")).c_str(), SError::SkipCycle );
+  }
+  return channel.scaleFactors;
+
+}
+
+
+const std::string& BTaggingScaleTool::channelSetting( const std::vector<std::string>& values, const size_t& channel, const std::string& property ) const {
 
+  if (values.size() == 1) {
+    return values[0];
+  }
+  if (values.size() != m_channelNames.size()) {
+    throw SError( (m_name + "_Channel_" + property + " needs one entry, or one per channel").c_str(), SError::SkipCycle );
+  }
+  return values[channel];
+
+}
+
+
+int BTaggingScaleTool::effCategory( const TString& jetCategory ) const {
+
+  for (size_t i = 0; i < m_jetCategories.size(); ++i) {
+    if (jetCategory == m_jetCategories[i]) {
+      return i;
+    }
+  }
+  return -1;
 
 }
 
+
 double BTaggingScaleTool::getEfficiency( const double& pt, const double& eta, const int& flavour, const TString& jetCategory ) {
-  double eff = 1.;
- 
-  if (jetCategory!="jet_ak4"){
  
-    TH2F thisHist = m_effMaps[(jetCategory + "_" + flavourToString(flavour) + "_" + m_workingPoint).Data()];
-    m_logger << DEBUG << /*thisHist << " " << */ thisHist.GetName() << SLogger::endmsg;
-    int binx = thisHist.GetXaxis()->FindBin(pt);
-    int biny = thisHist.GetYaxis()->FindBin(eta);
-    m_logger << DEBUG << "binx = " << binx << " biny = " << biny << SLogger::endmsg;
-    m_logger << DEBUG << "maxx = " << thisHist.GetNbinsX() << " maxy = " << thisHist.GetNbinsY() << SLogger::endmsg;
-    // implement check for overflow
-    eff = thisHist.GetBinContent(binx, biny);
-    m_logger << DEBUG << "For "<< jetCategory << " with pt = " << pt << ", eta = " << eta << ", flavour = " << flavour << " returning efficiency =" << eff << SLogger::endmsg;
+  return getEfficiency(pt, eta, BTaggingScaleFactors::effFlavour(flavour), this->jetCategory(jetCategory));
+
+}
+
+
+double BTaggingScaleTool::getEfficiency( const double& pt, const double& eta, const int& flavour, const JetCategory& jetCategory ) {
  
-  }else{
-    
-    TH2F thisHist_veto = m_effMaps_veto[("jet_ak4_" + flavourToString(flavour) + "_" + m_workingPoint_veto).Data()];
-    m_logger << DEBUG << /*thisHist << " " << */ thisHist_veto.GetName() << SLogger::endmsg;
-    int binx = thisHist_veto.GetXaxis()->FindBin(pt);
-    int biny = thisHist_veto.GetYaxis()->FindBin(eta);
-    m_logger << DEBUG << "binx = " << binx << " biny = " << biny << SLogger::endmsg;
-    m_logger << DEBUG << "maxx = " << thisHist_veto.GetNbinsX() << " maxy = " << thisHist_veto.GetNbinsY() << SLogger::endmsg;
-    // implement check for overflow
-    eff = thisHist_veto.GetBinContent(binx, biny);
-    m_logger << DEBUG << "For "<< jetCategory << " with pt = " << pt << ", eta = " << eta << ", flavour = " << flavour << " returning efficiency =" << eff << SLogger::endmsg;
+  return getEfficiency(pt, eta, BTaggingScaleFactors::effFlavour(flavour), jetCategory);
+
+}
+
+
+double BTaggingScaleTool::getEfficiency( const double& pt, const double& eta, EffFlavour flavour, const JetCategory& jetCategory ) {
  
-  }
+  BTAG_DEBUG_SCOPE;
+  const double eff = m_channels[CHANNEL_MAIN].scaleFactors.efficiency(jetCategory.index(), flavour, pt, eta);
+  BTAG_REPORT_DEBUG( "For category " << jetCategory.index() << " with pt = " << pt << ", eta = " << eta << ", flavour = " << m_flavours[flavour] << " returning efficiency =" << eff );
+
   return eff;
-  
-}
 
+}
 
 
-TString BTaggingScaleTool::flavourToString( const int& flavour ) {
+const TString& BTaggingScaleTool::flavourToString( const int& flavour ) {
   
-  TString flavourString = "udsg";
+  // 5 is b, 4 is c, everything else udsg, as the efficiency maps
+  static const TString flavourStrings[BTaggingScaleFactors::N_EFF_FLAVOURS] = {"b", "c", "udsg"};
   
-  if (flavour == 5) {
-    flavourString = "b";
-  }
-  else if (flavour == 4) {
-    flavourString = "c";
-  }
-  // else if (flavour == 15) {
-  //   flavourString = "c"; // Use C scale factors for tau for now.
-  // }
-  
-  return flavourString;
+  return flavourStrings[BTaggingScaleFactors::effFlavour(flavour)];
   
 }
 
 
 bool BTaggingScaleTool::isTagged( const UZH::Jet& jet ) {
   
-  if (jet.csv() > currentWorkingPointCut) {
-    return true;  
-  }
-  return false;
+  return isTagged(jet.csv());
   
 }
 
 
 bool BTaggingScaleTool::isTagged( const double& csv ) {
   
-  if (csv > currentWorkingPointCut) {
-    return true;  
-  }
-  return false;
+  return m_channels[CHANNEL_MAIN].scaleFactors.isTagged(csv);
   
 }
 
 
 bool BTaggingScaleTool::isTagged_veto(  const UZH::Jet& jet  ) {
   
-  if (jet.csv() > currentWorkingPointCut_veto) {
-    //std::cout << " jet.csv() " <<jet.csv() << " > currentWorkingPointCut_veto " << currentWorkingPointCut_veto << std::endl;
-    return true;  
-  }
-  return false;
+  return isTagged_veto(jet.csv());
   
 }
 bool BTaggingScaleTool::isTagged_veto( const double& csv ) {
   
-  if (csv > currentWorkingPointCut_veto) {
-    //std::cout << " csv " <<csv << " > currentWorkingPointCut_veto " << currentWorkingPointCut_veto << std::endl;
-    return true;  
-  }
-  return false;
+  return m_channels[CHANNEL_VETO].scaleFactors.isTagged(csv);
   
 }
+
+
+bool BTaggingScaleTool::isTaggedChannel( const double& csv, const size_t& channel ) const {
+
+  return m_channels.at(N_FIXED_CHANNELS + channel).scaleFactors.isTagged(csv);
+
+}
@@ -0,0 +1,52 @@
+#ifndef __BTAGGINGTESTJETS_H__
+#define __BTAGGINGTESTJETS_H__
+
+//
+// Synthetic, reproducible jets for the tests and benchmarks of this package, as structure of
+// arrays. BTaggingTestUZHJets.h makes UZH::Jet objects of them for the programs using SFrame.
+//
+
+// STL include(s):
+#include <random>
+#include <vector>
+
+#include "include/BTaggingScaleFactors.h"
+
+namespace BTaggingTest {
+
+  /// synthetic jets, as structure of arrays
+  struct JetSample {
+    std::vector<float> pt;
+    std::vector<float> eta;
+    std::vector<float> csv;
+    std::vector<int> hadronFlavour;
+    std::vector<BTagEntry::JetFlavor> flavor;
+  };
+
+  /// falling pt spectrum (including jets outside the calibrated range), 20% b, 10% c, 70% udsg,
+  /// 5% of the jets with the discriminator -10 of jets without tracks
+  inline JetSample makeJets( size_t n, unsigned seed ) {
+    std::mt19937 rng( seed );
+    std::exponential_distribution<float> ptDist( 1. / 80. );
+    std::uniform_real_distribution<float> etaDist( -2.6, 2.6 );
+    std::uniform_real_distribution<float> unit( 0., 1. );
+    JetSample jets;
+    for (size_t i = 0; i < n; ++i) {
+      const float f = unit( rng );
+      const int flavour = f < 0.2 ? 5 : (f < 0.3 ? 4 : 0);
+      float csv = unit( rng );
+      if (flavour == 5) csv = 1. - csv * csv;
+      if (flavour == 0) csv = csv * csv;
+      if (unit( rng ) < 0.05) csv = -10.;
+      jets.pt.push_back( 15. + ptDist( rng ) );
+      jets.eta.push_back( etaDist( rng ) );
+      jets.csv.push_back( csv );
+      jets.hadronFlavour.push_back( flavour );
+      jets.flavor.push_back( BTaggingScaleFactors::jetFlavor( flavour ) );
+    }
+    return jets;
+  }
+
+} // namespace BTaggingTest
+
+#endif //  __BTAGGINGTESTJETS_H__
@@ -0,0 +1,87 @@
+#ifndef __BTAGGINGTESTUZHJETS_H__
+#define __BTAGGINGTESTUZHJETS_H__
+
+//
+// UZH::Jet objects made of the synthetic jets of BTaggingTestJets.h, for the tests and
+// benchmarks of BTaggingScaleTool. UZH::Jet reads its values through pointers into the
+// ntuple; here they point into vectors owned by UZHJetSample.
+//
+
+// STL include(s):
+#include <type_traits>
+#include <vector>
+
+#include "../NtupleVariables/include/Jet.h"
+
+#include "test/BTaggingTestJets.h"
+
+namespace BTaggingTest {
+
+  /// jets of a JetSample as UZH::Jet: jet i is sample jet i, with the sample jets nJets + i * nSubjets
+  /// to nJets + (i + 1) * nSubjets - 1 as its softdrop subjets
+  class UZHJetSample {
+  public:
+    UZHJetSample( const JetSample& sample, size_t nJets, size_t nSubjets ):
+      m_pt( nJets ), m_eta( nJets ), m_csv( nJets ), m_hadronFlavour( nJets ), m_subjet_N( nJets ),
+      m_subjet_pt( nJets ), m_subjet_eta( nJets ), m_subjet_csv( nJets ), m_subjet_hadronFlavour( nJets ),
+      m_jets( nJets ) {
+      for (size_t i = 0; i < nJets; ++i) {
+        m_pt[i] = sample.pt.at( i );
+        m_eta[i] = sample.eta[i];
+        m_csv[i] = sample.csv[i];
+        m_hadronFlavour[i] = sample.hadronFlavour[i];
+        m_subjet_N[i] = nSubjets;
+        for (size_t k = nJets + i * nSubjets; k < nJets + (i + 1) * nSubjets; ++k) {
+          m_subjet_pt[i].push_back( sample.pt.at( k ) );
+          m_subjet_eta[i].push_back( sample.eta[k] );
+          m_subjet_csv[i].push_back( sample.csv[k] );
+          m_subjet_hadronFlavour[i].push_back( sample.hadronFlavour[k] );
+        }
+        // the vectors are not resized any more, so that the pointers stay valid
+        UZH::Jet& jet = m_jets[i];
+        jet.m_pt = &m_pt[i];
+        jet.m_eta = &m_eta[i];
+        jet.m_csv = &m_csv[i];
+        jet.m_hadronFlavour = &m_hadronFlavour[i];
+        jet.m_subjet_softdrop_N = &m_subjet_N[i];
+        jet.m_subjet_softdrop_pt = &m_subjet_pt[i];
+        jet.m_subjet_softdrop_eta = &m_subjet_eta[i];
+        jet.m_subjet_softdrop_csv = &m_subjet_csv[i];
+        jet.m_subjet_softdrop_hadronFlavour = &m_subjet_hadronFlavour[i];
+      }
+    }
+
+    const UZH::JetVec& jets() const { return m_jets; }
+
+    /// events of nPerEvent consecutive jets
+    std::vector<UZH::JetVec> events( size_t nPerEvent ) const {
+      std::vector<UZH::JetVec> result;
+      for (size_t i = 0; i + nPerEvent <= m_jets.size(); i += nPerEvent) {
+        result.push_back( UZH::JetVec( m_jets.begin() + i, m_jets.begin() + i + nPerEvent ) );
+      }
+      return result;
+    }
+
+  private:
+    UZHJetSample( const UZHJetSample& );
+    UZHJetSample& operator=( const UZHJetSample& );
+
+    // storage of the ntuple variables, of the types the jets point to
+    template <class Pointer> struct Values {
+      typedef std::vector<typename std::remove_pointer<Pointer>::type> type;
+    };
+    Values<decltype( UZH::Jet::m_pt )>::type m_pt;
+    Values<decltype( UZH::Jet::m_eta )>::type m_eta;
+    Values<decltype( UZH::Jet::m_csv )>::type m_csv;
+    Values<decltype( UZH::Jet::m_hadronFlavour )>::type m_hadronFlavour;
+    Values<decltype( UZH::Jet::m_subjet_softdrop_N )>::type m_subjet_N;
+    Values<decltype( UZH::Jet::m_subjet_softdrop_pt )>::type m_subjet_pt;
+    Values<decltype( UZH::Jet::m_subjet_softdrop_eta )>::type m_subjet_eta;
+    Values<decltype( UZH::Jet::m_subjet_softdrop_csv )>::type m_subjet_csv;
+    Values<decltype( UZH::Jet::m_subjet_softdrop_hadronFlavour )>::type m_subjet_hadronFlavour;
+    UZH::JetVec m_jets;
+  };
+
+} // namespace BTaggingTest
+
+#endif //  __BTAGGINGTESTUZHJETS_H__
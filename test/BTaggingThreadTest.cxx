@@ -0,0 +1,277 @@
+//
+// BTaggingThreadTest
+//
+// Stress test of the thread safety of the core library: shared instances of
+// BTagCalibration (LOAD_ON_DEMAND, from BTagCalibrationRegistry), BTagCalibrationReader (with
+// compiled and with TF1 formulas), BTaggingScaleFactors and BTaggingEventWeights are used by
+// several threads at once, and every result must be identical to the one of a single thread.
+// Also checks that addEntry() refuses to change a calibration that getEntries() is reading.
+//
+// usage: BTaggingThreadTest [nThreads] [nJets] [nRepeats] [csvFile]
+//
+// Returns 0 if all results agree, 1 otherwise. Run from the package directory, or give the
+// path of csv/CSVv2_Moriond17_B_H.csv.
+//
+
+// STL include(s):
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ROOT include(s):
+#include <TH2.h>
+
+#include "include/BTagCalibrationStandalone.h"
+#include "include/BTaggingEventWeight.h"
+#include "include/BTaggingScaleFactors.h"
+#include "test/BTaggingTestJets.h"
+
+namespace {
+
+  using BTaggingTest::JetSample;
+  using BTaggingTest::makeJets;
+
+  const size_t kJetsPerEvent = 4;
+  const int kValuesPerJet = 12;
+
+  /// the shared instances under test
+  struct Shared {
+    std::shared_ptr<const BTagCalibration> calibOnDemand;
+    std::shared_ptr<const BTagCalibrationReader> reader;
+    std::shared_ptr<const BTagCalibrationReader> readerTF1;
+    std::shared_ptr<const BTaggingScaleFactors> scaleFactors;
+  };
+
+  /// results of all queries, [jet * kValuesPerJet + value] and one event weight per event
+  struct Results {
+    std::vector<double> jets;
+    std::vector<double> events;
+  };
+
+  /// loads a reader from the shared on-demand calibration, so that the csv lines are parsed
+  /// while other threads do the same
+  void loadReader( BTagCalibrationReader& reader, const BTagCalibration& calib ) {
+    reader.load( calib, BTagEntry::FLAV_B, "mujets" );
+    reader.load( calib, BTagEntry::FLAV_C, "mujets" );
+    reader.load( calib, BTagEntry::FLAV_UDSG, "incl" );
+  }
+
+  /// all queries; first is the jet to start with, so that the threads are not in step
+  void evaluate( const Shared& shared, const JetSample& jets, size_t first, Results& results ) {
+    const size_t nJets = jets.pt.size();
+    results.jets.assign( nJets * kValuesPerJet, 0. );
+    results.events.assign( nJets / kJetsPerEvent, 0. );
+
+    // operating points loaded here, in another order in each thread
+    const BTagEntry::OperatingPoint ops[] = { BTagEntry::OP_LOOSE, BTagEntry::OP_MEDIUM, BTagEntry::OP_TIGHT };
+    std::unique_ptr<BTagCalibrationReader> readers[3];
+    for (int i = 0; i < 3; ++i) {
+      const int op = (first + i) % 3;
+      readers[op].reset( new BTagCalibrationReader( ops[op], "central" ) );
+      loadReader( *readers[op], *shared.calibOnDemand );
+    }
+
+    const BTaggingScaleFactors& sf = *shared.scaleFactors;
+    std::vector<double> batch( nJets );
+    shared.reader->eval_batch( nJets, &jets.flavor[0], &jets.eta[0], &jets.pt[0], 0, &batch[0] );
+
+    for (size_t k = 0; k < nJets; ++k) {
+      const size_t i = (first + k) % nJets;
+      double* out = &results.jets[i * kValuesPerJet];
+      out[0] = shared.reader->eval( jets.flavor[i], jets.eta[i], jets.pt[i] );
+      shared.reader->eval_all( jets.flavor[i], jets.eta[i], jets.pt[i], 0., out + 1 );
+      out[4] = batch[i];
+      out[5] = shared.readerTF1->eval( jets.flavor[i], jets.eta[i], jets.pt[i] );
+      shared.readerTF1->eval_all( jets.flavor[i], jets.eta[i], jets.pt[i], 0., out + 6 );
+      out[9] = sf.getJetWeight( jets.pt[i], jets.eta[i], jets.hadronFlavour[i], sf.isTagged( jets.csv[i] ), 0., 0., 0 );
+      out[10] = sf.getJetWeight( jets.pt[i], jets.eta[i], jets.hadronFlavour[i], sf.isTagged( jets.csv[i] ), 1., -1., 0 );
+      out[11] = 0.;
+      for (int r = 0; r < 3; ++r) {
+        out[11] += readers[r]->eval( jets.flavor[i], jets.eta[i], jets.pt[i] ) * (1 << r);
+      }
+    }
+
+    BTaggingEventWeights eventWeights( shared.scaleFactors );
+    const size_t nEvents = results.events.size();
+    for (size_t k = 0; k < nEvents; ++k) {
+      const size_t e = (first + k) % nEvents;
+      const size_t begin = e * kJetsPerEvent, end = begin + kJetsPerEvent;
+      BTaggingEventWeights::Floats pt( jets.pt.begin() + begin, jets.pt.begin() + end );
+      BTaggingEventWeights::Floats eta( jets.eta.begin() + begin, jets.eta.begin() + end );
+      BTaggingEventWeights::Floats csv( jets.csv.begin() + begin, jets.csv.begin() + end );
+      BTaggingEventWeights::Ints flavour( jets.hadronFlavour.begin() + begin, jets.hadronFlavour.begin() + end );
+      const BTaggingScaleFactors::Weights w = eventWeights( pt, eta, csv, flavour );
+      results.events[e] = w.nominal + 2. * w.bc_up + 3. * w.bc_down + 4. * w.udsg_up + 5. * w.udsg_down;
+    }
+  }
+
+  /// number of values that differ bitwise
+  size_t compare( const std::vector<double>& a, const std::vector<double>& b ) {
+    size_t nDiff = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+      if (std::memcmp( &a[i], &b[i], sizeof( double ) )) ++nDiff;
+    }
+    return nDiff;
+  }
+
+  /// calibration whose formulas BTagFormula does not understand ('^'), evaluated by TF1
+  std::shared_ptr<const BTagCalibration> makeTF1Calibration() {
+    std::shared_ptr<BTagCalibration> calib = std::make_shared<BTagCalibration>( "CSVv2" );
+    calib->readCSV( "CSVv2;OperatingPoint, measurementType, sysType, jetFlavor, etaMin, etaMax, ptMin, ptMax, discrMin, discrMax, formula\n"
+                    "1, comb, central, 0, -2.4, 2.4, 20, 1000, 0, 1, \"0.9+0.002*x^0.5\"\n"
+                    "1, comb, up, 0, -2.4, 2.4, 20, 1000, 0, 1, \"0.95+0.002*x^0.5\"\n"
+                    "1, comb, down, 0, -2.4, 2.4, 20, 1000, 0, 1, \"0.85+0.002*x^0.5\"\n"
+                    "1, comb, central, 1, -2.4, 2.4, 20, 1000, 0, 1, \"0.9+0.001*x^0.6\"\n"
+                    "1, comb, up, 1, -2.4, 2.4, 20, 1000, 0, 1, \"0.95+0.001*x^0.6\"\n"
+                    "1, comb, down, 1, -2.4, 2.4, 20, 1000, 0, 1, \"0.85+0.001*x^0.6\"\n"
+                    "1, comb, central, 2, -2.4, 2.4, 20, 1000, 0, 1, \"1.1-0.001*x^0.5\"\n"
+                    "1, comb, up, 2, -2.4, 2.4, 20, 1000, 0, 1, \"1.2-0.001*x^0.5\"\n"
+                    "1, comb, down, 2, -2.4, 2.4, 20, 1000, 0, 1, \"1.0-0.001*x^0.5\"\n" );
+    return calib;
+  }
+
+  /// efficiency map with values between 0.1 and 0.9, different per flavour
+  void setEfficiencies( BTaggingScaleFactors& sf ) {
+    const int nPtBins = 11;
+    const int nEtaBins = 4;
+    const float ptBins[nPtBins+1] = {10, 20, 30, 50, 70, 100, 140, 200, 300, 670, 1000, 1500};
+    const float etaBins[nEtaBins+1] = {-2.5, -1.5, 0, 1.5, 2.5};
+    for (int f = 0; f < BTaggingScaleFactors::N_EFF_FLAVOURS; ++f) {
+      TH2F hPass( "hPass", "hPass", nPtBins, ptBins, nEtaBins, etaBins );
+      TH2F hAll( "hAll", "hAll", nPtBins, ptBins, nEtaBins, etaBins );
+      for (int x = 1; x <= nPtBins; ++x) {
+        for (int y = 1; y <= nEtaBins; ++y) {
+          hPass.SetBinContent( x, y, 10. + 10. * ((x + y + f) % 9) );
+          hAll.SetBinContent( x, y, 100. );
+        }
+      }
+      sf.setEfficiency( 0, BTaggingScaleFactors::EffFlavour( f ), hPass, hAll );
+    }
+  }
+
+  /// getEntries() in one thread while another one calls addEntry(): once a reference has
+  /// been handed out, every addEntry() must throw and the referenced entries must not move
+  size_t checkAddEntryWhileShared( const std::string& csvFile ) {
+    BTagCalibration calib( "CSVv2", csvFile, BTagCalibration::LOAD_ON_DEMAND );
+    const BTagEntry::Parameters params( BTagEntry::OP_MEDIUM, "mujets", "central" );
+    const BTagEntry extra( "0.9", BTagEntry::Parameters( BTagEntry::OP_MEDIUM, "mujets", "central",
+                                                        BTagEntry::FLAV_B, 2.4, 2.5, 20., 1000. ) );
+    const std::vector<BTagEntry>& entries = calib.getEntries( params );
+    const BTagEntry* const first = &entries[0];
+    const size_t nEntries = entries.size();
+
+    std::atomic<size_t> nAdded( 0 );
+    std::atomic<bool> done( false );
+    std::thread writer( [&]() {
+      for (int i = 0; i < 50; ++i) {
+        try {
+          calib.addEntry( extra );
+          ++nAdded;
+        }
+        catch (const std::exception&) {}
+      }
+      done = true;
+    } );
+    size_t nDiff = 0;
+    while (!done) {
+      const std::vector<BTagEntry>& again = calib.getEntries( params );
+      if (&again != &entries || &again[0] != first || again.size() != nEntries) ++nDiff;
+    }
+    writer.join();
+    if (nAdded) {
+      std::fprintf( stderr, "ERROR: addEntry() succeeded %lu times on a shared calibration\n", (unsigned long) nAdded );
+    }
+    return nDiff + nAdded;
+  }
+
+} // namespace
+
+
+int main( int argc, char** argv ) {
+
+  const unsigned nThreads = argc > 1 ? std::strtoul( argv[1], 0, 10 ) : 8;
+  const size_t nJets = argc > 2 ? std::strtoul( argv[2], 0, 10 ) / kJetsPerEvent * kJetsPerEvent : 100000;
+  const unsigned nRepeats = argc > 3 ? std::strtoul( argv[3], 0, 10 ) : 5;
+  const std::string csvFile = argc > 4 ? argv[4] : "csv/CSVv2_Moriond17_B_H.csv";
+  TH1::AddDirectory( kFALSE );
+
+  const JetSample jets = makeJets( nJets, 12345 );
+  const std::vector<std::string> otherSysTypes = {"up", "down"};
+
+  // reference: everything made and evaluated by one thread, from a fully parsed calibration
+  Shared reference;
+  reference.calibOnDemand = std::make_shared<BTagCalibration>( "CSVv2", csvFile );
+  std::shared_ptr<BTagCalibrationReader> reader = std::make_shared<BTagCalibrationReader>( BTagEntry::OP_MEDIUM, "central", otherSysTypes );
+  loadReader( *reader, *reference.calibOnDemand );
+  reference.reader = reader;
+  const std::shared_ptr<const BTagCalibration> calibTF1 = makeTF1Calibration();
+  std::shared_ptr<BTagCalibrationReader> readerTF1 = std::make_shared<BTagCalibrationReader>( BTagEntry::OP_MEDIUM, "central", otherSysTypes );
+  readerTF1->load( *calibTF1, BTagEntry::FLAV_B, "comb" );
+  readerTF1->load( *calibTF1, BTagEntry::FLAV_C, "comb" );
+  readerTF1->load( *calibTF1, BTagEntry::FLAV_UDSG, "comb" );
+  if (readerTF1->lockFree()) {
+    std::fprintf( stderr, "ERROR: the TF1 reader does not use TF1\n" );
+    return 1;
+  }
+  reference.readerTF1 = readerTF1;
+  std::shared_ptr<BTaggingScaleFactors> scaleFactors = std::make_shared<BTaggingScaleFactors>();
+  scaleFactors->setReader( reference.reader, 0.8484 );
+  setEfficiencies( *scaleFactors );
+  reference.scaleFactors = scaleFactors;
+
+  Results expected;
+  evaluate( reference, jets, 0, expected );
+
+  size_t nFailed = 0;
+  for (unsigned repeat = 0; repeat < nRepeats; ++repeat) {
+    // shared: an on-demand calibration from the registry, parsed by all threads at once
+    Shared shared = reference;
+    shared.calibOnDemand = BTagCalibrationRegistry::calibration( "CSVv2", csvFile, BTagCalibration::LOAD_ON_DEMAND );
+    shared.reader = BTagCalibrationRegistry::reader( "CSVv2", csvFile, BTagEntry::OP_MEDIUM, "mujets", "incl",
+                                                     "central", otherSysTypes, 0., BTagCalibration::LOAD_ON_DEMAND );
+    std::shared_ptr<BTaggingScaleFactors> sharedScaleFactors = std::make_shared<BTaggingScaleFactors>();
+    sharedScaleFactors->setReader( shared.reader, 0.8484 );
+    setEfficiencies( *sharedScaleFactors );
+    shared.scaleFactors = sharedScaleFactors;
+
+    std::vector<Results> results( nThreads );
+    std::atomic<size_t> nErrors( 0 );
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nThreads; ++t) {
+      threads.push_back( std::thread( [&, t]() {
+        try {
+          evaluate( shared, jets, t * nJets / nThreads, results[t] );
+        }
+        catch (const std::exception& e) {
+          std::fprintf( stderr, "ERROR in thread %u: %s\n", t, e.what() );
+          ++nErrors;
+        }
+      } ) );
+    }
+    for (size_t t = 0; t < threads.size(); ++t) {
+      threads[t].join();
+    }
+
+    size_t nDiff = nErrors;
+    for (unsigned t = 0; t < nThreads && !nErrors; ++t) {
+      nDiff += compare( expected.jets, results[t].jets ) + compare( expected.events, results[t].events );
+    }
+    std::printf( "repeat %u: %u threads, %lu jets, %lu differences\n", repeat, nThreads, (unsigned long) nJets, (unsigned long) nDiff );
+    if (nDiff) ++nFailed;
+  }
+
+  const size_t nAddDiff = checkAddEntryWhileShared( csvFile );
+  std::printf( "addEntry while shared: %lu differences\n", (unsigned long) nAddDiff );
+  if (nAddDiff) ++nFailed;
+
+  std::printf( nFailed ? "FAILED\n" : "OK\n" );
+  return nFailed ? 1 : 0;
+
+}
@@ -0,0 +1,255 @@
+//
+// BTaggingToolTest
+//
+// Tests of BTaggingScaleTool configured through its properties, as by the cycle's XML file:
+// the discriminator reshaping (WorkingPoint "Reshaping") of the main and the veto
+// configuration against BTaggingReshapingWeights with a reader of its own, and the SErrors of
+// the configurations and calls it does not support.
+//
+// usage: BTaggingToolTest [nJets]
+//
+// Returns 0 if all checks pass, 1 otherwise. Needs SFRAME_DIR, as the tool, and finds the csv
+// files of this package in $SFRAME_DIR/../BTaggingTools/csv.
+//
+
+// STL include(s):
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// ROOT include(s):
+#include <TList.h>
+
+// SFrame include(s):
+#include "core/include/SCycleBase.h"
+#include "core/include/SInputData.h"
+
+#include "include/BTagCalibrationStandalone.h"
+#include "include/BTaggingScaleFactors.h"
+#include "include/BTaggingScaleTool.h"
+#include "test/BTaggingTestUZHJets.h"
+
+namespace {
+
+  typedef std::vector<std::pair<std::string, std::string> > Properties;
+
+  /// cycle without event loop, setting the properties of its tools as SFrame does with the
+  /// UserConfig of the XML file
+  class ToolTestCycle : public SCycleBase {
+  public:
+    ToolTestCycle() { SetHistOutput( &m_output ); }
+    void configure( const Properties& properties ) {
+      SCycleConfig config = GetConfig();
+      for (size_t i = 0; i < properties.size(); ++i) {
+        config.SetProperty( properties[i].first, properties[i].second );
+      }
+      SetConfig( config );
+      ReadProperties();
+    }
+    virtual void BeginCycle() throw( SError ) {}
+    virtual void EndCycle() throw( SError ) {}
+    virtual void BeginInputData( const SInputData& ) throw( SError ) {}
+    virtual void EndInputData( const SInputData& ) throw( SError ) {}
+    virtual void BeginMasterInputData( const SInputData& ) throw( SError ) {}
+    virtual void EndMasterInputData( const SInputData& ) throw( SError ) {}
+    virtual void BeginInputFile( const SInputData& ) throw( SError ) {}
+    virtual void ExecuteEvent( const SInputData&, Double_t ) throw( SError ) {}
+  private:
+    TList m_output;
+  };
+
+  size_t g_nFailed = 0;
+
+  void check( bool ok, const std::string& what ) {
+    if (!ok) {
+      std::fprintf( stderr, "FAILED: %s\n", what.c_str() );
+      ++g_nFailed;
+    }
+  }
+
+  /// the message of the SError thrown by call, "" if there is none
+  template <class Call> std::string errorOf( Call call ) {
+    try {
+      call();
+    }
+    catch (const SError& e) {
+      return e.what();
+    }
+    return "";
+  }
+
+  void checkError( const std::string& error, const std::string& expected, const std::string& what ) {
+    check( error.find( expected ) != std::string::npos, what + ": expected an SError with \"" + expected + "\", got \"" + error + "\"" );
+  }
+
+  /// reshaping weights made directly, from a reader of their own
+  BTaggingReshapingWeights reshapingWeights( const std::string& csvFile, const std::vector<std::string>& sysTypes ) {
+    const BTagCalibration calib( "CSVv2", csvFile );
+    std::shared_ptr<BTagCalibrationReader> reader = std::make_shared<BTagCalibrationReader>( BTagEntry::OP_RESHAPING, "central", sysTypes );
+    reader->load( calib, BTagEntry::FLAV_B, "iterativefit" );
+    reader->load( calib, BTagEntry::FLAV_C, "iterativefit" );
+    reader->load( calib, BTagEntry::FLAV_UDSG, "iterativefit" );
+    BTaggingReshapingWeights weights;
+    weights.setReader( reader );
+    return weights;
+  }
+
+  /// event weights of BTaggingReshapingWeights, as getReshapingWeights computes them
+  std::vector<double> expectedWeights( const BTaggingReshapingWeights& reshaping, const UZH::JetVec& event ) {
+    std::vector<double> weights( reshaping.nWeights(), 1. );
+    std::vector<double> sf( reshaping.nWeights() );
+    for (size_t i = 0; i < event.size(); ++i) {
+      reshaping.multiplyJetWeights( &weights[0], &sf[0], event[i].pt(), event[i].eta(), event[i].hadronFlavour(), event[i].csv() );
+    }
+    return weights;
+  }
+
+  /// main and veto configuration with WorkingPoint "Reshaping": the weights of the tool are
+  /// those of BTaggingReshapingWeights, the fixed-cut functions throw
+  void testReshaping( const std::string& csvDir, size_t nJets ) {
+    const std::string csvFile = csvDir + "CSVv2_Moriond17_B_H.csv";
+    ToolTestCycle cycle;
+    BTaggingScaleTool tool( &cycle );
+    cycle.configure( { { "BTaggingScaleTool_WorkingPoint", "Reshaping" },
+                       { "BTaggingScaleTool_CsvFile", csvFile },
+                       { "BTaggingScaleTool_WorkingPoint_veto", "Reshaping" },
+                       { "BTaggingScaleTool_CsvFile_veto", csvFile },
+                       { "BTaggingScaleTool_ReshapingSysTypes", "up_jes down_jes up_hf down_hf up_lf down_lf" } } );
+    const SInputData id( "Reshaping" );
+    tool.BeginInputData( id );
+
+    const std::vector<std::string>& sysTypes = tool.getReshapingSysTypes();
+    check( sysTypes.size() == 6 && sysTypes[4] == "up_lf", "ReshapingSysTypes property" );
+    const BTaggingReshapingWeights reference = reshapingWeights( csvFile, sysTypes );
+
+    const BTaggingTest::JetSample sample = BTaggingTest::makeJets( nJets, 12345 );
+    const BTaggingTest::UZHJetSample jets( sample, nJets, 0 );
+    const std::vector<UZH::JetVec> events = jets.events( 4 );
+    size_t nDiff = 0, nVaried = 0;
+    std::vector<double> weights, weights_veto;
+    for (size_t e = 0; e < events.size(); ++e) {
+      const std::vector<double> expected = expectedWeights( reference, events[e] );
+      tool.getReshapingWeights( events[e], weights );
+      tool.getReshapingWeights_veto( events[e], weights_veto );
+      if (weights != expected || weights_veto != expected) ++nDiff;
+      if (expected[1] != expected[0]) ++nVaried;
+    }
+    check( nDiff == 0, "getReshapingWeights and getReshapingWeights_veto differ from BTaggingReshapingWeights in "
+                       + std::to_string( nDiff ) + " events" );
+    check( nVaried > 0, "no event with a jes variation" );
+    check( weights.size() == sysTypes.size() + 1, "one weight per systematic and the central one" );
+
+    checkError( errorOf( [&]() { tool.getScaleFactor( 50., 1., 5, true ); } ), "getReshapingWeights", "getScaleFactor with Reshaping" );
+    checkError( errorOf( [&]() { tool.getScaleFactors( events[0] ); } ), "getReshapingWeights", "getScaleFactors with Reshaping" );
+    checkError( errorOf( [&]() { tool.getSoftdropSubjetScaleFactor( events[0] ); } ), "getReshapingWeights",
+                "getSoftdropSubjetScaleFactor with Reshaping" );
+    checkError( errorOf( [&]() { tool.getScaleFactor_veto( events[0] ); } ), "getReshapingWeights_veto", "getScaleFactor_veto with Reshaping" );
+  }
+
+  /// a systematic without scale factor where the central one has one is an error, a systematic
+  /// without entries for the jet's flavour takes the central value
+  void testZeroScaleFactor() {
+    const std::string csvFile = "BTaggingToolTest_zero.csv";
+    {
+      std::ofstream csv( csvFile.c_str() );
+      csv << "CSVv2;OperatingPoint, measurementType, sysType, jetFlavor, etaMin, etaMax, ptMin, ptMax, discrMin, discrMax, formula \n"
+          << "3, iterativefit, central, 0, 0.0, 2.4, 20, 1000, -15, 1.1, \"1.1\" \n"
+          << "3, iterativefit, up_jes, 0, 0.0, 2.4, 20, 1000, -15, 0.5, \"1.2\" \n"
+          << "3, iterativefit, central, 1, 0.0, 2.4, 20, 1000, -15, 1.1, \"0.9\" \n"
+          << "3, iterativefit, central, 2, 0.0, 2.4, 20, 1000, -15, 1.1, \"1.0\" \n";
+    }
+    ToolTestCycle cycle;
+    BTaggingScaleTool tool( &cycle );
+    cycle.configure( { { "BTaggingScaleTool_WorkingPoint", "Reshaping" },
+                       { "BTaggingScaleTool_CsvFile", csvFile },
+                       { "BTaggingScaleTool_WorkingPoint_veto", "Reshaping" },
+                       { "BTaggingScaleTool_CsvFile_veto", csvFile },
+                       { "BTaggingScaleTool_ReshapingSysTypes", "up_jes" } } );
+    const SInputData id( "ZeroScaleFactor" );
+    tool.BeginInputData( id );
+    std::remove( csvFile.c_str() );
+
+    //                                     b jet      c jet      b jet without up_jes
+    BTaggingTest::JetSample sample;
+    sample.pt = { 50., 50., 50. };
+    sample.eta = { 1., 1., 1. };
+    sample.csv = { 0.3, 0.9, 0.9 };
+    sample.hadronFlavour = { 5, 4, 5 };
+    const BTaggingTest::UZHJetSample jets( sample, 3, 0 );
+    const std::vector<UZH::JetVec> covered( 1, UZH::JetVec( jets.jets().begin(), jets.jets().begin() + 2 ) );
+    std::vector<double> weights;
+    tool.getReshapingWeights( covered[0], weights );
+    check( weights.size() == 2 && std::fabs( weights[0] - 1.1 * 0.9 ) < 1e-12 && std::fabs( weights[1] - 1.2 * 0.9 ) < 1e-12,
+           "reshaping weights of a b jet with and a c jet without up_jes" );
+    checkError( errorOf( [&]() { tool.getReshapingWeights( jets.jets(), weights ); } ), "Scale factor returned is zero!",
+                "zero up_jes scale factor" );
+  }
+
+  /// configurations that cannot be used with Reshaping, or at all
+  void testConfigurationErrors( const std::string& csvDir ) {
+    const std::string csvFile = csvDir + "CSVv2_Moriond17_B_H.csv";
+    const std::string subjetCsvFile = csvDir + "subjet_CSVv2_Moriond17_B_H.csv";
+    const SInputData id( "Errors" );
+    const Properties reshaping = { { "BTaggingScaleTool_WorkingPoint", "Reshaping" },
+                                   { "BTaggingScaleTool_CsvFile", csvFile },
+                                   { "BTaggingScaleTool_WorkingPoint_veto", "Reshaping" },
+                                   { "BTaggingScaleTool_CsvFile_veto", csvFile } };
+    struct Case {
+      Properties properties;
+      std::string expected;
+      std::string what;
+    };
+    const Case cases[] = {
+      { { { "BTaggingScaleTool_MultiWorkingPoints", "Loose Medium" } }, "MultiWorkingPoints", "MultiWorkingPoints with Reshaping" },
+      { { { "BTaggingScaleTool_Channels", "ak4" }, { "BTaggingScaleTool_Channel_WorkingPoints", "Reshaping" } }, "Channel ak4",
+        "Reshaping channel" },
+      { { { "BTaggingScaleTool_CsvFile_veto", subjetCsvFile } }, "cannot read the Reshaping scale factors", "csv file without iterativefit" },
+      { { { "BTaggingScaleTool_CsvFile", csvDir + "missing.csv" } }, "missing.csv", "missing csv file" },
+    };
+    for (size_t i = 0; i < sizeof( cases ) / sizeof( cases[0] ); ++i) {
+      ToolTestCycle cycle;
+      BTaggingScaleTool tool( &cycle );
+      Properties properties = reshaping;
+      properties.insert( properties.end(), cases[i].properties.begin(), cases[i].properties.end() );
+      cycle.configure( properties );
+      checkError( errorOf( [&]() { tool.BeginInputData( id ); } ), cases[i].expected, cases[i].what );
+    }
+  }
+
+} // namespace
+
+
+int main( int argc, char** argv ) {
+
+  const size_t nJets = argc > 1 ? std::strtoul( argv[1], 0, 10 ) : 10000;
+  const char* sframe_dir = std::getenv( "SFRAME_DIR" );
+  if (!sframe_dir) {
+    std::fprintf( stderr, "SFRAME_DIR is not set\n" );
+    return 1;
+  }
+  const std::string csvDir = std::string( sframe_dir ) + "/../BTaggingTools/csv/";
+
+  try {
+    testReshaping( csvDir, nJets );
+    testZeroScaleFactor();
+    testConfigurationErrors( csvDir );
+  }
+  catch (const std::exception& e) {
+    std::fprintf( stderr, "FAILED: unexpected exception: %s\n", e.what() );
+    return 1;
+  }
+
+  if (g_nFailed) {
+    std::fprintf( stderr, "%zu checks failed\n", g_nFailed );
+    return 1;
+  }
+  std::printf( "OK\n" );
+  return 0;
+
+}